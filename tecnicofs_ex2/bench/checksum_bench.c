@@ -0,0 +1,95 @@
+#include "fs/crc32c.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*  Measures the cost of checksumming a data block (with the portable and
+    the SSE4.2 CRC32C) against writing and reading it back through the FS,
+    which computes one checksum on the write and checks it on the read.
+    Note: the simulated storage delay makes the FS side slow; with DELAY
+    set to 0 in config.h this compares against the bare memory accesses.
+    Usage: checksum_bench [rounds]
+*/
+
+#define DEFAULT_ROUNDS 20000
+
+static double elapsed(struct timespec const *start, struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Returns the nanoseconds per block */
+static double run_crc(uint32_t (*fn)(uint32_t, void const *, size_t),
+                      char const *data, long rounds) {
+    struct timespec start, end;
+    uint32_t crc = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < rounds; i++) {
+        crc ^= fn(crc, data, BLOCK_SIZE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    /* keep the loop from being optimized away */
+    if (crc == 1) {
+        printf(" ");
+    }
+    return elapsed(&start, &end) * 1e9 / (double)rounds;
+}
+
+/* Returns the nanoseconds per write and read of a full block */
+static double run_fs(char const *data, long rounds) {
+    char buffer[BLOCK_SIZE];
+    struct timespec start, end;
+
+    assert(tfs_init() != -1);
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < rounds; i++) {
+        int g = tfs_open("/f", TFS_O_TRUNC);
+        assert(g != -1);
+        assert(tfs_write(g, data, BLOCK_SIZE) == BLOCK_SIZE);
+        assert(tfs_close(g) != -1);
+        g = tfs_open("/f", 0);
+        assert(g != -1);
+        assert(tfs_read(g, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+        assert(tfs_close(g) != -1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+    return elapsed(&start, &end) * 1e9 / (double)rounds;
+}
+
+int main(int argc, char **argv) {
+    static char data[BLOCK_SIZE];
+    long rounds = argc > 1 ? atol(argv[1]) : DEFAULT_ROUNDS;
+    unsigned int seed = 1;
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)rand_r(&seed);
+    }
+
+    double portable = run_crc(crc32c_portable, data, rounds * 10);
+    double hw = run_crc(crc32c_hw, data, rounds * 10);
+    double fs = run_fs(data, rounds);
+    /* each round checksums the file's block, the directory's block (on
+     * the truncation, which changes the i-node) and i-node table blocks */
+    double used = crc32c_hw_available() ? hw : portable;
+
+    printf("CRC32C of a %d byte block\n", BLOCK_SIZE);
+    printf("  portable: %10.1f ns %10.1f MiB/s\n", portable,
+           BLOCK_SIZE / portable * 1e9 / (1024 * 1024));
+    printf("  sse4.2:   %10.1f ns %10.1f MiB/s%s\n", hw,
+           BLOCK_SIZE / hw * 1e9 / (1024 * 1024),
+           crc32c_hw_available() ? "" : " (not available, portable)");
+    printf("FS write + read of a block: %.1f ns\n", fs);
+    printf("  checksums (~5 blocks): %.2f%%\n", 5 * used / fs * 100);
+
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*  Compares plain and compressed files: how many bytes of text and of
+    random data each holds, and the write/read throughput for it.
+    Note: every block access includes the simulated storage delay, which
+    dominates unless DELAY is scaled down in config.h.
+    Usage: compression_bench [rounds]
+*/
+
+#define DEFAULT_ROUNDS 200
+
+static double elapsed(struct timespec const *start, struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Writes as much of data as fits, rounds times, then reads it back */
+static void run(char const *label, char const *data, bool compress,
+                long rounds) {
+    static char buffer[MAX_COMPRESSED_FILE_SIZE];
+    struct timespec start, end;
+    ssize_t stored = 0;
+    int flags = TFS_O_CREAT | TFS_O_TRUNC | (compress ? TFS_O_COMPRESS : 0);
+
+    assert(tfs_init() != -1);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < rounds; i++) {
+        int f = tfs_open("/f", flags);
+        assert(f != -1);
+        /* the largest size that fits, by halving */
+        size_t len = MAX_COMPRESSED_FILE_SIZE;
+        while ((stored = tfs_write(f, data, len)) == -1) {
+            len /= 2;
+            assert(tfs_close(f) != -1);
+            f = tfs_open("/f", flags);
+            assert(f != -1);
+        }
+        assert(tfs_close(f) != -1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double write_time = elapsed(&start, &end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < rounds; i++) {
+        int f = tfs_open("/f", 0);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == stored);
+        assert(tfs_close(f) != -1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double read_time = elapsed(&start, &end);
+
+    assert(memcmp(buffer, data, (size_t)stored) == 0);
+    assert(tfs_destroy() != -1);
+
+    printf("  %-6s %-10s %6zd bytes/file %10.2f MiB/s write %10.2f MiB/s "
+           "read\n",
+           label, compress ? "compressed" : "plain", stored,
+           (double)stored * (double)rounds / write_time / (1024 * 1024),
+           (double)stored * (double)rounds / read_time / (1024 * 1024));
+}
+
+int main(int argc, char **argv) {
+    static char text[MAX_COMPRESSED_FILE_SIZE];
+    static char noise[MAX_COMPRESSED_FILE_SIZE];
+    static char const words[] = "the quick brown fox jumps over the lazy dog ";
+    long rounds = argc > 1 ? atol(argv[1]) : DEFAULT_ROUNDS;
+    unsigned int seed = 1;
+
+    for (size_t i = 0; i < sizeof(text); i++) {
+        text[i] = words[i % (sizeof(words) - 1)];
+        noise[i] = (char)rand_r(&seed);
+    }
+
+    printf("single file capacity and throughput (%ld rounds)\n", rounds);
+    run("text", text, false, rounds);
+    run("text", text, true, rounds);
+    run("random", noise, false, rounds);
+    run("random", noise, true, rounds);
+
+    return 0;
+}
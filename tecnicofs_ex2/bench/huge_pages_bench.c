@@ -0,0 +1,68 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*  Compares the throughput of random 1 KiB reads from the data blocks with
+    and without huge pages backing them.
+    Note: every data_block_get includes the simulated storage delay, which
+    dominates unless DATA_BLOCKS is scaled up (or DELAY down) in config.h.
+    Usage: huge_pages_bench [reads]
+*/
+
+#define DEFAULT_READS 200000
+
+static double elapsed(struct timespec const *start, struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Returns the number of reads per second */
+static double run(bool huge_pages, long reads) {
+    static int blocks[DATA_BLOCKS];
+    char buffer[BLOCK_SIZE];
+    struct timespec start, end;
+    unsigned int seed = 1;
+    int n = 0, b;
+
+    tfs_params params = tfs_default_params();
+    params.huge_pages = huge_pages;
+    assert(tfs_init_with_params(&params) != -1);
+
+    /* take (and touch) every free block */
+    while ((b = data_block_alloc()) != -1) {
+        void *block = data_block_get(b);
+        assert(block != NULL);
+        memset(block, n, BLOCK_SIZE);
+        blocks[n++] = b;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < reads; i++) {
+        memcpy(buffer, data_block_get(blocks[rand_r(&seed) % n]),
+               BLOCK_SIZE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    assert(tfs_destroy() != -1);
+
+    return (double)reads / elapsed(&start, &end);
+}
+
+int main(int argc, char **argv) {
+    long reads = argc > 1 ? atol(argv[1]) : DEFAULT_READS;
+
+    double base = run(false, reads);
+    double huge = run(true, reads);
+
+    printf("random %d byte reads over %d blocks (%ld reads)\n", BLOCK_SIZE,
+           DATA_BLOCKS, reads);
+    printf("  regular pages: %12.0f reads/s %10.1f MiB/s\n", base,
+           base * BLOCK_SIZE / (1024 * 1024));
+    printf("  huge pages:    %12.0f reads/s %10.1f MiB/s\n", huge,
+           huge * BLOCK_SIZE / (1024 * 1024));
+    printf("  speedup:       %12.2fx\n", huge / base);
+
+    return 0;
+}
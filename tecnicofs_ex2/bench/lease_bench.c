@@ -0,0 +1,83 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*  Measures how long a client takes to reread (open, read and close) a
+    small file that nobody writes: with a lease, after the first open, the
+    file is read from the client's cache. Then compares reading it through
+    a handle on the server with reading it from a mapping (checking that
+    the mapping is still valid before each read).
+    Usage: lease_bench server_pipe [rounds]
+*/
+
+#define DEFAULT_ROUNDS 100000
+#define FILE_SIZE 512
+
+static double now_us() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e6 + (double)t.tv_nsec / 1e3;
+}
+
+int main(int argc, char **argv) {
+    char data[FILE_SIZE], buffer[FILE_SIZE];
+
+    if (argc < 2) {
+        printf("Usage: %s server_pipe [rounds]\n", argv[0]);
+        return 1;
+    }
+    long rounds = argc > 2 ? atol(argv[2]) : DEFAULT_ROUNDS;
+
+    memset(data, 'c', sizeof(data));
+    assert(tfs_mount("/tmp/tfs_lease_bench", argv[1]) == 0);
+
+    int f = tfs_open("/config", TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, data, sizeof(data)) == sizeof(data));
+    assert(tfs_close(f) != -1);
+
+    double start = now_us();
+    for (long i = 0; i < rounds; i++) {
+        f = tfs_open("/config", 0);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(tfs_close(f) != -1);
+    }
+    double total = now_us() - start;
+
+    printf("%ld rereads of a %d byte file: %.2f us each\n", rounds, FILE_SIZE,
+           total / (double)rounds);
+
+    f = server_open("/config", 0);
+    assert(f != -1);
+    start = now_us();
+    for (long i = 0; i < rounds; i++) {
+        assert(server_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(server_close(f) != -1);
+        f = server_open("/config", 0);
+        assert(f != -1);
+    }
+    total = now_us() - start;
+    printf("%ld rereads through the server: %.2f us each\n", rounds,
+           total / (double)rounds);
+
+    size_t size;
+    char const *mapped = tfs_mmap(f, &size);
+    assert(mapped != NULL && size == sizeof(data));
+    start = now_us();
+    for (long i = 0; i < rounds; i++) {
+        assert(tfs_mmap_valid(mapped));
+        memcpy(buffer, mapped, size);
+    }
+    total = now_us() - start;
+    printf("%ld reads from a mapping: %.2f us each\n", rounds,
+           total / (double)rounds);
+    assert(tfs_munmap(mapped) == 0);
+    assert(server_close(f) != -1);
+
+    assert(tfs_unmount() == 0);
+    return 0;
+}
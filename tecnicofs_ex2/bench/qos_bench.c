@@ -0,0 +1,131 @@
+#define _DEFAULT_SOURCE /* MAP_ANONYMOUS */
+
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*  Measures the latency of small clients (open, 16 byte write, close),
+    first alone and then next to a noisy client issuing back to back
+    block-sized writes.
+    Usage: qos_bench server_pipe [small_clients]
+    (start the server with e.g. -w /tmp/tfs_qos_noisy:1 -w /tmp/tfs_qos_small:4
+    to weigh the clients differently)
+*/
+
+#define DEFAULT_SMALL_CLIENTS 4
+#define SMALL_OPS 200
+/* a full block; requests larger than PIPE_BUF would not reach the server
+   pipe atomically */
+#define NOISY_WRITE 1024
+
+static double now_us() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e6 + (double)t.tv_nsec / 1e3;
+}
+
+static int compare(void const *a, void const *b) {
+    double x = *(double const *)a, y = *(double const *)b;
+    return (x > y) - (x < y);
+}
+
+static void noisy_client(char const *server_pipe) {
+    static char data[NOISY_WRITE];
+
+    assert(tfs_mount("/tmp/tfs_qos_noisy", server_pipe) == 0);
+    for (;;) {
+        int f = tfs_open("/noisy", TFS_O_CREAT | TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, data, sizeof(data)) >= 0);
+        assert(tfs_close(f) != -1);
+    }
+}
+
+static void small_client(char const *server_pipe, int id, double *latencies) {
+    char pipe_name[40], path[40];
+
+    sprintf(pipe_name, "/tmp/tfs_qos_small%d", id);
+    sprintf(path, "/small%d", id);
+    assert(tfs_mount(pipe_name, server_pipe) == 0);
+
+    for (int i = 0; i < SMALL_OPS; i++) {
+        double start = now_us();
+        int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, "sixteen bytes!!!", 16) == 16);
+        assert(tfs_close(f) != -1);
+        latencies[i] = now_us() - start;
+    }
+
+    assert(tfs_unmount() == 0);
+}
+
+static void run(char const *server_pipe, int clients, int noisy,
+                double *latencies) {
+    pid_t noisy_pid = 0;
+    pid_t pids[clients];
+
+    if (noisy) {
+        noisy_pid = fork();
+        assert(noisy_pid >= 0);
+        if (noisy_pid == 0) {
+            noisy_client(server_pipe);
+            exit(0);
+        }
+        sleep(1);
+    }
+
+    for (int i = 0; i < clients; i++) {
+        pids[i] = fork();
+        assert(pids[i] >= 0);
+        if (pids[i] == 0) {
+            small_client(server_pipe, i, latencies + i * SMALL_OPS);
+            exit(0);
+        }
+    }
+    for (int i = 0; i < clients; i++) {
+        int status;
+        waitpid(pids[i], &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    if (noisy) {
+        /* the server reaps its session */
+        kill(noisy_pid, SIGKILL);
+        waitpid(noisy_pid, NULL, 0);
+    }
+
+    size_t n = (size_t)clients * SMALL_OPS;
+    qsort(latencies, n, sizeof(double), compare);
+    printf("  %-14s p50 %10.1f us   p99 %10.1f us\n",
+           noisy ? "noisy neighbor" : "alone", latencies[n / 2],
+           latencies[n * 99 / 100]);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s server_pipe [small_clients]\n", argv[0]);
+        return 1;
+    }
+    int clients = argc > 2 ? atoi(argv[2]) : DEFAULT_SMALL_CLIENTS;
+
+    double *latencies = mmap(NULL, (size_t)clients * SMALL_OPS * sizeof(double),
+                             PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(latencies != MAP_FAILED);
+
+    printf("%d small clients, %d operations each\n", clients, SMALL_OPS);
+    fflush(stdout);
+    run(argv[1], clients, 0, latencies);
+    run(argv[1], clients, 1, latencies);
+
+    return 0;
+}
@@ -2,8 +2,243 @@
 
 #define ALL_TAKEN -1
 
-int session_id, fcli, fserv;
+//a busy server is asked again after the time it suggests, or after an
+//exponentially growing (and jittered) wait if that is longer
+#define BACKOFF_MIN_US 100
+#define BACKOFF_MAX_US 100000
+#define BUSY_RETRIES 16
+
+//client-side cache: the contents of files the server granted a lease on.
+//While the lease holds, opening such a file (with no flags but TFS_O_CREAT)
+//gives a local handle, which is read from the cache with no request at all;
+//a local handle is turned into a real one (opened on the server, at the same
+//offset) when it is written to or its lease is recalled
+#define CACHE_ENTRIES 16
+#define LOCAL_HANDLES 64
+#define LOCAL_HANDLE_BASE (1 << 30) //above every handle the server gives out
+
+//mappings: files' contents read in place, from the server's memory file of
+//data blocks (opened through /proc, and mapped in units of its block size)
+#define MAPPINGS 16
+
+//and the names looked up: while the lease on their directory holds, a file
+//is reopened by its i-number, with no lookup on the server
+#define NAME_ENTRIES 64
+
+typedef struct {
+    int valid;
+    int inumber;
+    char name[NAME_SIZE];
+    size_t size;
+    char data[LEASE_MAX_SIZE];
+} cache_entry;
+
+typedef struct {
+    int used;
+    char name[NAME_SIZE];
+    cache_entry *entry;
+    int inumber;    //of the cached file, in case the entry is reused
+    size_t offset;
+    int fhandle;    //once opened on the server, -1 before
+} local_handle;
+
+typedef struct {
+    int used;
+    int valid;      //until the file's lease is recalled
+    int inumber;
+    int block;      //pinned by the server until unmapped, -1 if the file is empty
+    int server;     //pid of the server that pinned it
+    void *region;
+    size_t region_len;
+    char const *contents;
+} mapping;
+
+typedef struct {
+    int valid;
+    char name[NAME_SIZE];
+    int inumber;
+    int dir;        //the i-number of the directory the name is in
+} name_entry;
+
+int session_id, fcli, fserv, flease = -1;
 char const *client_pipe;
+char lease_pipe[NAME_SIZE + sizeof(LEASE_SUFFIX)];
+cache_entry cache[CACHE_ENTRIES];
+int cache_next;
+local_handle local[LOCAL_HANDLES];
+name_entry names[NAME_ENTRIES];
+int names_next;
+mapping maps[MAPPINGS];
+char const empty_contents[MAPPINGS]; //what the mapping of an empty file points to
+int data_fd = -1, data_server = -1, data_server_fd;
+size_t data_unit;
+
+void sleep_us(long us) {
+    struct timespec t = { .tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000 };
+
+    while(nanosleep(&t, &t) == -1 && errno == EINTR)
+        continue;
+}
+
+//sends a request and reads its answer (an int or a ssize_t), resending it while the server is busy
+int request(void *message, size_t len, void *answer, size_t answer_size) {
+    long backoff = BACKOFF_MIN_US;
+
+    for(int attempt = 0; attempt <= BUSY_RETRIES; attempt++) {
+        int retry_us;
+
+        if(write_function(message, len) == -1)
+            return -1;
+        if(read_function(answer, answer_size) == -1)
+            return -1;
+
+        if(answer_size == sizeof(int) ? *(int*)answer != TFS_BUSY : *(ssize_t*)answer != TFS_BUSY)
+            return 0;
+
+        if(read_function(&retry_us, sizeof(int)) == -1)
+            return -1;
+
+        long wait = retry_us > backoff ? retry_us : backoff;
+        sleep_us(wait / 2 + rand() % (wait / 2 + 1));
+        if(backoff < BACKOFF_MAX_US)
+            backoff *= 2;
+    }
+
+    return -1;
+}
+
+//reads the recalls the server sent, invalidating what they name
+void drain_recalls() {
+    int inumber;
+    ssize_t rd;
+
+    if(flease == -1)
+        return;
+
+    while((rd = read(flease, &inumber, sizeof(int))) == sizeof(int)) {
+        for(int i = 0; i < CACHE_ENTRIES; i++) {
+            if(cache[i].valid && cache[i].inumber == inumber)
+                cache[i].valid = FALSE;
+        }
+        for(int i = 0; i < NAME_ENTRIES; i++) {
+            if(names[i].valid && names[i].dir == inumber)
+                names[i].valid = FALSE;
+        }
+        for(int i = 0; i < MAPPINGS; i++) {
+            if(maps[i].used && maps[i].inumber == inumber)
+                maps[i].valid = FALSE;
+        }
+    }
+
+    //the server closed the lease pipe: none of the leases can be trusted
+    if(rd == 0) {
+        close_function(flease);
+        flease = -1;
+        for(int i = 0; i < CACHE_ENTRIES; i++)
+            cache[i].valid = FALSE;
+        for(int i = 0; i < NAME_ENTRIES; i++)
+            names[i].valid = FALSE;
+        for(int i = 0; i < MAPPINGS; i++)
+            maps[i].valid = FALSE;
+    }
+}
+
+cache_entry *cache_lookup(char const *name) {
+    for(int i = 0; i < CACHE_ENTRIES; i++) {
+        if(cache[i].valid && strcmp(cache[i].name, name) == 0)
+            return &cache[i];
+    }
+    return NULL;
+}
+
+//the entry to cache a file in: the one it already had, or the next one round robin
+cache_entry *cache_slot(char const *name) {
+    for(int i = 0; i < CACHE_ENTRIES; i++) {
+        if(strcmp(cache[i].name, name) == 0)
+            return &cache[i];
+    }
+    cache_next = (cache_next + 1) % CACHE_ENTRIES;
+    return &cache[cache_next];
+}
+
+name_entry *name_lookup(char const *name) {
+    for(int i = 0; i < NAME_ENTRIES; i++) {
+        if(names[i].valid && strcmp(names[i].name, name) == 0)
+            return &names[i];
+    }
+    return NULL;
+}
+
+name_entry *name_slot(char const *name) {
+    for(int i = 0; i < NAME_ENTRIES; i++) {
+        if(strcmp(names[i].name, name) == 0)
+            return &names[i];
+    }
+    names_next = (names_next + 1) % NAME_ENTRIES;
+    return &names[names_next];
+}
+
+//reads the leases that come with the handle an open answers, caching what they grant
+int read_leases(char const *name) {
+    int inumber, dir;
+    ssize_t size;
+
+    //the file's i-number, -1 if there are none
+    if(read_function(&inumber, sizeof(int)) == -1)
+        return -1;
+    if(inumber == -1)
+        return 0;
+    if(read_function(&dir, sizeof(int)) == -1 || read_function(&size, sizeof(ssize_t)) == -1 ||
+       size < -1 || size > LEASE_MAX_SIZE)
+        return -1;
+
+    name_entry *n = name_slot(name);
+
+    strcpy(n->name, name);
+    n->inumber = inumber;
+    n->dir = dir;
+    n->valid = flease != -1;
+
+    //the contents, unless the size is -1
+    if(size == -1)
+        return 0;
+
+    cache_entry *entry = cache_slot(name);
+
+    entry->valid = FALSE;
+    if(read_function(entry->data, (size_t)size) == -1)
+        return -1;
+    strcpy(entry->name, name);
+    entry->inumber = inumber;
+    entry->size = (size_t)size;
+    entry->valid = flease != -1;
+    return 0;
+}
+
+local_handle *get_local(int fhandle) {
+    if(fhandle < LOCAL_HANDLE_BASE || fhandle >= LOCAL_HANDLE_BASE + LOCAL_HANDLES || !local[fhandle - LOCAL_HANDLE_BASE].used)
+        return NULL;
+    return &local[fhandle - LOCAL_HANDLE_BASE];
+}
+
+//opens a local handle's file on the server, at the offset it had reached
+int promote(local_handle *l) {
+    int fhandle = server_open_inumber(l->name, l->inumber, 0, l->offset);
+
+    if(fhandle == -1)
+        return -1;
+    l->fhandle = fhandle;
+    return 0;
+}
+
+//FNV-1a
+unsigned hash_name(char const *name) {
+    unsigned hash = 2166136261u;
+
+    for(; *name != '\0'; name++)
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash;
+}
 
 int tfs_mount(char const *client_pipe_path, char const *server_pipe_path) {
     int code = TFS_OP_CODE_MOUNT;
@@ -12,6 +247,15 @@ int tfs_mount(char const *client_pipe_path, char const *server_pipe_path) {
     
     unlink(client_pipe_path);
 
+    //without a lease pipe, the client just gets no leases
+    if(strlen(client_pipe_path) < NAME_SIZE) {
+        strcpy(lease_pipe, client_pipe_path);
+        strcat(lease_pipe, LEASE_SUFFIX);
+        unlink(lease_pipe);
+        if(mkfifo(lease_pipe, 0777) == 0)
+            flease = open(lease_pipe, O_RDONLY | O_NONBLOCK);
+    }
+
     if((fserv = open_function(server_pipe_path, O_WRONLY)) == -1) 
         return -1;
     
@@ -39,6 +283,23 @@ int tfs_mount(char const *client_pipe_path, char const *server_pipe_path) {
     if(session_id == ALL_TAKEN)
         return -1;
 
+    //the requests go to the endpoint the client's pipe hashes onto
+    int endpoints, endpoint;
+
+    if(read_function(&endpoints, sizeof(int)) == -1 || endpoints < 1 || endpoints > MAX_ENDPOINTS)
+        return -1;
+
+    if((endpoint = (int)(hash_name(client_pipe_path) % (unsigned)endpoints)) != 0) {
+        char endpoint_name[strlen(server_pipe_path) + sizeof(".64")]; //endpoint < MAX_ENDPOINTS
+        int fd;
+
+        snprintf(endpoint_name, sizeof(endpoint_name), "%s.%d", server_pipe_path, endpoint);
+        if((fd = open_function(endpoint_name, O_WRONLY)) == -1)
+            return -1;
+        close_function(fserv);
+        fserv = fd;
+    }
+
     return 0;
 }
 
@@ -59,10 +320,62 @@ int tfs_unmount() {
 
     unlink(client_pipe);
 
+    if(flease != -1)
+        close_function(flease);
+    flease = -1;
+    unlink(lease_pipe);
+    for(int i = 0; i < CACHE_ENTRIES; i++)
+        cache[i].valid = FALSE;
+    for(int i = 0; i < LOCAL_HANDLES; i++)
+        local[i].used = FALSE;
+    for(int i = 0; i < NAME_ENTRIES; i++)
+        names[i].valid = FALSE;
+    //the server drops the pins of a closed session
+    for(int i = 0; i < MAPPINGS; i++) {
+        if(maps[i].used && maps[i].region != NULL)
+            munmap(maps[i].region, maps[i].region_len);
+        maps[i].used = FALSE;
+    }
+    if(data_fd != -1)
+        close_function(data_fd);
+    data_fd = data_server = -1;
+
     return 0;
 }
 
 int tfs_open(char const *name, int flags) {
+    cache_entry *entry;
+    name_entry *n;
+
+    drain_recalls();
+    if((flags & ~TFS_O_CREAT) == 0 && (entry = cache_lookup(name)) != NULL) {
+        for(int i = 0; i < LOCAL_HANDLES; i++) {
+            local_handle *l = &local[i];
+
+            if(l->used)
+                continue;
+            l->used = TRUE;
+            strcpy(l->name, name);
+            l->entry = entry;
+            l->inumber = entry->inumber;
+            l->offset = 0;
+            l->fhandle = -1;
+            return LOCAL_HANDLE_BASE + i;
+        }
+    }
+
+    if((n = name_lookup(name)) != NULL) {
+        int fhandle = server_open_inumber(name, n->inumber, flags, 0);
+
+        if(fhandle != -1)
+            return fhandle;
+        n->valid = FALSE;
+    }
+
+    return server_open(name, flags);
+}
+
+int server_open(char const *name, int flags) {
     int code = TFS_OP_CODE_OPEN, answer;
     char file_name[NAME_SIZE], message[1+2*sizeof(int)+NAME_SIZE];
 
@@ -76,33 +389,94 @@ int tfs_open(char const *name, int flags) {
     memcpy(message+1+sizeof(int), file_name, NAME_SIZE);
     memcpy(message+1+sizeof(int)+NAME_SIZE, &flags, sizeof(int));
 
-    if(write_function(message, 1+2*sizeof(int)+NAME_SIZE) == -1)
+    if(request(message, 1+2*sizeof(int)+NAME_SIZE, &answer, sizeof(int)) == -1)
+        return -1;
+    if(answer == -1 || read_leases(file_name) == -1)
         return -1;
 
-    if(read_function(&answer, sizeof(int)) == -1)
+    return answer;
+}
+
+int server_open_inumber(char const *name, int inumber, int flags, size_t offset) {
+    int code = TFS_OP_CODE_OPEN_INUMBER, answer;
+    char message[1+3*sizeof(int)+sizeof(size_t)];
+
+    memcpy(message, &code, sizeof(char));
+    memcpy(message+1, &session_id, sizeof(int));
+    memcpy(message+1+sizeof(int), &inumber, sizeof(int));
+    memcpy(message+1+2*sizeof(int), &flags, sizeof(int));
+    memcpy(message+1+3*sizeof(int), &offset, sizeof(size_t));
+
+    if(request(message, 1+3*sizeof(int)+sizeof(size_t), &answer, sizeof(int)) == -1)
+        return -1;
+    if(answer == -1 || read_leases(name) == -1)
         return -1;
 
     return answer;
 }
 
 int tfs_close(int fhandle) {
-    int code = TFS_OP_CODE_CLOSE, answer;
+    local_handle *l = get_local(fhandle);
+
+    if(fhandle >= LOCAL_HANDLE_BASE) {
+        if(l == NULL)
+            return -1;
+        l->used = FALSE;
+        return l->fhandle == -1 ? 0 : server_close(l->fhandle);
+    }
+    return server_close(fhandle);
+}
+
+int tfs_fsync(int fhandle) {
+    int code = TFS_OP_CODE_FSYNC, answer;
     char message[1+2*sizeof(int)];
+    local_handle *l = get_local(fhandle);
+
+    //nothing was written through a handle that was never opened on the server
+    if(fhandle >= LOCAL_HANDLE_BASE) {
+        if(l == NULL)
+            return -1;
+        if(l->fhandle == -1)
+            return 0;
+        fhandle = l->fhandle;
+    }
 
     memcpy(message, &code, sizeof(char));
     memcpy(message+1, &session_id, sizeof(int));
     memcpy(message+1+sizeof(int), &fhandle, sizeof(int));
 
-    if(write_function(message, 1+2*sizeof(int)) == -1)
+    if(request(message, 1+2*sizeof(int), &answer, sizeof(int)) == -1)
         return -1;
 
-    if(read_function(&answer, sizeof(int)) == -1)
+    return answer;
+}
+
+int server_close(int fhandle) {
+    int code = TFS_OP_CODE_CLOSE, answer;
+    char message[1+2*sizeof(int)];
+
+    memcpy(message, &code, sizeof(char));
+    memcpy(message+1, &session_id, sizeof(int));
+    memcpy(message+1+sizeof(int), &fhandle, sizeof(int));
+
+    if(request(message, 1+2*sizeof(int), &answer, sizeof(int)) == -1)
         return -1;
 
     return answer;
 }
 
 ssize_t tfs_write(int fhandle, void const *buffer, size_t len) {
+    local_handle *l = get_local(fhandle);
+
+    if(fhandle >= LOCAL_HANDLE_BASE) {
+        if(l == NULL || (l->fhandle == -1 && promote(l) == -1))
+            return -1;
+        fhandle = l->fhandle;
+    }
+    return server_write(fhandle, buffer, len);
+}
+
+ssize_t server_write(int fhandle, void const *buffer, size_t len) {
     int code = TFS_OP_CODE_WRITE;
     ssize_t answer;
     char message[sizeof(char)+2*sizeof(int)+sizeof(size_t)+len];
@@ -113,16 +487,37 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len) {
     memcpy(message+1+2*sizeof(int), &len, sizeof(size_t));
     memcpy(message+1+2*sizeof(int)+sizeof(size_t), buffer, len);
     
-    if(write_function(message, sizeof(char)+2*sizeof(int)+sizeof(size_t)+len) == -1)
-        return -1;
-
-    if(read_function(&answer, sizeof(ssize_t)) == -1)
+    if(request(message, sizeof(char)+2*sizeof(int)+sizeof(size_t)+len, &answer, sizeof(ssize_t)) == -1)
         return -1;
 
     return answer;
 }
 
 ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    local_handle *l = get_local(fhandle);
+
+    if(fhandle >= LOCAL_HANDLE_BASE) {
+        if(l == NULL)
+            return -1;
+
+        drain_recalls();
+        if(l->fhandle == -1 && l->entry->valid && l->entry->inumber == l->inumber) {
+            size_t n = l->offset < l->entry->size ? l->entry->size - l->offset : 0;
+
+            if(n > len)
+                n = len;
+            memcpy(buffer, l->entry->data + l->offset, n);
+            l->offset += n;
+            return (ssize_t)n;
+        }
+        if(l->fhandle == -1 && promote(l) == -1)
+            return -1;
+        fhandle = l->fhandle;
+    }
+    return server_read(fhandle, buffer, len);
+}
+
+ssize_t server_read(int fhandle, void *buffer, size_t len) {
     int code = TFS_OP_CODE_READ;
     char message[1+2*sizeof(int)+sizeof(size_t)];
     ssize_t answer;
@@ -132,20 +527,14 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
     memcpy(message+1+sizeof(int), &fhandle, sizeof(int));
     memcpy(message+1+2*sizeof(int), &len, sizeof(size_t));
 
-    if(write_function(message, 1+2*sizeof(int)+sizeof(size_t)) == -1)
-        return -1;
-
-    if(read_function(&answer, sizeof(ssize_t)) == -1)
+    if(request(message, 1+2*sizeof(int)+sizeof(size_t), &answer, sizeof(ssize_t)) == -1)
         return -1;
 
-    if(answer == -1)
+    if(answer == -1 || answer > (ssize_t)len)
         return -1;
 
     if(read_function(buffer, (size_t)answer) == -1)
         return -1;
-    
-    char buffer2[answer];
-    memcpy(buffer2, buffer, (size_t)answer);
 
     return answer;
 }
@@ -157,15 +546,213 @@ int tfs_shutdown_after_all_closed() {
     memcpy(message, &code, sizeof(char));
     memcpy(message+1, &session_id, sizeof(int));
 
-    if(write_function(message, 1+sizeof(int)) == -1)
+    if(request(message, 1+sizeof(int), &answer, sizeof(int)) == -1)
         return -1;
 
-    if(read_function(&answer, sizeof(int)) == -1)
+    return answer;
+}
+
+int tfs_snapshot() {
+    int code = TFS_OP_CODE_SNAPSHOT, answer;
+    char message[1+sizeof(int)];
+
+    memcpy(message, &code, sizeof(char));
+    memcpy(message+1, &session_id, sizeof(int));
+
+    if(request(message, 1+sizeof(int), &answer, sizeof(int)) == -1)
         return -1;
 
     return answer;
 }
 
+int tfs_snapshot_open(int snapshot, char const *name) {
+    int code = TFS_OP_CODE_SNAPSHOT_OPEN, answer;
+    char file_name[NAME_SIZE], message[1+2*sizeof(int)+NAME_SIZE];
+
+    strcpy(file_name, name);
+
+    for(size_t i = strlen(file_name); i < NAME_SIZE; i++)
+        file_name[i] = '\0';
+
+    memcpy(message, &code, sizeof(char));
+    memcpy(message+1, &session_id, sizeof(int));
+    memcpy(message+1+sizeof(int), &snapshot, sizeof(int));
+    memcpy(message+1+2*sizeof(int), file_name, NAME_SIZE);
+
+    if(request(message, 1+2*sizeof(int)+NAME_SIZE, &answer, sizeof(int)) == -1)
+        return -1;
+
+    return answer;
+}
+
+int tfs_snapshot_delete(int snapshot) {
+    int code = TFS_OP_CODE_SNAPSHOT_DELETE, answer;
+    char message[1+2*sizeof(int)];
+
+    memcpy(message, &code, sizeof(char));
+    memcpy(message+1, &session_id, sizeof(int));
+    memcpy(message+1+sizeof(int), &snapshot, sizeof(int));
+
+    if(request(message, 1+2*sizeof(int), &answer, sizeof(int)) == -1)
+        return -1;
+
+    return answer;
+}
+
+int tfs_readdir_plus(int *cookie, tfs_dirent_t *entries, int max) {
+    int code = TFS_OP_CODE_READDIR_PLUS, answer;
+    char message[1+3*sizeof(int)];
+
+    if(*cookie == -1)
+        return 0;
+    if(max > READDIR_BATCH)
+        max = READDIR_BATCH;
+
+    memcpy(message, &code, sizeof(char));
+    memcpy(message+1, &session_id, sizeof(int));
+    memcpy(message+1+sizeof(int), cookie, sizeof(int));
+    memcpy(message+1+2*sizeof(int), &max, sizeof(int));
+
+    if(request(message, 1+3*sizeof(int), &answer, sizeof(int)) == -1 || answer == -1)
+        return -1;
+    if(read_function(cookie, sizeof(int)) == -1 ||
+       read_function(entries, (size_t)answer * sizeof(tfs_dirent_t)) == -1)
+        return -1;
+
+    return answer;
+}
+
+//opens the memory file of data blocks of a server (unless it is already open)
+int open_data(int server, int server_fd) {
+    char path[64];
+    struct stat st;
+
+    if(data_fd != -1 && server == data_server && server_fd == data_server_fd)
+        return 0;
+    if(data_fd != -1)
+        close_function(data_fd);
+    data_server = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", server, server_fd);
+    if((data_fd = open(path, O_RDONLY)) == -1)
+        return -1;
+    //huge pages can only be mapped whole
+    if(fstat(data_fd, &st) == -1) {
+        close_function(data_fd);
+        data_fd = -1;
+        return -1;
+    }
+    data_unit = (size_t)st.st_blksize;
+    data_server = server;
+    data_server_fd = server_fd;
+    return 0;
+}
+
+int unpin(int block) {
+    int code = TFS_OP_CODE_MUNMAP, answer;
+    char message[1+2*sizeof(int)];
+
+    memcpy(message, &code, sizeof(char));
+    memcpy(message+1, &session_id, sizeof(int));
+    memcpy(message+1+sizeof(int), &block, sizeof(int));
+
+    if(request(message, 1+2*sizeof(int), &answer, sizeof(int)) == -1)
+        return -1;
+
+    return answer;
+}
+
+void const *tfs_mmap(int fhandle, size_t *size) {
+    int code = TFS_OP_CODE_MMAP, answer, layout[4];
+    char message[1+2*sizeof(int)];
+    size_t extent[2];
+    local_handle *l = get_local(fhandle);
+    mapping *m = NULL;
+
+    if(fhandle >= LOCAL_HANDLE_BASE) {
+        if(l == NULL || (l->fhandle == -1 && promote(l) == -1))
+            return NULL;
+        fhandle = l->fhandle;
+    }
+
+    for(int i = 0; i < MAPPINGS && m == NULL; i++) {
+        if(!maps[i].used)
+            m = &maps[i];
+    }
+    if(m == NULL)
+        return NULL;
+
+    memcpy(message, &code, sizeof(char));
+    memcpy(message+1, &session_id, sizeof(int));
+    memcpy(message+1+sizeof(int), &fhandle, sizeof(int));
+
+    //recalls of earlier leases on the file must not be taken for the new one's
+    drain_recalls();
+    if(request(message, 1+2*sizeof(int), &answer, sizeof(int)) == -1 || answer == -1)
+        return NULL;
+    //the server's pid and memory file, and the file's i-number, block, offset and size
+    if(read_function(layout, sizeof(layout)) == -1 || read_function(extent, sizeof(extent)) == -1)
+        return NULL;
+
+    m->inumber = layout[2];
+    m->block = layout[3];
+    m->server = layout[0];
+    m->region = NULL;
+    m->region_len = 0;
+    m->contents = &empty_contents[m - maps];
+    if(m->block != -1) {
+        size_t start;
+
+        if(open_data(layout[0], layout[1]) == -1) {
+            unpin(m->block);
+            return NULL;
+        }
+        start = extent[0] / data_unit * data_unit;
+        m->region_len = extent[0] + extent[1] - start;
+        m->region = mmap(NULL, m->region_len, PROT_READ, MAP_SHARED, data_fd, (off_t)start);
+        if(m->region == MAP_FAILED) {
+            unpin(m->block);
+            return NULL;
+        }
+        m->contents = (char const *)m->region + (extent[0] - start);
+    }
+    m->valid = flease != -1;
+    m->used = TRUE;
+
+    *size = extent[1];
+    return m->contents;
+}
+
+mapping *get_mapping(void const *contents) {
+    for(int i = 0; i < MAPPINGS; i++) {
+        if(maps[i].used && maps[i].contents == contents)
+            return &maps[i];
+    }
+    return NULL;
+}
+
+int tfs_mmap_valid(void const *contents) {
+    mapping *m;
+
+    drain_recalls();
+    m = get_mapping(contents);
+    return m != NULL && m->valid;
+}
+
+int tfs_munmap(void const *contents) {
+    mapping *m = get_mapping(contents);
+
+    if(m == NULL)
+        return -1;
+    m->used = FALSE;
+    if(m->region != NULL && munmap(m->region, m->region_len) == -1)
+        return -1;
+    //a server that took over from the one that pinned the block has no pin for it
+    if(m->block == -1 || m->server != data_server)
+        return 0;
+    return unpin(m->block);
+}
+
 int open_function(const char *file, int flag) {
     int fd;
     while((fd = open(file, flag)) == -1) {
@@ -7,8 +7,11 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdlib.h>
+#include <time.h>
 
 /*
  * Establishes a session with a TecnicoFS server.
@@ -27,6 +30,19 @@
  */
 int tfs_mount(char const *client_pipe_path, char const *server_pipe_path);
 
+/*
+ * When the server is overloaded it turns requests down with TFS_BUSY; the
+ * calls below then retry, backing off exponentially, and fail (returning -1)
+ * if the server is still busy after BUSY_RETRIES attempts.
+ */
+
+/*
+ * Files the server grants a read lease on (at open) are cached by the
+ * client: until the lease is recalled (when anyone writes the file), opening
+ * them again with no flags other than TFS_O_CREAT, and reading them, needs
+ * no request to the server.
+ */
+
 /*
  * Ends the currently active session.
  * After notifying the server, both named pipes are closed by the client,
@@ -42,9 +58,13 @@ int tfs_unmount();
  * Input:
  *  - name: absolute path name
  *  - flags: can be a combination (with bitwise or) of the following flags:
- *    - append mode (TFS_O_APPEND)
+ *    - append mode (TFS_O_APPEND): each write goes to the end of the
+ *      file as it is then, so concurrent appenders never overwrite each other
  *    - truncate file contents (TFS_O_TRUNC)
  *    - create file if it does not exist (TFS_O_CREAT)
+ *    - store the contents compressed, if the file is created or truncated
+ *      (TFS_O_COMPRESS): it can then grow past a block (up to
+ *      MAX_COMPRESSED_FILE_SIZE), as long as its contents compress into one
  */
 int tfs_open(char const *name, int flags);
 
@@ -55,6 +75,14 @@ int tfs_open(char const *name, int flags);
  */
 int tfs_close(int fhandle);
 
+/* Makes what was written to a file (and, with it, whatever else changed)
+ * reach the server's backing file, if it has one
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fsync(int fhandle);
+
 /* Writes to an open file, starting at the current offset
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
@@ -84,6 +112,65 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len);
  */
 int tfs_shutdown_after_all_closed();
 
+/*
+ * Takes a snapshot of the TecnicoFS server's file system, without waiting
+ * for open files to be closed.
+ * Returns the snapshot's identifier if successful, -1 otherwise.
+ */
+int tfs_snapshot();
+
+/* Opens a file, for reading, as it was when a snapshot was taken
+ * Input:
+ * 	- snapshot identifier (obtained from a previous call to tfs_snapshot)
+ * 	- name: absolute path name
+ * Returns the file handle if successful, -1 otherwise.
+ */
+int tfs_snapshot_open(int snapshot, char const *name);
+
+/* Deletes a snapshot, which must not have open files
+ * Input:
+ * 	- snapshot identifier (obtained from a previous call to tfs_snapshot)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_snapshot_delete(int snapshot);
+
+/* Lists the root directory, with each entry's i-number, type and size, in
+ * batches: each call asks the server for up to max entries (at most
+ * READDIR_BATCH)
+ * Input:
+ * 	- where to start from (0 for the first entry), updated to where to go
+ * 	  on from (-1 once no entry is left)
+ * 	- where to store the entries, and how many fit there
+ * Returns the number of entries listed (0 once no entry is left), -1 if
+ * unsuccessful
+ */
+int tfs_readdir_plus(int *cookie, tfs_dirent_t *entries, int max);
+
+/* Maps the contents of an open file into memory, read-only, so that they
+ * are read with no request to the server. The mapping goes on showing the
+ * contents as they were when it was made, until it is unmapped
+ * Input:
+ * 	- file handle (of a file that is not compressed)
+ * 	- where to store the size of the contents
+ * Returns a pointer to the contents if successful, NULL otherwise.
+ */
+void const *tfs_mmap(int fhandle, size_t *size);
+
+/* Tells whether a file is still as it was mapped (it is not once it is
+ * written to or truncated, or the server is replaced)
+ * Input:
+ * 	- the pointer tfs_mmap returned
+ * Returns 1 if it is, 0 otherwise.
+ */
+int tfs_mmap_valid(void const *contents);
+
+/* Unmaps a file's contents
+ * Input:
+ * 	- the pointer tfs_mmap returned
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_munmap(void const *contents);
+
 int open_function(const char *file, int flag);
 
 int close_function(int fd);
@@ -92,4 +179,20 @@ int write_function(void *buf, size_t bytes);
 
 int read_function(void *buf, size_t bytes);
 
+int request(void *message, size_t len, void *answer, size_t answer_size);
+
+int server_open(char const *name, int flags);
+
+int server_open_inumber(char const *name, int inumber, int flags, size_t offset);
+
+int server_close(int fhandle);
+
+ssize_t server_write(int fhandle, void const *buffer, size_t len);
+
+ssize_t server_read(int fhandle, void *buffer, size_t len);
+
+void sleep_us(long us);
+
+unsigned hash_name(char const *name);
+
 #endif /* CLIENT_API_H */
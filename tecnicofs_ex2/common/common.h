@@ -1,12 +1,15 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <stddef.h>
+
 #define TRUE  1
 #define FALSE 0
 
 #define BUFFER_SIZE 50
 #define NAME_SIZE   40
 
+/* the server allocates sessions S at a time */
 #define S 20
 
 /* tfs_open flags */
@@ -14,8 +17,50 @@ enum {
     TFS_O_CREAT = 0b001,
     TFS_O_TRUNC = 0b010,
     TFS_O_APPEND = 0b100,
+    TFS_O_COMPRESS = 0b1000,
 };
 
+/* answer of a server too busy to take a request: it is followed by an int
+   with the number of microseconds the client should wait before retrying */
+#define TFS_BUSY -2
+
+/* read leases: a client creates a pipe named after its own with this suffix
+   before mounting; the server writes to it the i-number (an int) of each
+   file or directory whose lease it recalls. Opens get a lease on the name
+   (the file's i-number and the directory's, to reopen the file with
+   TFS_OP_CODE_OPEN_INUMBER until the directory's lease is recalled) and, for
+   files up to LEASE_MAX_SIZE bytes, on the file's contents */
+#define LEASE_SUFFIX ".lease"
+#define LEASE_MAX_SIZE 4096
+
+/* mappings: TFS_OP_CODE_MMAP answers where an open file's contents are (the
+   server's pid and the descriptor of its memory file of data blocks, which
+   the client opens through /proc, and the file's i-number, block, offset in
+   that memory file and size), with a lease recalled once they change; the
+   block stays as it is until TFS_OP_CODE_MUNMAP */
+
+/* directory listings (readdirplus): TFS_OP_CODE_READDIR_PLUS lists up to
+   READDIR_BATCH entries of the root directory, from a cookie (0 for the
+   first entry); it answers how many it listed, then the cookie to go on from
+   (-1 once there are no more) and the entries */
+#define READDIR_BATCH 32
+
+/* sharded endpoints: a server may listen on several pipes, each read by a
+   thread of its own. The server pipe is endpoint 0, and endpoint i is the
+   pipe named after it with ".i" appended; mounts go to endpoint 0, and are
+   answered with the session id followed by the number of endpoints, and
+   the client then sends its requests to the one its pipe's name hashes onto */
+#define MAX_ENDPOINTS 64
+
+enum { TFS_DT_FILE = 0, TFS_DT_DIRECTORY = 1 };
+
+typedef struct {
+    char de_name[NAME_SIZE]; /* without the leading '/' */
+    int de_inumber;
+    int de_type;
+    size_t de_size;
+} tfs_dirent_t;
+
 /* operation codes (for client-server requests) */
 enum {
     TFS_OP_CODE_MOUNT = 1,
@@ -24,7 +69,15 @@ enum {
     TFS_OP_CODE_CLOSE = 4,
     TFS_OP_CODE_WRITE = 5,
     TFS_OP_CODE_READ = 6,
-    TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED = 7
+    TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED = 7,
+    TFS_OP_CODE_SNAPSHOT = 8,
+    TFS_OP_CODE_SNAPSHOT_OPEN = 9,
+    TFS_OP_CODE_SNAPSHOT_DELETE = 10,
+    TFS_OP_CODE_OPEN_INUMBER = 11,
+    TFS_OP_CODE_MMAP = 12,
+    TFS_OP_CODE_MUNMAP = 13,
+    TFS_OP_CODE_READDIR_PLUS = 14,
+    TFS_OP_CODE_FSYNC = 15
 };
 
 #endif /* COMMON_H */
\ No newline at end of file
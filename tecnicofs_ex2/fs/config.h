@@ -7,8 +7,32 @@
 #define BLOCK_SIZE (1024)
 #define DATA_BLOCKS (1024)
 #define INODE_TABLE_SIZE (50)
-#define MAX_OPEN_FILES (20)
+
+/* Each session has its own table of open files, which grows as needed; file
+ * handles are session * MAX_SESSION_FILES + index */
+#define MAX_SESSIONS (1 << 14)
+#define MAX_SESSION_FILES (1 << 16)
+#define SESSION_FILES_MIN (16)
+/* Session of the files opened through tfs_open */
+#define DEFAULT_SESSION (0)
+
+/* The i-node table and the data blocks are split into this many allocation
+ * groups */
+#define ALLOCATION_GROUPS (4)
 #define MAX_FILE_NAME (40)
+/* Compressed files can hold this much, as long as it compresses into a
+ * single block */
+#define MAX_COMPRESSED_FILE_SIZE (4 * BLOCK_SIZE)
+#define MAX_SNAPSHOTS (8)
+
+/* Per-open-file write-behind buffer (bytes) */
+#define WRITE_BUFFER_SIZE (256)
+
+/* Initial read-ahead window (bytes); doubles on each sequential read */
+#define READ_AHEAD_MIN (64)
+
+/* Size of the huge pages used when tfs_params.huge_pages is set */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
 
 #define DELAY (5000)
 
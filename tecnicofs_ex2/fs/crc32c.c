@@ -0,0 +1,160 @@
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32C_X86
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+/* Reflected Castagnoli polynomial */
+#define POLY 0x82F63B78U
+
+/* The hardware version runs three streams of LANE bytes in parallel (the
+ * crc32 instruction has a latency of three cycles, but a throughput of
+ * one), so that a 1 KiB block is a single round */
+#define LANE 336
+
+static uint32_t table[8][256];
+/* x^(8 * LANE - 33) and x^(16 * LANE - 33) modulo POLY, which shift a CRC
+ * over one and two lanes of zeros (see shift_crc) */
+static uint64_t lane_shift[2];
+static bool hw_available;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/* Returns x^n modulo POLY (in the reflected bit order) */
+static uint32_t xpow(size_t n) {
+    uint32_t p = 0x80000000U; /* x^0 */
+    while (n-- > 0) {
+        p = (p & 1) ? (p >> 1) ^ POLY : p >> 1;
+    }
+    return p;
+}
+
+static void crc32c_init() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+        }
+        table[0][n] = crc;
+    }
+    for (int n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) {
+            table[k][n] =
+                (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xFF];
+        }
+    }
+
+    lane_shift[0] = xpow(8 * LANE - 33);
+    lane_shift[1] = xpow(16 * LANE - 33);
+
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    hw_available = __builtin_cpu_supports("sse4.2") &&
+                   __builtin_cpu_supports("pclmul");
+#endif
+}
+
+/* Slicing-by-8: eight bytes per step, from eight 256-entry tables */
+static uint32_t crc32c_sw(uint32_t crc, unsigned char const *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v ^= crc;
+        crc = table[7][v & 0xFF] ^ table[6][(v >> 8) & 0xFF] ^
+              table[5][(v >> 16) & 0xFF] ^ table[4][(v >> 24) & 0xFF] ^
+              table[3][(v >> 32) & 0xFF] ^ table[2][(v >> 40) & 0xFF] ^
+              table[1][(v >> 48) & 0xFF] ^ table[0][v >> 56];
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+uint32_t crc32c_portable(uint32_t crc, void const *data, size_t len) {
+    pthread_once(&init_once, crc32c_init);
+    return ~crc32c_sw(~crc, data, len);
+}
+
+bool crc32c_hw_available() {
+    pthread_once(&init_once, crc32c_init);
+    return hw_available;
+}
+
+#ifdef CRC32C_X86
+
+/* Returns crc * x^(8 * len) modulo POLY, given shift = x^(8 * len - 33): the
+ * carry-less product is crc * shift / x (as the crc32 instruction reads
+ * it), which the instruction multiplies by x^32 and reduces */
+__attribute__((target("sse4.2,pclmul"))) static inline uint32_t
+shift_crc(uint32_t crc, uint64_t shift) {
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)crc),
+                                           _mm_cvtsi64_si128((long long)shift),
+                                           0x00);
+    return (uint32_t)_mm_crc32_u64(
+        0, (unsigned long long)_mm_cvtsi128_si64(product));
+}
+
+__attribute__((target("sse4.2,pclmul"))) static uint32_t
+crc32c_sse42(uint32_t crc, unsigned char const *p, size_t len) {
+    unsigned long long crc0 = crc;
+
+    for (; len >= 3 * LANE; p += 3 * LANE, len -= 3 * LANE) {
+        unsigned long long crc1 = 0, crc2 = 0;
+        for (size_t i = 0; i < LANE; i += 8) {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p + i, sizeof(v0));
+            memcpy(&v1, p + LANE + i, sizeof(v1));
+            memcpy(&v2, p + 2 * LANE + i, sizeof(v2));
+            crc0 = _mm_crc32_u64(crc0, v0);
+            crc1 = _mm_crc32_u64(crc1, v1);
+            crc2 = _mm_crc32_u64(crc2, v2);
+        }
+        /* the CRC is linear: each stream's CRC is shifted past the lanes
+         * that follow it */
+        crc0 = shift_crc((uint32_t)crc0, lane_shift[1]) ^
+               shift_crc((uint32_t)crc1, lane_shift[0]) ^ crc2;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc0 = _mm_crc32_u64(crc0, v);
+    }
+    uint32_t crc32 = (uint32_t)crc0;
+    while (len-- > 0) {
+        crc32 = _mm_crc32_u8(crc32, *p++);
+    }
+    return crc32;
+}
+
+uint32_t crc32c_hw(uint32_t crc, void const *data, size_t len) {
+    pthread_once(&init_once, crc32c_init);
+    return ~crc32c_sse42(~crc, data, len);
+}
+
+#else
+
+uint32_t crc32c_hw(uint32_t crc, void const *data, size_t len) {
+    return crc32c_portable(crc, data, len);
+}
+
+#endif
+
+/*
+ * Computes the CRC32C of len bytes of data, continuing from crc (0 to start
+ * a new one).
+ * Returns: the updated CRC
+ */
+uint32_t crc32c(uint32_t crc, void const *data, size_t len) {
+    pthread_once(&init_once, crc32c_init);
+#ifdef CRC32C_X86
+    if (hw_available) {
+        return ~crc32c_sse42(~crc, data, len);
+    }
+#endif
+    return ~crc32c_sw(~crc, data, len);
+}
@@ -0,0 +1,22 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli), used to checksum data blocks and i-node table blocks.
+ * crc32c uses the SSE4.2 crc32 instruction (with PCLMUL to combine
+ * interleaved streams) when the CPU has it, and a table-driven fallback
+ * otherwise.
+ */
+
+uint32_t crc32c(uint32_t crc, void const *data, size_t len);
+
+/* The two implementations, for testing and benchmarking */
+uint32_t crc32c_portable(uint32_t crc, void const *data, size_t len);
+bool crc32c_hw_available();
+uint32_t crc32c_hw(uint32_t crc, void const *data, size_t len);
+
+#endif // CRC32C_H
@@ -0,0 +1,177 @@
+#include "dedup.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* 64-bit primes (as used by xxHash) */
+#define PRIME_1 0x9E3779B185EBCA87ULL
+#define PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME_3 0x165667B19E3779F9ULL
+#define PRIME_4 0x85EBCA77C2B2AE63ULL
+
+static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(unsigned char const *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+    return rotl(acc + input * PRIME_2, 31) * PRIME_1;
+}
+
+/*
+ * Hashes len bytes of data, 32 bytes at a time over four independent lanes
+ * (so that the multiplications pipeline), in the style of xxHash64.
+ * Returns: the 64-bit hash
+ */
+uint64_t dedup_hash(void const *data, size_t len) {
+    unsigned char const *p = data;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t acc[4] = {PRIME_1 + PRIME_2, PRIME_2, 0, -PRIME_1};
+        for (; len >= 32; p += 32, len -= 32) {
+            acc[0] = round64(acc[0], read64(p));
+            acc[1] = round64(acc[1], read64(p + 8));
+            acc[2] = round64(acc[2], read64(p + 16));
+            acc[3] = round64(acc[3], read64(p + 24));
+        }
+        h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) +
+            rotl(acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = (h ^ round64(0, acc[i])) * PRIME_1 + PRIME_4;
+        }
+    } else {
+        h = PRIME_3;
+    }
+
+    for (; len >= 8; p += 8, len -= 8) {
+        h = rotl(h ^ round64(0, read64(p)), 27) * PRIME_1 + PRIME_4;
+    }
+    for (; len > 0; p++, len--) {
+        h = rotl(h ^ (*p * PRIME_3), 11) * PRIME_1;
+    }
+
+    /* final avalanche */
+    h ^= h >> 33;
+    h *= PRIME_2;
+    h ^= h >> 29;
+    h *= PRIME_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* Open addressing (linear probing) table, with at least twice as many slots
+ * as there are blocks, so that it never fills */
+typedef struct {
+    uint64_t e_hash;
+    int e_block; /* -1 if the slot is empty */
+} dedup_entry_t;
+
+static dedup_entry_t *index_table;
+static size_t index_mask;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Creates an empty index for up to max_blocks blocks
+ * Returns: 0 if successful, -1 otherwise
+ */
+int dedup_init(size_t max_blocks) {
+    size_t slots = 1;
+    while (slots < 2 * max_blocks) {
+        slots *= 2;
+    }
+
+    index_table = malloc(slots * sizeof(dedup_entry_t));
+    if (index_table == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < slots; i++) {
+        index_table[i].e_block = -1;
+    }
+    index_mask = slots - 1;
+    return 0;
+}
+
+void dedup_destroy() {
+    free(index_table);
+    index_table = NULL;
+}
+
+/*
+ * Looks for a block whose contents have a given hash
+ * Returns: the block's index, -1 if there is none
+ */
+int dedup_lookup(uint64_t hash) {
+    int block_number = -1;
+
+    pthread_mutex_lock(&index_lock);
+    for (size_t i = hash & index_mask; index_table[i].e_block != -1;
+         i = (i + 1) & index_mask) {
+        if (index_table[i].e_hash == hash) {
+            block_number = index_table[i].e_block;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+    return block_number;
+}
+
+/*
+ * Adds a block to the index (unless another block already has the hash)
+ * Returns: 0 if added, -1 otherwise
+ */
+int dedup_insert(uint64_t hash, int block_number) {
+    int ret = 0;
+
+    pthread_mutex_lock(&index_lock);
+    size_t i = hash & index_mask;
+    for (; index_table[i].e_block != -1; i = (i + 1) & index_mask) {
+        if (index_table[i].e_hash == hash) {
+            ret = -1;
+            break;
+        }
+    }
+    if (ret == 0) {
+        index_table[i].e_hash = hash;
+        index_table[i].e_block = block_number;
+    }
+    pthread_mutex_unlock(&index_lock);
+    return ret;
+}
+
+/*
+ * Removes a block from the index (if it is there)
+ */
+void dedup_remove(uint64_t hash, int block_number) {
+    pthread_mutex_lock(&index_lock);
+    size_t i = hash & index_mask;
+    for (; index_table[i].e_block != -1; i = (i + 1) & index_mask) {
+        if (index_table[i].e_hash == hash &&
+            index_table[i].e_block == block_number) {
+            break;
+        }
+    }
+
+    if (index_table[i].e_block != -1) {
+        /* backward shift deletion: move later entries of the probe sequence
+         * into the hole, so that lookups don't stop early */
+        size_t hole = i;
+        for (size_t j = (i + 1) & index_mask; index_table[j].e_block != -1;
+             j = (j + 1) & index_mask) {
+            size_t home = index_table[j].e_hash & index_mask;
+            if (((j - home) & index_mask) >= ((j - hole) & index_mask)) {
+                index_table[hole] = index_table[j];
+                hole = j;
+            }
+        }
+        index_table[hole].e_block = -1;
+    }
+    pthread_mutex_unlock(&index_lock);
+}
@@ -0,0 +1,21 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fingerprint index for block deduplication: maps the hash of a data block's
+ * contents to the block holding them
+ */
+
+uint64_t dedup_hash(void const *data, size_t len);
+
+int dedup_init(size_t max_blocks);
+void dedup_destroy();
+
+int dedup_lookup(uint64_t hash);
+int dedup_insert(uint64_t hash, int block_number);
+void dedup_remove(uint64_t hash, int block_number);
+
+#endif // DEDUP_H
@@ -0,0 +1,184 @@
+#include "lz.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * The compressed stream is a sequence of:
+ *  - a token: number of literals (high nibble) and match length minus
+ *    MIN_MATCH (low nibble); a nibble of 15 is followed by extra length
+ *    bytes, added up until one is not 255
+ *  - the literals
+ *  - the match: 2-byte (little-endian) offset back into the output
+ * The last sequence has literals only, and ends the stream.
+ */
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 0xFFFF
+#define HASH_LOG 12
+
+static inline uint32_t read32(uint8_t const *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v) {
+    return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/* Writes a length that did not fit in its token nibble */
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/*
+ * Appends a sequence (match_len == 0 for the last one) to the output
+ * Returns: the new end of the output, NULL if it does not fit
+ */
+static uint8_t *put_sequence(uint8_t *op, uint8_t const *oend,
+                             uint8_t const *literals, size_t lit_len,
+                             size_t offset, size_t match_len) {
+    size_t ml = match_len == 0 ? 0 : match_len - MIN_MATCH;
+    size_t worst = 1 + lit_len / 255 + 1 + lit_len + 2 + ml / 255 + 1;
+    if (worst > (size_t)(oend - op)) {
+        return NULL;
+    }
+
+    uint8_t *token = op++;
+    *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15) {
+        op = put_length(op, lit_len - 15);
+    }
+    memcpy(op, literals, lit_len);
+    op += lit_len;
+
+    if (match_len > 0) {
+        *op++ = (uint8_t)(offset & 0xFF);
+        *op++ = (uint8_t)(offset >> 8);
+        *token |= (uint8_t)(ml < 15 ? ml : 15);
+        if (ml >= 15) {
+            op = put_length(op, ml - 15);
+        }
+    }
+    return op;
+}
+
+/*
+ * Compresses src_len bytes from src into dst
+ * Returns: the compressed size, 0 if it does not fit in dst_cap bytes
+ */
+size_t lz_compress(void const *src, size_t src_len, void *dst,
+                   size_t dst_cap) {
+    uint8_t const *in = src;
+    uint8_t *op = dst;
+    uint8_t const *oend = op + dst_cap;
+    /* last position where each hashed 4-byte sequence was seen (+1, so that
+     * 0 means none) */
+    size_t table[1 << HASH_LOG] = {0};
+    size_t anchor = 0, ip = 0;
+
+    while (ip + MIN_MATCH <= src_len) {
+        uint32_t seq = read32(in + ip);
+        uint32_t h = hash32(seq);
+        size_t ref = table[h];
+        table[h] = ip + 1;
+
+        if (ref == 0 || ip - (ref - 1) > MAX_OFFSET ||
+            read32(in + ref - 1) != seq) {
+            ip++;
+            continue;
+        }
+        ref--;
+
+        size_t len = MIN_MATCH;
+        while (ip + len < src_len && in[ref + len] == in[ip + len]) {
+            len++;
+        }
+
+        op = put_sequence(op, oend, in + anchor, ip - anchor, ip - ref, len);
+        if (op == NULL) {
+            return 0;
+        }
+        ip += len;
+        anchor = ip;
+    }
+
+    op = put_sequence(op, oend, in + anchor, src_len - anchor, 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+    return (size_t)(op - (uint8_t *)dst);
+}
+
+/* Reads a length that did not fit in its token nibble
+ * Returns: false if the input ends first */
+static bool get_length(uint8_t const **ip, uint8_t const *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip == iend) {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+/*
+ * Decompresses src_len bytes from src into dst
+ * Returns: the decompressed size, -1 if the input is malformed or does not
+ * fit in dst_cap bytes
+ */
+ssize_t lz_decompress(void const *src, size_t src_len, void *dst,
+                      size_t dst_cap) {
+    uint8_t const *ip = src;
+    uint8_t const *iend = ip + src_len;
+    uint8_t *out = dst;
+    size_t op = 0;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !get_length(&ip, iend, &lit_len)) {
+            return -1;
+        }
+        if (lit_len > (size_t)(iend - ip) || lit_len > dst_cap - op) {
+            return -1;
+        }
+        memcpy(out + op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == iend) {
+            break; /* last sequence */
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !get_length(&ip, iend, &match_len)) {
+            return -1;
+        }
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > op || match_len > dst_cap - op) {
+            return -1;
+        }
+
+        /* byte by byte, since the match may overlap what it produces */
+        for (size_t i = 0; i < match_len; i++, op++) {
+            out[op] = out[op - offset];
+        }
+    }
+
+    return (ssize_t)op;
+}
@@ -0,0 +1,16 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Fast LZ77-class codec (in the style of LZ4's block format), used to store
+ * compressed files
+ */
+
+size_t lz_compress(void const *src, size_t src_len, void *dst, size_t dst_cap);
+ssize_t lz_decompress(void const *src, size_t src_len, void *dst,
+                      size_t dst_cap);
+
+#endif // LZ_H
@@ -1,37 +1,324 @@
 #include "operations.h"
+#include "lz.h"
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 static pthread_mutex_t single_global_lock;
 pthread_cond_t cond;
 int value = 0;
 int open_files = 0;
 
-int tfs_init() {
-    state_init();
+/* Syncs of the backing file: sync_lock (taken before single_global_lock)
+ * keeps them from overlapping; under SYNC_PERIODIC, the flusher thread
+ * makes one every sync_interval_ms */
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher;
+static bool backed; /* there is a backing file to sync (see sync_lock) */
+static bool flusher_running;
+static bool flusher_stop;
+static sync_policy_t sync_policy;
+static int sync_interval_ms;
+
+/* Checkpoints of the file system (see tfs_checkpoint): checkpoint_lock
+ * (taken before sync_lock) keeps them from overlapping; the checkpointer
+ * thread makes one every checkpoint_interval_ms, if not 0 */
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checkpointer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t checkpointer;
+static char *checkpoint_file; /* NULL if none (see checkpoint_lock) */
+static bool checkpointer_running;
+static bool checkpointer_stop;
+static int checkpoint_interval_ms;
+
+static int _tfs_sync();
+static void *_tfs_flush_periodically(void *arg);
+static void *_tfs_checkpoint_periodically(void *arg);
+
+/* Bumped whenever a file's contents change, so that handles can tell whether
+ * the data they read ahead is still current */
+static unsigned int file_generation[INODE_TABLE_SIZE];
+
+/* Read leases: the sessions allowed to cache each file's contents (or, for
+ * a directory, the names they looked up in it). They are recalled (and told
+ * so through recall_function) as soon as the i-node changes, so while a
+ * file has leases, its size and mode can be kept here too. */
+static int *lease_holders[INODE_TABLE_SIZE];
+static int lease_count[INODE_TABLE_SIZE];
+static int lease_capacity[INODE_TABLE_SIZE];
+static size_t lease_size[INODE_TABLE_SIZE];
+static bool lease_compressed[INODE_TABLE_SIZE];
+static tfs_recall_function recall_function;
+
+/* Mappings (see tfs_mmap): each one pins, with a reference, the data block
+ * a session mapped, so that writes to the file go to a copy of it */
+typedef struct {
+    int p_session;
+    int p_block;
+} pin_t;
+
+static pin_t *pins;
+static int pin_count;
+static int pin_capacity;
+
+/*
+ * Recalls every lease on a file, whose contents are about to change.
+ */
+static void _tfs_recall_unsynchronized(int inumber) {
+    for (int i = 0; i < lease_count[inumber]; i++) {
+        if (recall_function != NULL) {
+            recall_function(lease_holders[inumber][i], inumber);
+        }
+    }
+    lease_count[inumber] = 0;
+}
+
+/*
+ * Returns whether a session holds a lease on a file.
+ */
+static bool _tfs_holds_lease_unsynchronized(int session, int inumber) {
+    for (int i = 0; i < lease_count[inumber]; i++) {
+        if (lease_holders[inumber][i] == session) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Drops the lease a session holds on a file, if any, without recalling it.
+ */
+static void _tfs_drop_lease_unsynchronized(int session, int inumber) {
+    for (int i = 0; i < lease_count[inumber]; i++) {
+        if (lease_holders[inumber][i] == session) {
+            lease_holders[inumber][i] =
+                lease_holders[inumber][--lease_count[inumber]];
+            return;
+        }
+    }
+}
+
+/*
+ * Grants a session a lease on a file (unless it already holds one).
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int _tfs_grant_lease_unsynchronized(int session, int inumber) {
+    if (_tfs_holds_lease_unsynchronized(session, inumber)) {
+        return 0;
+    }
+
+    if (lease_count[inumber] == lease_capacity[inumber]) {
+        int capacity =
+            lease_capacity[inumber] == 0 ? 4 : 2 * lease_capacity[inumber];
+        int *holders =
+            realloc(lease_holders[inumber], (size_t)capacity * sizeof(int));
+        if (holders == NULL) {
+            return -1;
+        }
+        lease_holders[inumber] = holders;
+        lease_capacity[inumber] = capacity;
+    }
+    lease_holders[inumber][lease_count[inumber]++] = session;
+    return 0;
+}
+
+/*
+ * Pins a data block for a session.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int _tfs_pin_unsynchronized(int session, int block) {
+    if (pin_count == pin_capacity) {
+        int capacity = pin_capacity == 0 ? 4 : 2 * pin_capacity;
+        pin_t *grown = realloc(pins, (size_t)capacity * sizeof(pin_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        pins = grown;
+        pin_capacity = capacity;
+    }
+    if (!data_block_ref(block)) {
+        return -1;
+    }
+    pins[pin_count].p_session = session;
+    pins[pin_count].p_block = block;
+    pin_count++;
+    return 0;
+}
+
+/*
+ * Unpins the i-th pinned block (freeing it if nothing else references it).
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int _tfs_unpin_unsynchronized(int i) {
+    int block = pins[i].p_block;
+    pins[i] = pins[--pin_count];
+    return data_block_free(block);
+}
+
+tfs_params tfs_default_params() {
+    tfs_params params = {
+        .huge_pages = false,
+        .dedup = false,
+        .shared_data = false,
+        .backing_file = NULL,
+        .sync_policy = SYNC_NONE,
+        .sync_interval_ms = 1000,
+        .checkpoint_file = NULL,
+        .checkpoint_interval_ms = 60000,
+    };
+    return params;
+}
+
+int tfs_init() { return tfs_init_with_params(NULL); }
+
+/*
+ * Starts syncing the backing file as the parameters' policy dictates.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int _tfs_start_syncing(tfs_params const *params) {
+    backed = params->backing_file != NULL;
+    sync_policy = backed ? params->sync_policy : SYNC_NONE;
+    sync_interval_ms = params->sync_interval_ms;
+    flusher_stop = false;
+    flusher_running = false;
+    if (sync_policy == SYNC_PERIODIC) {
+        if (sync_interval_ms < 1 ||
+            pthread_create(&flusher, NULL, _tfs_flush_periodically, NULL) !=
+                0) {
+            return -1;
+        }
+        flusher_running = true;
+    }
+    return 0;
+}
+
+/*
+ * Starts checkpointing the file system as the parameters dictate.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int _tfs_start_checkpointing(tfs_params const *params) {
+    checkpoint_file = NULL;
+    checkpoint_interval_ms = params->checkpoint_interval_ms;
+    checkpointer_stop = false;
+    checkpointer_running = false;
+    if (params->checkpoint_file == NULL) {
+        return 0;
+    }
+    checkpoint_file = strdup(params->checkpoint_file);
+    if (checkpoint_file == NULL || checkpoint_interval_ms < 0) {
+        return -1;
+    }
+    if (checkpoint_interval_ms > 0) {
+        if (pthread_create(&checkpointer, NULL, _tfs_checkpoint_periodically,
+                           NULL) != 0) {
+            return -1;
+        }
+        checkpointer_running = true;
+    }
+    return 0;
+}
+
+int tfs_init_with_params(tfs_params const *params) {
+    tfs_params default_params = tfs_default_params();
+    if (params == NULL) {
+        params = &default_params;
+    }
+
+    if (state_init(params) != 0)
+        return -1;
     pthread_cond_init(&cond, NULL);
 
     if (pthread_mutex_init(&single_global_lock, 0) != 0)
         return -1;
 
-    /* create root inode */
-    int root = inode_create(T_DIRECTORY);
-    if (root != ROOT_DIR_INUM) {
+    /* create root inode (unless the file system was loaded from the backing
+     * file or a checkpoint) */
+    int loaded = state_load(params->checkpoint_file);
+    if (loaded == -1) {
+        return -1;
+    }
+    if (!loaded && inode_create(T_DIRECTORY) != ROOT_DIR_INUM) {
         return -1;
     }
 
-    return 0;
+    /* and the session of the files opened through tfs_open */
+    if (session_create() != DEFAULT_SESSION) {
+        return -1;
+    }
+
+    if (_tfs_start_syncing(params) == -1) {
+        return -1;
+    }
+    return _tfs_start_checkpointing(params);
+}
+
+int tfs_import(tfs_params const *params, int fd) {
+    tfs_params default_params = tfs_default_params();
+    if (params == NULL) {
+        params = &default_params;
+    }
+
+    if (state_init(params) != 0)
+        return -1;
+    pthread_cond_init(&cond, NULL);
+
+    if (pthread_mutex_init(&single_global_lock, 0) != 0)
+        return -1;
+
+    /* the root directory and the default session come with the state */
+    int files = state_import(fd);
+    if (files == -1) {
+        tfs_destroy();
+        return -1;
+    }
+    open_files = files;
+
+    if (_tfs_start_syncing(params) == -1) {
+        return -1;
+    }
+    return _tfs_start_checkpointing(params);
 }
 
 int tfs_destroy() {
+    if (checkpointer_running) {
+        pthread_mutex_lock(&checkpoint_lock);
+        checkpointer_stop = true;
+        pthread_cond_signal(&checkpointer_cond);
+        pthread_mutex_unlock(&checkpoint_lock);
+        pthread_join(checkpointer, NULL);
+        checkpointer_running = false;
+    }
+    free(checkpoint_file);
+    checkpoint_file = NULL;
+    if (flusher_running) {
+        pthread_mutex_lock(&sync_lock);
+        flusher_stop = true;
+        pthread_cond_signal(&flusher_cond);
+        pthread_mutex_unlock(&sync_lock);
+        pthread_join(flusher, NULL);
+        flusher_running = false;
+    }
+    int ret = _tfs_sync();
+
     state_destroy();
+    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
+        free(lease_holders[inumber]);
+        lease_holders[inumber] = NULL;
+        lease_count[inumber] = lease_capacity[inumber] = 0;
+    }
+    free(pins);
+    pins = NULL;
+    pin_count = pin_capacity = 0;
     if (pthread_mutex_destroy(&single_global_lock) != 0) {
         return -1;
     }
-    return 0;
+    return ret;
 }
 
 static bool valid_pathname(char const *name) {
@@ -40,10 +327,14 @@ static bool valid_pathname(char const *name) {
 
 int tfs_destroy_after_all_closed() {
     /* TO DO: implement this */
+    if (pthread_mutex_lock(&single_global_lock) != 0)
+        return -1;
     value = 1;
 
     while(open_files != 0)
         pthread_cond_wait(&cond, &single_global_lock);
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
     
     tfs_destroy();
     
@@ -70,33 +361,279 @@ int tfs_lookup(char const *name) {
     return ret;
 }
 
-static int _tfs_open_unsynchronized(char const *name, int flags) {
-    int inum;
-    size_t offset;
+/*
+ * Makes the i-node's data block ready to be written: allocates it if the
+ * file is empty, or replaces it by a private copy if it is shared (with a
+ * snapshot, or an identical file), which must not see the write.
+ * Returns a pointer to the block if successful, NULL otherwise.
+ */
+static void *_tfs_writable_block_unsynchronized(inode_t *inode) {
+    if (inode->i_size == 0) {
+        /* If empty file, allocate new block */
+        int b = data_block_alloc();
+        if (b == -1) {
+            return NULL;
+        }
+        inode->i_data_block = b;
+    } else {
+        int b = data_block_cow(inode->i_data_block);
+        if (b == -1) {
+            return NULL;
+        }
+        inode->i_data_block = b;
+    }
 
-    inum = _tfs_lookup_unsynchronized(name);
-    if (inum >= 0) {
-        /* The file already exists */
-        inode_t *inode = inode_get(inum);
-        if (inode == NULL) {
+    return data_block_get(inode->i_data_block);
+}
+
+/*
+ * Decompresses the contents of a compressed file into buffer (which must
+ * hold MAX_COMPRESSED_FILE_SIZE bytes).
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int _tfs_decompress_unsynchronized(inode_t const *inode, char *buffer) {
+    if (inode->i_size == 0) {
+        return 0;
+    }
+
+    void *block = data_block_get(inode->i_data_block);
+    if (block == NULL || data_block_verify(inode->i_data_block) == -1 ||
+        lz_decompress(block, inode->i_stored_size, buffer,
+                      MAX_COMPRESSED_FILE_SIZE) != (ssize_t)inode->i_size) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Writes to a compressed file: its contents are decompressed, changed and
+ * compressed again, which fails if they no longer fit in a block.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int _tfs_write_compressed_unsynchronized(inode_t *inode, size_t offset,
+                                                void const *buffer,
+                                                size_t len) {
+    char contents[MAX_COMPRESSED_FILE_SIZE];
+    char packed[BLOCK_SIZE];
+
+    if (_tfs_decompress_unsynchronized(inode, contents) == -1) {
+        return -1;
+    }
+
+    size_t size = inode->i_size;
+    if (offset > size) {
+        memset(contents + size, 0, offset - size);
+    }
+    memcpy(contents + offset, buffer, len);
+    if (offset + len > size) {
+        size = offset + len;
+    }
+
+    size_t stored = lz_compress(contents, size, packed, BLOCK_SIZE);
+    if (stored == 0) {
+        return -1;
+    }
+
+    void *block = _tfs_writable_block_unsynchronized(inode);
+    if (block == NULL) {
+        return -1;
+    }
+    memcpy(block, packed, stored);
+    data_block_seal(inode->i_data_block);
+    inode->i_stored_size = stored;
+    inode->i_size = size;
+    return 0;
+}
+
+/*
+ * Copies len bytes from buffer to the data block of file inumber, starting at
+ * offset, allocating the block if the file is still empty.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int _tfs_write_block_unsynchronized(int inumber, size_t offset,
+                                           void const *buffer, size_t len) {
+    inode_t *inode = inode_get(inumber);
+    if (inode == NULL) {
+        return -1;
+    }
+
+    if (inode->i_compressed) {
+        if (_tfs_write_compressed_unsynchronized(inode, offset, buffer, len) ==
+            -1) {
             return -1;
         }
+        inode_seal(inumber);
+        file_generation[inumber]++;
+        return 0;
+    }
+
+    void *block = _tfs_writable_block_unsynchronized(inode);
+    if (block == NULL) {
+        return -1;
+    }
+
+    /* Perform the actual write */
+    memcpy(block + offset, buffer, len);
+    data_block_seal(inode->i_data_block);
+    file_generation[inumber]++;
+
+    if (offset + len > inode->i_size) {
+        inode->i_size = offset + len;
+    }
 
+    /* A full block may share its storage with an identical one */
+    int ret = 0;
+    if (inode->i_size == BLOCK_SIZE) {
+        int b = data_block_dedup(inode->i_data_block);
+        if (b == -1) {
+            ret = -1;
+        } else {
+            inode->i_data_block = b;
+        }
+    }
+    inode_seal(inumber);
+    return ret;
+}
+
+/*
+ * Writes the contents of a handle's write-behind buffer to the file.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int _tfs_flush_unsynchronized(open_file_entry_t *file) {
+    if (file->of_wb_len == 0) {
+        return 0;
+    }
+
+    size_t len = file->of_wb_len;
+    file->of_wb_len = 0;
+    file->of_open_inode->oi_buffered = NULL;
+    return _tfs_write_block_unsynchronized(file->of_inumber, file->of_wb_offset,
+                                           file->of_wb, len);
+}
+
+/*
+ * Flushes the write-behind buffer of the handle open on inumber that has
+ * buffered data (there is at most one), unless it is the handle given in
+ * except (which can be NULL).
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int _tfs_flush_inode_unsynchronized(int inumber,
+                                           open_file_entry_t const *except) {
+    open_inode_t *open_inode = open_inode_get(-1, inumber);
+    if (open_inode == NULL) {
+        return -1;
+    }
+
+    open_file_entry_t *file = open_inode->oi_buffered;
+    if (file != NULL && file != except) {
+        return _tfs_flush_unsynchronized(file);
+    }
+    return 0;
+}
+
+/*
+ * Finds where the end of an open (live) file is, counting what is still
+ * buffered to be written past its i-node's size.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int _tfs_file_end_unsynchronized(open_file_entry_t const *file,
+                                        size_t *end) {
+    inode_t *inode = inode_get(file->of_inumber);
+    if (inode == NULL) {
+        return -1;
+    }
+
+    *end = inode->i_size;
+    open_file_entry_t const *buffered = file->of_open_inode->oi_buffered;
+    if (buffered != NULL &&
+        buffered->of_wb_offset + buffered->of_wb_len > *end) {
+        *end = buffered->of_wb_offset + buffered->of_wb_len;
+    }
+    return 0;
+}
+
+/*
+ * Returns the i-node an open file entry refers to (in the live file system
+ * or in a snapshot).
+ */
+static inode_t *_tfs_file_inode(open_file_entry_t const *file) {
+    if (file->of_snapshot != -1) {
+        return snapshot_inode_get(file->of_snapshot, file->of_inumber);
+    }
+    return inode_get(file->of_inumber);
+}
+
+/*
+ * Opens an existing file, at the given offset (or at its end, if appending).
+ * The size of a file the session holds a lease on has not changed since the
+ * lease was granted, so it is taken from the lease; whether the i-node is a
+ * file in use is checked either way (a session also holds leases on
+ * directories).
+ * Returns the file handle if successful, -1 otherwise.
+ */
+static int _tfs_open_inode_unsynchronized(int session, int inum, int flags,
+                                          size_t offset) {
+    bool compressed;
+
+    inode_t *inode = inode_get(inum);
+    if (inode == NULL || !inode_in_use(inum) ||
+        inode->i_node_type != T_FILE) {
+        return -1;
+    }
+
+    if (!(flags & TFS_O_TRUNC) &&
+        _tfs_holds_lease_unsynchronized(session, inum)) {
+        if (flags & TFS_O_APPEND) {
+            offset = lease_size[inum];
+        }
+        compressed = lease_compressed[inum];
+    } else {
         /* Trucate (if requested) */
         if (flags & TFS_O_TRUNC) {
+            /* Writes still buffered by other handles happened before the
+             * truncation, so they must land (and be discarded) first */
+            if (_tfs_flush_inode_unsynchronized(inum, NULL) == -1) {
+                return -1;
+            }
             if (inode->i_size > 0) {
+                _tfs_recall_unsynchronized(inum);
                 if (data_block_free(inode->i_data_block) == -1) {
                     return -1;
                 }
                 inode->i_size = 0;
+                file_generation[inum]++;
             }
+            /* A truncated file starts over, in the requested mode */
+            inode->i_compressed = (flags & TFS_O_COMPRESS) != 0;
+            inode_seal(inum);
         }
         /* Determine initial offset */
         if (flags & TFS_O_APPEND) {
             offset = inode->i_size;
-        } else {
-            offset = 0;
         }
+        compressed = inode->i_compressed;
+    }
+
+    int fhandle = add_to_open_file_table(session, -1, inum, offset);
+    if (fhandle != -1) {
+        open_file_entry_t *file = get_open_file_entry(fhandle);
+        if (compressed) {
+            file->of_max_size = MAX_COMPRESSED_FILE_SIZE;
+        }
+        file->of_append = (flags & TFS_O_APPEND) != 0;
+    }
+    return fhandle;
+}
+
+static int _tfs_open_unsynchronized(int session, char const *name,
+                                    int flags) {
+    int inum;
+    bool compressed;
+
+    inum = _tfs_lookup_unsynchronized(name);
+    if (inum >= 0) {
+        /* The file already exists */
+        return _tfs_open_inode_unsynchronized(session, inum, flags, 0);
     } else if (flags & TFS_O_CREAT) {
         /* The file doesn't exist; the flags specify that it should be created*/
         /* Create inode */
@@ -109,14 +646,31 @@ static int _tfs_open_unsynchronized(char const *name, int flags) {
             inode_delete(inum);
             return -1;
         }
-        offset = 0;
+        _tfs_recall_unsynchronized(ROOT_DIR_INUM);
+        compressed = (flags & TFS_O_COMPRESS) != 0;
+        if (compressed) {
+            inode_t *inode = inode_get(inum);
+            if (inode == NULL) {
+                return -1;
+            }
+            inode->i_compressed = true;
+            inode_seal(inum);
+        }
     } else {
         return -1;
     }
 
     /* Finally, add entry to the open file table and
      * return the corresponding handle */
-    return add_to_open_file_table(inum, offset);
+    int fhandle = add_to_open_file_table(session, -1, inum, 0);
+    if (fhandle != -1) {
+        open_file_entry_t *file = get_open_file_entry(fhandle);
+        if (compressed) {
+            file->of_max_size = MAX_COMPRESSED_FILE_SIZE;
+        }
+        file->of_append = (flags & TFS_O_APPEND) != 0;
+    }
+    return fhandle;
 
     /* Note: for simplification, if file was created with TFS_O_CREAT and there
      * is an error adding an entry to the open file table, the file is not
@@ -124,75 +678,150 @@ static int _tfs_open_unsynchronized(char const *name, int flags) {
 }
 
 int tfs_open(char const *name, int flags) {
+    return tfs_open_in_session(DEFAULT_SESSION, name, flags);
+}
+
+int tfs_open_in_session(int session, char const *name, int flags) {
     if(value == 1)
         return -1;
 
     if (pthread_mutex_lock(&single_global_lock) != 0)
         return -1;
-    int ret = _tfs_open_unsynchronized(name, flags);
+    int ret = _tfs_open_unsynchronized(session, name, flags);
+    if (ret != -1)
+        open_files++;
     if (pthread_mutex_unlock(&single_global_lock) != 0)
         return -1;
 
-    open_files++;
-
     return ret;
 }
 
-int tfs_close(int fhandle) {
+int tfs_open_inumber(int session, int inumber, int flags, size_t offset) {
+    if (value == 1 || inumber < 0 || inumber >= INODE_TABLE_SIZE)
+        return -1;
+
     if (pthread_mutex_lock(&single_global_lock) != 0)
         return -1;
-    int r = remove_from_open_file_table(fhandle);
+    int ret = _tfs_open_inode_unsynchronized(session, inumber, flags, offset);
+    if (ret != -1)
+        open_files++;
     if (pthread_mutex_unlock(&single_global_lock) != 0)
         return -1;
 
-    open_files--;
+    return ret;
+}
+
+int tfs_close(int fhandle) {
+    if (pthread_mutex_lock(&single_global_lock) != 0)
+        return -1;
+    int r = 0;
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file != NULL && _tfs_flush_unsynchronized(file) == -1) {
+        r = -1;
+    }
+    if (remove_from_open_file_table(fhandle) == -1) {
+        r = -1;
+    } else {
+        open_files--;
+    }
 
     if(value == 1 && open_files == 0)
         pthread_cond_signal(&cond);
 
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+
+    if (sync_policy == SYNC_ON_CLOSE && _tfs_sync() == -1) {
+        r = -1;
+    }
+
     return r;
 }
 
 static ssize_t _tfs_write_unsynchronized(int fhandle, void const *buffer,
                                          size_t to_write) {
     open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
+    if (file == NULL || file->of_snapshot != -1) {
         return -1;
     }
 
-    /* From the open file table entry, we get the inode */
-    inode_t *inode = inode_get(file->of_inumber);
-    if (inode == NULL) {
+    /* An append takes the range past the end of the file as it is now (the
+     * write is atomic, as the lock is held until the range is filled) */
+    if (file->of_append &&
+        _tfs_file_end_unsynchronized(file, &file->of_offset) == -1) {
         return -1;
     }
 
     /* Determine how many bytes to write */
-    if (to_write + file->of_offset > BLOCK_SIZE) {
-        to_write = BLOCK_SIZE - file->of_offset;
+    if (to_write + file->of_offset > file->of_max_size) {
+        to_write = file->of_max_size - file->of_offset;
     }
 
-    if (to_write > 0) {
-        if (inode->i_size == 0) {
-            /* If empty file, allocate new block */
-            inode->i_data_block = data_block_alloc();
-        }
+    if (to_write == 0) {
+        return 0;
+    }
 
-        void *block = data_block_get(inode->i_data_block);
-        if (block == NULL) {
+    /* The contents change now, even if the write is only buffered */
+    _tfs_recall_unsynchronized(file->of_inumber);
+
+    /* Appends through different handles coalesce: one that lands right
+     * after another handle's buffered run (at the end of the file) joins it,
+     * instead of flushing it */
+    open_file_entry_t *owner = file->of_open_inode->oi_buffered;
+    if (file->of_append && owner != NULL && owner != file &&
+        owner->of_wb_offset + owner->of_wb_len == file->of_offset &&
+        owner->of_wb_len + to_write <= WRITE_BUFFER_SIZE) {
+        memcpy(owner->of_wb + owner->of_wb_len, buffer, to_write);
+        owner->of_wb_len += to_write;
+        if (owner->of_wb_len == WRITE_BUFFER_SIZE &&
+            _tfs_flush_unsynchronized(owner) == -1) {
             return -1;
         }
+        file->of_offset += to_write;
+        return (ssize_t)to_write;
+    }
 
-        /* Perform the actual write */
-        memcpy(block + file->of_offset, buffer, to_write);
+    /* Only one handle may have buffered data for a file at a time, so that
+     * writes through different handles land in the order they were made */
+    if (_tfs_flush_inode_unsynchronized(file->of_inumber, file) == -1) {
+        return -1;
+    }
 
-        /* The offset associated with the file handle is
-         * incremented accordingly */
-        file->of_offset += to_write;
-        if (file->of_offset > inode->i_size) {
-            inode->i_size = file->of_offset;
+    /* The pending run can only be extended by a write that starts where it
+     * ends and fits in what is left of the buffer */
+    if (file->of_wb_len > 0 &&
+        (file->of_wb_offset + file->of_wb_len != file->of_offset ||
+         file->of_wb_len + to_write > WRITE_BUFFER_SIZE)) {
+        if (_tfs_flush_unsynchronized(file) == -1) {
+            return -1;
+        }
+    }
+
+    if (to_write <= WRITE_BUFFER_SIZE - file->of_wb_len) {
+        /* Small write: coalesce it in the write-behind buffer, without
+         * touching the i-node or the data block until the buffer fills */
+        if (file->of_wb_len == 0) {
+            file->of_wb_offset = file->of_offset;
+            file->of_open_inode->oi_buffered = file;
+        }
+        memcpy(file->of_wb + file->of_wb_len, buffer, to_write);
+        file->of_wb_len += to_write;
+        if (file->of_wb_len == WRITE_BUFFER_SIZE &&
+            _tfs_flush_unsynchronized(file) == -1) {
+            return -1;
+        }
+    } else {
+        /* Larger than the buffer: go straight to the data block */
+        if (_tfs_write_block_unsynchronized(file->of_inumber, file->of_offset,
+                                            buffer, to_write) == -1) {
+            return -1;
         }
     }
 
+    /* The offset associated with the file handle is
+     * incremented accordingly */
+    file->of_offset += to_write;
+
     return (ssize_t)to_write;
 }
 
@@ -212,22 +841,84 @@ static ssize_t _tfs_read_unsynchronized(int fhandle, void *buffer, size_t len) {
         return -1;
     }
 
-    /* From the open file table entry, we get the inode */
-    inode_t *inode = inode_get(file->of_inumber);
-    if (inode == NULL) {
+    /* Buffered writes (from any handle) must be visible to the read */
+    if (file->of_snapshot == -1 &&
+        _tfs_flush_inode_unsynchronized(file->of_inumber, NULL) == -1) {
         return -1;
     }
 
-    /* Determine how many bytes to read */
-    size_t to_read = inode->i_size - file->of_offset;
+    /* Serve the read from the data read ahead, if it is still current and
+     * covers the whole request */
+    if (file->of_ra_len > 0 &&
+        file->of_ra_generation == file_generation[file->of_inumber] &&
+        file->of_offset >= file->of_ra_offset &&
+        file->of_offset + len <= file->of_ra_offset + file->of_ra_len) {
+        memcpy(buffer, file->of_ra + (file->of_offset - file->of_ra_offset),
+               len);
+        file->of_offset += len;
+        file->of_read_end = file->of_offset;
+        return (ssize_t)len;
+    }
+
+    /* From the open file table entry, we get the inode (checking it, unless
+     * it is a snapshot's copy) */
+    inode_t *inode = _tfs_file_inode(file);
+    if (inode == NULL ||
+        (file->of_snapshot == -1 && inode_verify(file->of_inumber) == -1)) {
+        return -1;
+    }
+
+    /* Determine how many bytes to read (the file may have been truncated
+     * under the handle's offset) */
+    size_t to_read = 0;
+    if (inode->i_size > file->of_offset) {
+        to_read = inode->i_size - file->of_offset;
+    }
     if (to_read > len) {
         to_read = len;
     }
 
+    /* Sequential reads double the read-ahead window, others reset it */
+    if (file->of_offset == file->of_read_end) {
+        file->of_ra_window = file->of_ra_window == 0 ? READ_AHEAD_MIN
+                                                     : 2 * file->of_ra_window;
+        if (file->of_ra_window > BLOCK_SIZE) {
+            file->of_ra_window = BLOCK_SIZE;
+        }
+    } else {
+        file->of_ra_window = 0;
+    }
+    file->of_ra_len = 0;
+
     if (to_read > 0) {
-        void *block = data_block_get(inode->i_data_block);
-        if (block == NULL) {
-            return -1;
+        char contents[MAX_COMPRESSED_FILE_SIZE];
+        void *block;
+        if (inode->i_compressed) {
+            if (_tfs_decompress_unsynchronized(inode, contents) == -1) {
+                return -1;
+            }
+            block = contents;
+        } else {
+            block = data_block_get(inode->i_data_block);
+            if (block == NULL ||
+                data_block_verify(inode->i_data_block) == -1) {
+                return -1;
+            }
+        }
+
+        /* Read ahead what the window allows past the requested bytes */
+        size_t ahead = file->of_ra_window;
+        if (ahead > inode->i_size - file->of_offset) {
+            ahead = inode->i_size - file->of_offset;
+        }
+        if (ahead > to_read && file->of_ra == NULL) {
+            file->of_ra = malloc(BLOCK_SIZE);
+        }
+        if (ahead > to_read && file->of_ra != NULL) {
+            memcpy(file->of_ra, block + file->of_offset, ahead);
+            file->of_ra_offset = file->of_offset;
+            file->of_ra_len = ahead;
+            file->of_ra_generation = file_generation[file->of_inumber];
         }
 
         /* Perform the actual read */
@@ -236,6 +927,7 @@ static ssize_t _tfs_read_unsynchronized(int fhandle, void *buffer, size_t len) {
          * incremented accordingly */
         file->of_offset += to_read;
     }
+    file->of_read_end = file->of_offset;
 
     return (ssize_t)to_read;
 }
@@ -249,3 +941,529 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
 
     return ret;
 }
+
+/*
+ * Flushes every write-behind buffer and writes what changed since the last
+ * sync to the backing file (if any). The file system is only locked while
+ * the changes are copied out, not while they are written.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int _tfs_sync() {
+    pthread_mutex_lock(&sync_lock);
+    if (!backed) {
+        pthread_mutex_unlock(&sync_lock);
+        return 0;
+    }
+
+    pthread_mutex_lock(&single_global_lock);
+    int ret = 0;
+    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
+        if (_tfs_flush_inode_unsynchronized(inumber, NULL) == -1) {
+            ret = -1;
+        }
+    }
+    int staged = state_sync_stage();
+    pthread_mutex_unlock(&single_global_lock);
+
+    if (staged == 1 && state_sync_write() == -1) {
+        pthread_mutex_lock(&single_global_lock);
+        state_sync_abort();
+        pthread_mutex_unlock(&single_global_lock);
+        ret = -1;
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return ret;
+}
+
+/*
+ * The flusher thread: syncs every sync_interval_ms until tfs_destroy
+ */
+static void *_tfs_flush_periodically(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&sync_lock);
+    while (!flusher_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += sync_interval_ms / 1000;
+        deadline.tv_nsec += (long)(sync_interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!flusher_stop &&
+               pthread_cond_timedwait(&flusher_cond, &sync_lock, &deadline) ==
+                   0) {
+        }
+        if (flusher_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&sync_lock);
+        _tfs_sync();
+        pthread_mutex_lock(&sync_lock);
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return NULL;
+}
+
+int tfs_fsync(int fhandle) {
+    if (pthread_mutex_lock(&single_global_lock) != 0)
+        return -1;
+    int ret = -1;
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file != NULL) {
+        ret = _tfs_flush_unsynchronized(file);
+    }
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+
+    if (ret == 0) {
+        ret = _tfs_sync();
+    }
+    return ret;
+}
+
+/*
+ * Writes a checkpoint, with checkpoint_lock held
+ */
+static int _tfs_checkpoint_unsynchronized() {
+    if (checkpoint_file == NULL) {
+        return -1;
+    }
+
+    /* the file system is only locked while the child is forked; the child
+     * then writes the image from its copy of it while requests go on */
+    if (pthread_mutex_lock(&single_global_lock) != 0)
+        return -1;
+    int ret = 0;
+    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
+        if (_tfs_flush_inode_unsynchronized(inumber, NULL) == -1) {
+            ret = -1;
+        }
+    }
+    state_checkpoint_begin();
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(state_checkpoint_write(checkpoint_file) == 0 ? 0 : 1);
+    }
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        ret = -1;
+    }
+
+    pthread_mutex_lock(&single_global_lock);
+    if (state_checkpoint_end() == -1) {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&single_global_lock);
+    return ret;
+}
+
+int tfs_checkpoint() {
+    pthread_mutex_lock(&checkpoint_lock);
+    int ret = _tfs_checkpoint_unsynchronized();
+    pthread_mutex_unlock(&checkpoint_lock);
+    return ret;
+}
+
+/*
+ * The checkpointer thread: checkpoints every checkpoint_interval_ms until
+ * tfs_destroy
+ */
+static void *_tfs_checkpoint_periodically(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&checkpoint_lock);
+    while (!checkpointer_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += checkpoint_interval_ms / 1000;
+        deadline.tv_nsec += (long)(checkpoint_interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!checkpointer_stop &&
+               pthread_cond_timedwait(&checkpointer_cond, &checkpoint_lock,
+                                      &deadline) == 0) {
+        }
+        if (!checkpointer_stop && checkpoint_file != NULL) {
+            _tfs_checkpoint_unsynchronized();
+        }
+    }
+    pthread_mutex_unlock(&checkpoint_lock);
+    return NULL;
+}
+
+int tfs_export(int fd) {
+    pthread_mutex_lock(&checkpoint_lock);
+    pthread_mutex_lock(&sync_lock);
+    if (pthread_mutex_lock(&single_global_lock) != 0) {
+        pthread_mutex_unlock(&sync_lock);
+        pthread_mutex_unlock(&checkpoint_lock);
+        return -1;
+    }
+
+    /* the exported state has no write-behind buffers, so they are flushed,
+     * nor leases, so they are recalled, nor mappings (which hold on to the
+     * memory they mapped), so their pins are dropped */
+    int ret = 0;
+    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
+        if (_tfs_flush_inode_unsynchronized(inumber, NULL) == -1) {
+            ret = -1;
+        }
+        _tfs_recall_unsynchronized(inumber);
+    }
+    while (pin_count > 0) {
+        if (_tfs_unpin_unsynchronized(0) == -1) {
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        ret = state_export(fd);
+    }
+
+    pthread_mutex_unlock(&single_global_lock);
+    /* no sync or checkpoint is made until the export is committed or
+     * aborted */
+    if (ret == -1) {
+        pthread_mutex_unlock(&sync_lock);
+        pthread_mutex_unlock(&checkpoint_lock);
+    }
+
+    return ret;
+}
+
+int tfs_export_commit() {
+    /* whoever imported the state took the backing file (and checkpoints)
+     * over */
+    state_backing_detach();
+    backed = false;
+    free(checkpoint_file);
+    checkpoint_file = NULL;
+
+    pthread_mutex_unlock(&sync_lock);
+    pthread_mutex_unlock(&checkpoint_lock);
+    return 0;
+}
+
+int tfs_export_abort() {
+    pthread_mutex_unlock(&sync_lock);
+    pthread_mutex_unlock(&checkpoint_lock);
+    return 0;
+}
+
+int tfs_snapshot() {
+    if (pthread_mutex_lock(&single_global_lock) != 0)
+        return -1;
+
+    /* Buffered writes were made before the snapshot, so it must see them */
+    int ret = 0;
+    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
+        if (_tfs_flush_inode_unsynchronized(inumber, NULL) == -1) {
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        ret = snapshot_create();
+    }
+
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+
+    return ret;
+}
+
+static int _tfs_snapshot_open_unsynchronized(int session, int snapshot,
+                                             char const *name) {
+    if (!valid_pathname(name)) {
+        return -1;
+    }
+
+    int inum = snapshot_find_in_dir(snapshot, ROOT_DIR_INUM, name + 1);
+    if (inum == -1) {
+        return -1;
+    }
+
+    return add_to_open_file_table(session, snapshot, inum, 0);
+}
+
+int tfs_snapshot_open(int snapshot, char const *name) {
+    return tfs_snapshot_open_in_session(DEFAULT_SESSION, snapshot, name);
+}
+
+int tfs_snapshot_open_in_session(int session, int snapshot, char const *name) {
+    if (value == 1)
+        return -1;
+
+    if (pthread_mutex_lock(&single_global_lock) != 0)
+        return -1;
+    int ret = _tfs_snapshot_open_unsynchronized(session, snapshot, name);
+    if (ret != -1)
+        open_files++;
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+
+    return ret;
+}
+
+int tfs_snapshot_delete(int snapshot) {
+    if (pthread_mutex_lock(&single_global_lock) != 0)
+        return -1;
+
+    /* (fails if files opened from the snapshot are still open) */
+    int ret = snapshot_delete(snapshot);
+
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+
+    return ret;
+}
+
+int tfs_dedup_stats(dedup_stats_t *stats) {
+    if (pthread_mutex_lock(&single_global_lock) != 0)
+        return -1;
+    dedup_stats_get(stats);
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+    return 0;
+}
+
+int tfs_scrub(int threads, scrub_stats_t *stats) {
+    if (pthread_mutex_lock(&single_global_lock) != 0)
+        return -1;
+    int ret = state_scrub(threads, stats);
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+    return ret;
+}
+
+int tfs_session_create() {
+    if (pthread_mutex_lock(&single_global_lock) != 0)
+        return -1;
+    int ret = session_create();
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+    return ret;
+}
+
+int tfs_session_close(int session) {
+    if (pthread_mutex_lock(&single_global_lock) != 0)
+        return -1;
+
+    int ret = 0;
+    int fhandle = session_next_file(session, -1);
+    while (fhandle != -1) {
+        int next = session_next_file(session, fhandle);
+        open_file_entry_t *file = get_open_file_entry(fhandle);
+        if (_tfs_flush_unsynchronized(file) == -1) {
+            ret = -1;
+        }
+        if (remove_from_open_file_table(fhandle) == -1) {
+            ret = -1;
+        } else {
+            open_files--;
+        }
+        fhandle = next;
+    }
+    if (session != DEFAULT_SESSION && session_destroy(session) == -1) {
+        ret = -1;
+    }
+    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
+        _tfs_drop_lease_unsynchronized(session, inumber);
+    }
+    for (int i = pin_count - 1; i >= 0; i--) {
+        if (pins[i].p_session == session &&
+            _tfs_unpin_unsynchronized(i) == -1) {
+            ret = -1;
+        }
+    }
+
+    if(value == 1 && open_files == 0)
+        pthread_cond_signal(&cond);
+
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+
+    return ret;
+}
+
+int tfs_handle_session(int fhandle) {
+    return fhandle < 0 ? -1 : fhandle / MAX_SESSION_FILES;
+}
+
+void tfs_set_recall_function(tfs_recall_function recall) {
+    pthread_mutex_lock(&single_global_lock);
+    recall_function = recall;
+    pthread_mutex_unlock(&single_global_lock);
+}
+
+int tfs_lease(int fhandle, lease_t *lease, void *buffer, size_t len) {
+    char contents[MAX_COMPRESSED_FILE_SIZE];
+
+    if (pthread_mutex_lock(&single_global_lock) != 0)
+        return -1;
+
+    int ret = -1;
+    int session = tfs_handle_session(fhandle);
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    inode_t *inode = file == NULL || file->of_snapshot != -1
+                         ? NULL
+                         : inode_get(file->of_inumber);
+
+    /* the name the file was opened by stays valid while the directory has
+     * not changed */
+    if (inode != NULL &&
+        _tfs_grant_lease_unsynchronized(session, ROOT_DIR_INUM) == 0) {
+        lease->l_inumber = file->of_inumber;
+        lease->l_dir = ROOT_DIR_INUM;
+        lease->l_size = -1;
+        ret = 0;
+    }
+
+    /* and the contents, while the file has not changed (buffered writes are
+     * part of them, so its size is only known once they are flushed) */
+    ssize_t size = -1;
+    if (ret == 0 &&
+        _tfs_flush_inode_unsynchronized(file->of_inumber, NULL) == 0 &&
+        inode->i_size <= len) {
+        if (inode->i_compressed) {
+            if (_tfs_decompress_unsynchronized(inode, contents) == 0) {
+                memcpy(buffer, contents, inode->i_size);
+                size = (ssize_t)inode->i_size;
+            }
+        } else if (inode->i_size == 0) {
+            size = 0;
+        } else {
+            void *block = data_block_get(inode->i_data_block);
+            if (block != NULL &&
+                data_block_verify(inode->i_data_block) == 0) {
+                memcpy(buffer, block, inode->i_size);
+                size = (ssize_t)inode->i_size;
+            }
+        }
+    }
+
+    if (size != -1 &&
+        _tfs_grant_lease_unsynchronized(session, file->of_inumber) == 0) {
+        lease_size[file->of_inumber] = inode->i_size;
+        lease_compressed[file->of_inumber] = inode->i_compressed;
+        lease->l_size = size;
+    }
+
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+
+    return ret;
+}
+
+int tfs_mmap(int fhandle, mapping_t *mapping) {
+    if (data_region_fd() == -1)
+        return -1;
+
+    if (pthread_mutex_lock(&single_global_lock) != 0)
+        return -1;
+
+    int ret = -1;
+    int session = tfs_handle_session(fhandle);
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    inode_t *inode = file == NULL || file->of_snapshot != -1
+                         ? NULL
+                         : inode_get(file->of_inumber);
+
+    /* compressed contents cannot be read in place; buffered writes must be
+     * in the block first */
+    if (inode != NULL && !inode->i_compressed &&
+        _tfs_flush_inode_unsynchronized(file->of_inumber, NULL) == 0) {
+        mapping->m_inumber = file->of_inumber;
+        mapping->m_block = -1;
+        mapping->m_offset = 0;
+        mapping->m_size = inode->i_size;
+        if (inode->i_size == 0) {
+            ret = 0;
+        } else if (data_block_verify(inode->i_data_block) == 0 &&
+                   _tfs_pin_unsynchronized(session, inode->i_data_block) ==
+                       0) {
+            mapping->m_block = inode->i_data_block;
+            mapping->m_offset = (size_t)inode->i_data_block * BLOCK_SIZE;
+            ret = 0;
+        }
+    }
+
+    /* the lease tells the session when the mapping is out of date */
+    if (ret == 0) {
+        if (_tfs_grant_lease_unsynchronized(session, file->of_inumber) == 0) {
+            lease_size[file->of_inumber] = inode->i_size;
+            lease_compressed[file->of_inumber] = false;
+        } else {
+            if (mapping->m_block != -1) {
+                _tfs_unpin_unsynchronized(pin_count - 1);
+            }
+            ret = -1;
+        }
+    }
+
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+
+    return ret;
+}
+
+int tfs_munmap(int session, int block) {
+    if (pthread_mutex_lock(&single_global_lock) != 0)
+        return -1;
+
+    int ret = -1;
+    for (int i = 0; i < pin_count; i++) {
+        if (pins[i].p_session == session && pins[i].p_block == block) {
+            ret = _tfs_unpin_unsynchronized(i);
+            break;
+        }
+    }
+
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+
+    return ret;
+}
+
+int tfs_data_fd() { return data_region_fd(); }
+
+_Static_assert(NAME_SIZE >= MAX_FILE_NAME, "directory entry names too long");
+
+int tfs_readdir_plus(int *cookie, tfs_dirent_t *entries, int max) {
+    dir_entry_t found[MAX_DIR_ENTRIES];
+
+    if (*cookie == -1)
+        return 0;
+    if (max > (int)MAX_DIR_ENTRIES)
+        max = (int)MAX_DIR_ENTRIES;
+
+    if (pthread_mutex_lock(&single_global_lock) != 0)
+        return -1;
+
+    int count = dir_list(ROOT_DIR_INUM, *cookie, found, max, cookie);
+    for (int i = 0; i < count; i++) {
+        inode_t *inode;
+        if (_tfs_flush_inode_unsynchronized(found[i].d_inumber, NULL) == -1 ||
+            (inode = inode_get(found[i].d_inumber)) == NULL) {
+            count = -1;
+            break;
+        }
+        memcpy(entries[i].de_name, found[i].d_name, MAX_FILE_NAME);
+        entries[i].de_inumber = found[i].d_inumber;
+        entries[i].de_type = inode->i_node_type == T_DIRECTORY
+                                 ? TFS_DT_DIRECTORY
+                                 : TFS_DT_FILE;
+        entries[i].de_size = inode->i_size;
+    }
+
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+
+    return count;
+}
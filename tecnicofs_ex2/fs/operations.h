@@ -12,6 +12,62 @@
  */
 int tfs_init();
 
+/*
+ * Returns the default initialization parameters
+ */
+tfs_params tfs_default_params();
+
+/*
+ * Initializes tecnicofs with the given parameters (or the default ones, if
+ * params is NULL)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_init_with_params(tfs_params const *params);
+
+/*
+ * Initializes tecnicofs with the state (files, snapshots, sessions and their
+ * open files) written by tfs_export, possibly by another process
+ * Input:
+ *  - params: initialization parameters (or NULL, for the default ones)
+ *  - fd: file descriptor positioned at the start of the exported state
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_import(tfs_params const *params, int fd);
+
+/*
+ * Writes the whole state of tecnicofs to a file, after flushing every
+ * write-behind buffer, so that tfs_import can take it over. If successful,
+ * no sync or checkpoint is made until tfs_export_commit or tfs_export_abort
+ * is called
+ * Input:
+ *  - fd: file descriptor to write to
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_export(int fd);
+
+/*
+ * Hands the backing file and the checkpoints over to whoever imported the
+ * exported state: this instance no longer syncs or checkpoints
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_export_commit();
+
+/*
+ * Keeps the backing file and the checkpoints after an export that nobody
+ * took over
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_export_abort();
+
+/*
+ * Writes a checkpoint image of the file system (see
+ * tfs_params.checkpoint_file), which the next tfs_init loads: a child
+ * process is forked to write it, so the file system is only held up while
+ * write-behind buffers are flushed and the child is forked
+ * Returns 0 if successful, -1 otherwise (or if there is no checkpoint image).
+ */
+int tfs_checkpoint();
+
 /*
  * Destroy tecnicofs
  * Returns 0 if successful, -1 otherwise.
@@ -38,13 +94,51 @@ int tfs_lookup(char const *name);
  * Input:
  *  - name: absolute path name
  *  - flags: can be a combination (with bitwise or) of the following flags:
- *    - append mode (TFS_O_APPEND)
+ *    - append mode (TFS_O_APPEND): each write goes to the end of the
+ *      file as it is then, so concurrent appenders never overwrite each other
  *    - truncate file contents (TFS_O_TRUNC)
  *    - create file if it does not exist (TFS_O_CREAT)
+ *    - store the contents compressed, if the file is created or truncated
+ *      (TFS_O_COMPRESS): it can then grow up to MAX_COMPRESSED_FILE_SIZE, as
+ *      long as its contents compress into a single block
  */
 int tfs_open(char const *name, int flags);
 
-/* Closes a file
+/* Creates a session: a table of open files that grows as files are opened
+ * in it, and which is released as a whole by tfs_session_close
+ * Returns the session identifier if successful, -1 otherwise.
+ */
+int tfs_session_create();
+
+/* Closes every file open in a session, and (unless it is DEFAULT_SESSION,
+ * where tfs_open opens files) the session itself
+ * Input:
+ * 	- session identifier (obtained from a previous call to
+ * 	  tfs_session_create)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_session_close(int session);
+
+/* Opens a file (as in tfs_open) in a session */
+int tfs_open_in_session(int session, char const *name, int flags);
+
+/* Opens an existing file by its i-number (as learned from a lease), with no
+ * lookup; if the session holds a lease on the file, not even its i-node is
+ * read
+ * Input:
+ * 	- session identifier
+ * 	- i-number of the file
+ * 	- flags (as in tfs_open, but TFS_O_CREAT and TFS_O_COMPRESS are
+ * 	  meaningless)
+ * 	- initial offset (unless appending)
+ * Returns the file handle if successful, -1 otherwise.
+ */
+int tfs_open_inumber(int session, int inumber, int flags, size_t offset);
+
+/* Returns the session a file handle was opened in, -1 if it is invalid */
+int tfs_handle_session(int fhandle);
+
+/* Closes a file, flushing its write-behind buffer
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
  * Returns 0 if successful, -1 otherwise.
@@ -52,6 +146,9 @@ int tfs_open(char const *name, int flags);
 int tfs_close(int fhandle);
 
 /* Writes to an open file, starting at the current offset
+ * Small writes are kept in the handle's write-behind buffer and only reach
+ * the file's data block when the buffer fills, the file is read, or the
+ * handle is flushed (tfs_fsync) or closed.
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
  * 	- buffer containing the contents to write
@@ -61,6 +158,14 @@ int tfs_close(int fhandle);
  */
 ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
 
+/* Flushes the write-behind buffer of an open file and, if TecnicoFS has a
+ * backing file (see tfs_params.backing_file), syncs it
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fsync(int fhandle);
+
 /* Reads from an open file, starting at the current offset
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
@@ -72,6 +177,107 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Takes a snapshot of the whole file system (i-nodes and directories).
+ * Only metadata is copied: data blocks are shared with the snapshot until
+ * they are written to, when they are copied.
+ * Returns the snapshot's identifier if successful, -1 otherwise.
+ */
+int tfs_snapshot();
+
+/* Opens a file, for reading, as it was when a snapshot was taken
+ * Input:
+ * 	- snapshot identifier (obtained from a previous call to tfs_snapshot)
+ * 	- name: absolute path name
+ * Returns the file handle if successful, -1 otherwise.
+ */
+int tfs_snapshot_open(int snapshot, char const *name);
+
+/* Opens a file from a snapshot (as in tfs_snapshot_open) in a session */
+int tfs_snapshot_open_in_session(int session, int snapshot, char const *name);
+
+/* Deletes a snapshot, which must not have open files
+ * Input:
+ * 	- snapshot identifier (obtained from a previous call to tfs_snapshot)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_snapshot_delete(int snapshot);
+
+/* Gets the block deduplication statistics (see tfs_params.dedup)
+ * Input:
+ * 	- where to store the statistics
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_dedup_stats(dedup_stats_t *stats);
+
+/* Checks every data block in use, and the i-node table, against their
+ * checksums (reads also check what they read, failing if it is corrupt)
+ * Input:
+ * 	- number of threads to split the work among
+ * 	- where to store the number of blocks checked and found corrupt
+ * Returns 0 if the scrub ran, -1 otherwise.
+ */
+int tfs_scrub(int threads, scrub_stats_t *stats);
+
+/* Called (with tecnicofs locked) when a session's lease on a file is
+ * recalled, because the file's contents are changing */
+typedef void (*tfs_recall_function)(int session, int inumber);
+
+/* Sets the function that recalls leases (see tfs_lease) */
+void tfs_set_recall_function(tfs_recall_function recall);
+
+/* Grants the session of an open file read leases: on the name it was
+ * opened by (a lease on the directory, recalled when the directory changes)
+ * and, if they fit in the buffer, on its contents (recalled by any write or
+ * truncation of the file). Until a lease is recalled, the session may keep
+ * using what it got now. Leases last until recalled or until the session is
+ * closed.
+ * Input:
+ * 	- file handle (of a file in the live file system)
+ * 	- where to store the leases granted: the file's and directory's
+ * 	  i-numbers (named in recalls) and the file's size (-1 if its contents
+ * 	  were not leased)
+ * 	- buffer for the file's contents, and its length
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_lease(int fhandle, lease_t *lease, void *buffer, size_t len);
+
+/* Maps the contents of an open file: pins its data block, so that it is
+ * not written to (writes to the file go to a copy of it) and can be read in
+ * place, from the memory file of the data blocks, until tfs_munmap. The
+ * session gets a read lease on the file, recalled once the mapping is out of
+ * date.
+ * Input:
+ * 	- file handle (of an uncompressed file in the live file system, with
+ * 	  TecnicoFS initialized with shared_data)
+ * 	- where to store where the contents are
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_mmap(int fhandle, mapping_t *mapping);
+
+/* Unpins a data block a session mapped with tfs_mmap (sessions that are
+ * closed unpin theirs)
+ * Input:
+ * 	- session identifier
+ * 	- the mapping's block
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_munmap(int session, int block);
+
+/* Returns the memory file the data blocks are in (see tfs_mmap), -1 if
+ * TecnicoFS was not initialized with shared_data */
+int tfs_data_fd();
+
+/* Lists the root directory, with the attributes of each entry (whose size
+ * includes writes still buffered)
+ * Input:
+ * 	- where to start (0 for the first entry), updated to where to go on
+ * 	  from (-1 once no entry is left)
+ * 	- where to store the entries, and how many fit there
+ * Returns the number of entries listed (0 once no entry is left), -1 if
+ * unsuccessful
+ */
+int tfs_readdir_plus(int *cookie, tfs_dirent_t *entries, int max);
+
 /* Copies the contents of a file that exists in TecnicoFS to the contents
  * of another file in the OS' file system tree (outside TecnicoFS).
  * Input:
@@ -1,26 +1,137 @@
+#define _GNU_SOURCE /* MAP_ANONYMOUS, MAP_NORESERVE, madvise and memfd_create */
+
 #include "state.h"
+#include "crc32c.h"
+#include "dedup.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /* Persistent FS state  (in reality, it should be maintained in secondary
  * memory; for simplicity, this project maintains it in primary memory) */
 
+/* The i-node table and the data blocks are only reserved (as anonymous
+ * mappings, or, for data blocks to be mapped by other processes, a shared
+ * mapping of a memory file) by state_init; the OS commits their memory as
+ * it is first touched, and data blocks give it back when they are freed */
+
 /* I-node table */
-static inode_t inode_table[INODE_TABLE_SIZE];
+static inode_t *inode_table;
 static char freeinode_ts[INODE_TABLE_SIZE];
 
 /* Data blocks */
-static char fs_data[BLOCK_SIZE * DATA_BLOCKS];
+static char *fs_data;
+static int fs_data_fd = -1; /* the memory file backing fs_data, if shared */
 static char free_blocks[DATA_BLOCKS];
+/* number of i-nodes (live or in snapshots) referencing each taken block */
+static int block_refs[DATA_BLOCKS];
+
+/* Checksums (CRC32C) of the data blocks in use, and of the i-node table,
+ * in blocks of INODES_PER_BLOCK i-nodes; they are updated (sealed) after
+ * every change, and checked when read and when the FS is scrubbed */
+#define INODES_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(inode_t)))
+#define INODE_BLOCKS                                                           \
+    ((INODE_TABLE_SIZE + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK)
+
+static uint32_t block_crc[DATA_BLOCKS];
+static uint32_t inode_block_crc[INODE_BLOCKS];
+
+/* Deduplication: blocks in the fingerprint index, and their hashes */
+static bool dedup_enabled;
+static bool block_indexed[DATA_BLOCKS];
+static uint64_t block_hash[DATA_BLOCKS];
+static dedup_stats_t dedup_stats;
+
+/* Snapshots: copies of the i-node table, whose data blocks are shared (by
+ * reference count) with the live file system until it writes to them */
+typedef struct {
+    inode_t s_inodes[INODE_TABLE_SIZE];
+    char s_taken[INODE_TABLE_SIZE];
+} snapshot_t;
+
+static snapshot_t *snapshots[MAX_SNAPSHOTS];
+
+/* Backing file (see backing_meta_t). What changes is marked dirty, and
+ * state_sync_stage/state_sync_write write it out. */
+static int backing_fd = -1;
+static uint64_t backing_seq;
+/* where each data block is in the backing file, as of its latest slot */
+static char block_area[DATA_BLOCKS];
+static bool block_dirty[DATA_BLOCKS];
+static bool inodes_dirty;
+
+/* What the next state_sync_write writes: copies of the dirty blocks (in
+ * block order), where they go, and the metadata */
+static char *sync_data;
+static int sync_blocks[DATA_BLOCKS];
+static int sync_count;
+static char sync_area[DATA_BLOCKS];
+static backing_meta_t sync_meta;
+
+/* The blocks the checkpoint being written holds a reference to (when they
+ * are in a memory file, which a forked child shares instead of copying) */
+static bool checkpoint_pinned[DATA_BLOCKS];
+
+/* Actual sizes of the two mappings, and the granularity at which memory can
+ * be given back to the OS */
+static size_t inode_table_len;
+static size_t fs_data_len;
+static size_t page_size;
+
+/* Allocation groups: each one owns a range of the i-node table and of the
+ * data blocks, with its own count of free entries (so that full groups are
+ * skipped without scanning). Each thread allocates from its preferred group
+ * first, and only then steals from the others, so that threads' files end
+ * up apart. This is only about where things are allocated: like the rest of
+ * the state, groups are only changed with the file system locked (see
+ * single_global_lock in operations.c), so they need no locks of their own. */
+typedef struct {
+    int ag_first_inumber;
+    int ag_end_inumber;
+    int ag_free_inodes;
+    int ag_first_block;
+    int ag_end_block;
+    int ag_free_blocks;
+} allocation_group_t;
+
+static allocation_group_t groups[ALLOCATION_GROUPS];
+static int next_preferred_group;
+static _Thread_local int preferred_group = -1;
 
 /* Volatile FS state */
 
-static open_file_entry_t open_file_table[MAX_OPEN_FILES];
-static char free_open_file_entries[MAX_OPEN_FILES];
+/* Sessions: each one has a table of open files, which doubles (up to
+ * MAX_SESSION_FILES) when it fills, and a stack of its free handles. Entries
+ * are allocated as files are opened, so that their addresses do not change
+ * when the table grows. */
+typedef struct {
+    open_file_entry_t **se_files; /* NULL where the handle is free */
+    int *se_free;                 /* free handles (indices), lowest on top */
+    int se_free_count;
+    int se_capacity;
+} session_t;
+
+static session_t **sessions;
+static int sessions_capacity;
+
+/* Open i-nodes: one entry for every live i-node, then one for every i-node
+ * of each snapshot */
+static open_inode_t open_inodes[(1 + MAX_SNAPSHOTS) * INODE_TABLE_SIZE];
 
 static inline bool valid_inumber(int inumber) {
     return inumber >= 0 && inumber < INODE_TABLE_SIZE;
@@ -30,8 +141,14 @@ static inline bool valid_block_number(int block_number) {
     return block_number >= 0 && block_number < DATA_BLOCKS;
 }
 
-static inline bool valid_file_handle(int file_handle) {
-    return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
+static inline bool valid_snapshot(int snapshot) {
+    return snapshot >= 0 && snapshot < MAX_SNAPSHOTS &&
+           snapshots[snapshot] != NULL;
+}
+
+static inline bool valid_session(int session) {
+    return session >= 0 && session < sessions_capacity &&
+           sessions[session] != NULL;
 }
 
 /**
@@ -61,24 +178,380 @@ static void insert_delay() {
     }
 }
 
+/*
+ * Reserves *size bytes of zero-filled memory, without committing it.
+ * With huge_pages, the region is backed by (and *size rounded up to) huge
+ * pages if the system has them reserved, or else marked as eligible for
+ * transparent huge pages; *huge tells whether the former happened.
+ * Returns: pointer to the region if successful, NULL otherwise
+ */
+static void *region_reserve(size_t *size, bool huge_pages, bool *huge) {
+    void *region;
+
+    *huge = false;
+    if (huge_pages) {
+        size_t len = (*size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE *
+                     HUGE_PAGE_SIZE;
+        /* no MAP_NORESERVE here: without a reservation, a fault with the
+         * huge page pool exhausted would kill the process with SIGBUS */
+        region = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region != MAP_FAILED) {
+            *size = len;
+            *huge = true;
+            return region;
+        }
+    }
+
+    region = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        return NULL;
+    }
+    if (huge_pages) {
+        /* best effort: the kernel may not support transparent huge pages */
+        madvise(region, *size, MADV_HUGEPAGE);
+    }
+    return region;
+}
+
+/*
+ * Like region_reserve, but the region is a shared mapping of a memory file
+ * (of *size bytes, and backed by huge pages under the same conditions),
+ * which other processes can map too.
+ * Returns: pointer to the region if successful, NULL otherwise; *fd is set
+ * to the memory file
+ */
+static void *region_share(size_t *size, bool huge_pages, bool *huge,
+                          int *fd) {
+    void *region;
+
+    *huge = false;
+    if (huge_pages) {
+        size_t len = (*size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE *
+                     HUGE_PAGE_SIZE;
+        *fd = memfd_create("tfs_data", MFD_CLOEXEC | MFD_HUGETLB);
+        if (*fd != -1 && ftruncate(*fd, (off_t)len) == 0) {
+            region = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          *fd, 0);
+            if (region != MAP_FAILED) {
+                *size = len;
+                *huge = true;
+                return region;
+            }
+        }
+        if (*fd != -1) {
+            close(*fd);
+        }
+    }
+
+    *fd = memfd_create("tfs_data", MFD_CLOEXEC);
+    if (*fd == -1) {
+        return NULL;
+    }
+    if (ftruncate(*fd, (off_t)*size) != 0 ||
+        (region = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd,
+                       0)) == MAP_FAILED) {
+        close(*fd);
+        *fd = -1;
+        return NULL;
+    }
+    if (huge_pages) {
+        madvise(region, *size, MADV_HUGEPAGE);
+    }
+    return region;
+}
+
+static int pread_all(int fd, void *buf, size_t len, off_t offset) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t got = pread(fd, p, len, offset);
+        if (got <= 0) {
+            return -1;
+        }
+        p += got;
+        len -= (size_t)got;
+        offset += got;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, void const *buf, size_t len, off_t offset) {
+    char const *p = buf;
+    while (len > 0) {
+        ssize_t written = pwrite(fd, p, len, offset);
+        if (written <= 0) {
+            return -1;
+        }
+        p += written;
+        len -= (size_t)written;
+        offset += written;
+    }
+    return 0;
+}
+
+/*
+ * Reads a metadata slot of a backing file (or checkpoint image) into
+ * sync_meta.
+ * Returns: true if it holds valid metadata for this geometry
+ */
+static bool backing_read_slot(int fd, int slot) {
+    if (pread_all(fd, &sync_meta, sizeof(sync_meta),
+                  (off_t)((size_t)slot * BACKING_SLOT)) == -1) {
+        return false;
+    }
+    return sync_meta.bm_magic == BACKING_MAGIC &&
+           sync_meta.bm_crc ==
+               crc32c(0, &sync_meta.bm_seq,
+                      sizeof(sync_meta) -
+                          offsetof(backing_meta_t, bm_seq)) &&
+           sync_meta.bm_inodes == INODE_TABLE_SIZE &&
+           sync_meta.bm_blocks == DATA_BLOCKS &&
+           sync_meta.bm_block_size == BLOCK_SIZE;
+}
+
+/*
+ * Reads the latest valid metadata slot of a backing file (or checkpoint
+ * image) into sync_meta
+ * Returns: the slot, -1 if neither is valid
+ */
+static int backing_latest(int fd) {
+    int latest = -1;
+    uint64_t seq = 0;
+    for (int slot = 0; slot < 2; slot++) {
+        if (backing_read_slot(fd, slot) &&
+            (latest == -1 || sync_meta.bm_seq > seq)) {
+            latest = slot;
+            seq = sync_meta.bm_seq;
+        }
+    }
+    if (latest != -1 && !backing_read_slot(fd, latest)) {
+        return -1;
+    }
+    return latest;
+}
+
+/*
+ * Opens (creating it if needed) the backing file, which later syncs write
+ * to (continuing its sequence of metadata slots).
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int backing_open(char const *path) {
+    backing_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    sync_data = malloc((size_t)DATA_BLOCKS * BLOCK_SIZE);
+    if (backing_fd == -1 || sync_data == NULL) {
+        state_backing_detach();
+        return -1;
+    }
+
+    off_t len = (off_t)BACKING_BLOCK(DATA_BLOCKS, 1);
+    if (lseek(backing_fd, 0, SEEK_END) < len &&
+        ftruncate(backing_fd, len) == -1) {
+        state_backing_detach();
+        return -1;
+    }
+
+    if (backing_latest(backing_fd) == -1) {
+        backing_seq = 0;
+        memset(block_area, 0, sizeof(block_area));
+    } else {
+        backing_seq = sync_meta.bm_seq;
+        memcpy(block_area, sync_meta.bm_block_area, sizeof(block_area));
+    }
+    return 0;
+}
+
 /*
  * Initializes FS state
+ * Input:
+ *  - params: initialization parameters
+ * Returns: 0 if successful, -1 otherwise
  */
-void state_init() {
+int state_init(tfs_params const *params) {
+    bool huge;
+
+    inode_table_len = INODE_TABLE_SIZE * sizeof(inode_t);
+    inode_table = region_reserve(&inode_table_len, params->huge_pages, &huge);
+    if (inode_table == NULL) {
+        return -1;
+    }
+
+    fs_data_len = (size_t)BLOCK_SIZE * DATA_BLOCKS;
+    if (params->shared_data) {
+        fs_data = region_share(&fs_data_len, params->huge_pages, &huge,
+                               &fs_data_fd);
+    } else {
+        fs_data = region_reserve(&fs_data_len, params->huge_pages, &huge);
+    }
+    if (fs_data == NULL) {
+        munmap(inode_table, inode_table_len);
+        inode_table = NULL;
+        return -1;
+    }
+    page_size = huge ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+
     for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
         freeinode_ts[i] = FREE;
     }
+    for (int i = 0; i < INODE_BLOCKS; i++) {
+        inode_seal(i * INODES_PER_BLOCK);
+    }
 
+    /* (a previous instance in this process may have left them set) */
     for (size_t i = 0; i < DATA_BLOCKS; i++) {
         free_blocks[i] = FREE;
+        block_refs[i] = 0;
+        block_crc[i] = 0;
+        block_indexed[i] = false;
+        block_dirty[i] = false;
+        checkpoint_pinned[i] = false;
+    }
+    inodes_dirty = false;
+
+    dedup_enabled = params->dedup;
+    memset(&dedup_stats, 0, sizeof(dedup_stats));
+    if (dedup_enabled && dedup_init(DATA_BLOCKS) != 0) {
+        return -1;
+    }
+
+    for (int g = 0; g < ALLOCATION_GROUPS; g++) {
+        allocation_group_t *group = &groups[g];
+        group->ag_first_inumber = g * INODE_TABLE_SIZE / ALLOCATION_GROUPS;
+        group->ag_end_inumber = (g + 1) * INODE_TABLE_SIZE / ALLOCATION_GROUPS;
+        group->ag_free_inodes = group->ag_end_inumber - group->ag_first_inumber;
+        group->ag_first_block = g * DATA_BLOCKS / ALLOCATION_GROUPS;
+        group->ag_end_block = (g + 1) * DATA_BLOCKS / ALLOCATION_GROUPS;
+        group->ag_free_blocks = group->ag_end_block - group->ag_first_block;
+    }
+    /* the thread initializing the FS starts from group 0, so that the root
+     * directory gets i-node ROOT_DIR_INUM */
+    next_preferred_group = 1;
+    preferred_group = 0;
+
+    memset(open_inodes, 0, sizeof(open_inodes));
+
+    if (params->backing_file != NULL &&
+        backing_open(params->backing_file) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void state_destroy() {
+    for (int session = 0; session < sessions_capacity; session++) {
+        if (sessions[session] != NULL) {
+            for (int fhandle = session_next_file(session, -1); fhandle != -1;
+                 fhandle = session_next_file(session, fhandle)) {
+                remove_from_open_file_table(fhandle);
+            }
+            session_destroy(session);
+        }
+    }
+    free(sessions);
+    sessions = NULL;
+    sessions_capacity = 0;
+
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        free(snapshots[i]);
+        snapshots[i] = NULL;
+    }
+    if (dedup_enabled) {
+        dedup_destroy();
+    }
+    if (fs_data != NULL) {
+        munmap(fs_data, fs_data_len);
+        fs_data = NULL;
+    }
+    if (fs_data_fd != -1) {
+        close(fs_data_fd);
+        fs_data_fd = -1;
+    }
+    state_backing_detach();
+    if (inode_table != NULL) {
+        munmap(inode_table, inode_table_len);
+        inode_table = NULL;
+    }
+}
+
+/*
+ * Returns the allocation group the calling thread allocates from first
+ * (assigning groups to threads round-robin)
+ */
+static int thread_group() {
+    if (preferred_group == -1) {
+        preferred_group =
+            __atomic_fetch_add(&next_preferred_group, 1, __ATOMIC_RELAXED) %
+            ALLOCATION_GROUPS;
+    }
+    return preferred_group;
+}
+
+/* Group g owns entries [g * n / ALLOCATION_GROUPS, (g + 1) * n /
+ * ALLOCATION_GROUPS) of a map with n entries */
+static inline int group_of(int index, int n) {
+    return ((index + 1) * ALLOCATION_GROUPS - 1) / n;
+}
+
+static inline allocation_group_t *inode_group(int inumber) {
+    return &groups[group_of(inumber, INODE_TABLE_SIZE)];
+}
+
+static inline allocation_group_t *block_group(int block_number) {
+    return &groups[group_of(block_number, DATA_BLOCKS)];
+}
+
+/*
+ * Takes the first free entry of a free map range [first, end) whose free
+ * entries are counted in *free_count.
+ * Returns: index of the entry taken, -1 if none is free
+ */
+static int free_map_take(char *free_map, int first, int end, int *free_count) {
+    if (*free_count == 0) {
+        return -1;
+    }
+
+    for (int i = first; i < end; i++) {
+        if (i * (int)sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
+            insert_delay(); // simulate storage access delay to the free map
+        }
+
+        if (free_map[i] == FREE) {
+            free_map[i] = TAKEN;
+            (*free_count)--;
+            return i;
+        }
     }
+    return -1;
+}
+
+/*
+ * Takes an entry of the i-node table, trying the calling thread's group
+ * first.
+ * Returns: the i-node's number, -1 if the table is full
+ */
+static int inode_take() {
+    int first = thread_group();
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
+    for (int i = 0; i < ALLOCATION_GROUPS; i++) {
+        allocation_group_t *group = &groups[(first + i) % ALLOCATION_GROUPS];
+        int inumber =
+            free_map_take(freeinode_ts, group->ag_first_inumber,
+                          group->ag_end_inumber, &group->ag_free_inodes);
+        if (inumber != -1) {
+            return inumber;
+        }
     }
+    return -1;
 }
 
-void state_destroy() { /* nothing to do */
+/*
+ * Gives back an entry of the i-node table to its allocation group.
+ */
+static void inode_put(int inumber) {
+    freeinode_ts[inumber] = FREE;
+    inode_group(inumber)->ag_free_inodes++;
+    inodes_dirty = true;
 }
 
 /*
@@ -89,48 +562,49 @@ void state_destroy() { /* nothing to do */
  *  new i-node's number if successfully created, -1 otherwise
  */
 int inode_create(inode_type n_type) {
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * (int)sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
+    /* Finds a free entry in i-node table, and takes it for the new i-node */
+    int inumber = inode_take();
+    if (inumber == -1) {
+        return -1;
+    }
+
+    insert_delay(); // simulate storage access delay (to i-node)
+    inode_table[inumber].i_node_type = n_type;
+    inode_table[inumber].i_compressed = false;
+
+    if (n_type == T_DIRECTORY) {
+        /* Initializes directory (filling its block with empty
+         * entries, labeled with inumber==-1) */
+        int b = data_block_alloc();
+        if (b == -1) {
+            inode_seal(inumber);
+            inode_put(inumber);
+            return -1;
         }
 
-        /* Finds first free entry in i-node table */
-        if (freeinode_ts[inumber] == FREE) {
-            /* Found a free entry, so takes it for the new i-node*/
-            freeinode_ts[inumber] = TAKEN;
-            insert_delay(); // simulate storage access delay (to i-node)
-            inode_table[inumber].i_node_type = n_type;
-
-            if (n_type == T_DIRECTORY) {
-                /* Initializes directory (filling its block with empty
-                 * entries, labeled with inumber==-1) */
-                int b = data_block_alloc();
-                if (b == -1) {
-                    freeinode_ts[inumber] = FREE;
-                    return -1;
-                }
-
-                inode_table[inumber].i_size = BLOCK_SIZE;
-                inode_table[inumber].i_data_block = b;
-
-                dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-                if (dir_entry == NULL) {
-                    freeinode_ts[inumber] = FREE;
-                    return -1;
-                }
-
-                for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    dir_entry[i].d_inumber = -1;
-                }
-            } else {
-                /* In case of a new file, simply sets its size to 0 */
-                inode_table[inumber].i_size = 0;
-                inode_table[inumber].i_data_block = -1;
-            }
-            return inumber;
+        inode_table[inumber].i_size = BLOCK_SIZE;
+        inode_table[inumber].i_data_block = b;
+        inode_seal(inumber);
+
+        dir_block_t *dir_block = (dir_block_t *)data_block_get(b);
+        if (dir_block == NULL) {
+            data_block_free(b);
+            inode_put(inumber);
+            return -1;
+        }
+
+        memset(dir_block->db_tags, 0, sizeof(dir_block->db_tags));
+        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+            dir_block->db_entries[i].d_inumber = -1;
         }
+        data_block_seal(b);
+    } else {
+        /* In case of a new file, simply sets its size to 0 */
+        inode_table[inumber].i_size = 0;
+        inode_table[inumber].i_data_block = -1;
+        inode_seal(inumber);
     }
-    return -1;
+    return inumber;
 }
 
 /*
@@ -148,7 +622,7 @@ int inode_delete(int inumber) {
         return -1;
     }
 
-    freeinode_ts[inumber] = FREE;
+    inode_put(inumber);
 
     if (inode_table[inumber].i_size > 0) {
         if (data_block_free(inode_table[inumber].i_data_block) == -1) {
@@ -174,6 +648,92 @@ inode_t *inode_get(int inumber) {
     return &inode_table[inumber];
 }
 
+/*
+ * Tells whether an i-node is in use (TAKEN in the free map).
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+bool inode_in_use(int inumber) {
+    return valid_inumber(inumber) && freeinode_ts[inumber] == TAKEN;
+}
+
+/*
+ * Returns the checksum of the i-node table block holding an i-node.
+ * Input:
+ *  - first: number of the first i-node in the block
+ */
+static uint32_t inode_block_checksum(int first) {
+    int count = INODE_TABLE_SIZE - first;
+    if (count > INODES_PER_BLOCK) {
+        count = INODES_PER_BLOCK;
+    }
+    return crc32c(0, &inode_table[first], (size_t)count * sizeof(inode_t));
+}
+
+/*
+ * Updates the checksum of the i-node table block holding an i-node (after
+ * the i-node is changed).
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+void inode_seal(int inumber) {
+    if (valid_inumber(inumber)) {
+        int k = inumber / INODES_PER_BLOCK;
+        inode_block_crc[k] = inode_block_checksum(k * INODES_PER_BLOCK);
+        inodes_dirty = true;
+    }
+}
+
+/*
+ * Checks the i-node table block holding an i-node against its checksum.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: 0 if it matches, -1 otherwise
+ */
+int inode_verify(int inumber) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+    int k = inumber / INODES_PER_BLOCK;
+    return inode_block_checksum(k * INODES_PER_BLOCK) == inode_block_crc[k]
+               ? 0
+               : -1;
+}
+
+/*
+ * Returns the tag of a directory entry's name: a 1-byte hash (FNV-1a) of the
+ * part of the name that is stored, which is never 0 (the tag of free
+ * entries).
+ */
+static unsigned char dir_tag(char const *name) {
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < MAX_FILE_NAME && name[i] != '\0'; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619U;
+    }
+    unsigned char tag = (unsigned char)(h ^ (h >> 8) ^ (h >> 16) ^ (h >> 24));
+    return tag == 0 ? 1 : tag;
+}
+
+/*
+ * Returns a bit mask of the directory entries (among the 16 starting at
+ * first) whose tag is the given one.
+ */
+static unsigned int dir_match(dir_block_t const *dir_block, int first,
+                              unsigned char tag) {
+#ifdef __SSE2__
+    __m128i tags =
+        _mm_loadu_si128((__m128i const *)&dir_block->db_tags[first]);
+    __m128i eq = _mm_cmpeq_epi8(tags, _mm_set1_epi8((char)tag));
+    return (unsigned int)_mm_movemask_epi8(eq);
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < 16; i++) {
+        mask |= (unsigned int)(dir_block->db_tags[first + i] == tag) << i;
+    }
+    return mask;
+#endif
+}
+
 /*
  * Adds an entry to the i-node directory data.
  * Input:
@@ -196,19 +756,35 @@ int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
         return -1;
     }
 
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block);
-    if (dir_entry == NULL) {
+    /* Locates the block containing the directory's entries (copying it
+     * first, if it is shared with a snapshot) */
+    int b = data_block_cow(inode_table[inumber].i_data_block);
+    if (b == -1) {
+        return -1;
+    }
+    inode_table[inumber].i_data_block = b;
+    inode_seal(inumber);
+
+    dir_block_t *dir_block = (dir_block_t *)data_block_get(b);
+    if (dir_block == NULL) {
         return -1;
     }
 
-    /* Finds and fills the first empty entry */
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = 0;
+    /* Finds and fills the first empty entry (the tags past the last entry
+     * are always 0, so they must be skipped) */
+    for (int first = 0; first < DIR_TAGS; first += 16) {
+        unsigned int mask = dir_match(dir_block, first, 0);
+        if (mask != 0) {
+            int i = first + __builtin_ctz(mask);
+            if (i >= (int)MAX_DIR_ENTRIES) {
+                break;
+            }
+            dir_entry_t *dir_entry = &dir_block->db_entries[i];
+            dir_entry->d_inumber = sub_inumber;
+            strncpy(dir_entry->d_name, sub_name, MAX_FILE_NAME - 1);
+            dir_entry->d_name[MAX_FILE_NAME - 1] = 0;
+            dir_block->db_tags[i] = dir_tag(dir_entry->d_name);
+            data_block_seal(b);
             return 0;
         }
     }
@@ -216,6 +792,41 @@ int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
     return -1;
 }
 
+/* Looks for a given name inside a directory's entries
+ * Input:
+ * 	- directory's i-node
+ * 	- name to search
+ * 	Returns i-number linked to the target name, -1 if not found
+ */
+static int dir_find(inode_t const *dir, char const *sub_name) {
+    if (dir->i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+
+    /* Locates the block containing the directory's entries */
+    dir_block_t *dir_block = (dir_block_t *)data_block_get(dir->i_data_block);
+    if (dir_block == NULL) {
+        return -1;
+    }
+
+    /* Scans the tags, 16 at a time, and only compares the names of the
+     * entries whose tag matches the target name's (free entries and the
+     * tags past the last entry are 0, which never matches) */
+    unsigned char tag = dir_tag(sub_name);
+    for (int first = 0; first < DIR_TAGS; first += 16) {
+        for (unsigned int mask = dir_match(dir_block, first, tag); mask != 0;
+             mask &= mask - 1) {
+            dir_entry_t *dir_entry =
+                &dir_block->db_entries[first + __builtin_ctz(mask)];
+            if (strncmp(dir_entry->d_name, sub_name, MAX_FILE_NAME) == 0) {
+                return dir_entry->d_inumber;
+            }
+        }
+    }
+
+    return -1;
+}
+
 /* Looks for a given name inside a directory
  * Input:
  * 	- parent directory's i-node number
@@ -224,66 +835,190 @@ int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
  */
 int find_in_dir(int inumber, char const *sub_name) {
     insert_delay(); // simulate storage access delay to i-node with inumber
-    if (!valid_inumber(inumber) ||
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    return dir_find(&inode_table[inumber], sub_name);
+}
+
+/* Lists the entries of a directory, in the order they are in its block
+ * Input:
+ * 	- directory's i-node number
+ * 	- where to start: the entry's position in the block (0 for the first)
+ * 	- where to store the entries, and how many fit there
+ * 	- where to store the position to go on from (-1 if no entry is left)
+ * 	Returns the number of entries stored, -1 if unsuccessful
+ */
+int dir_list(int inumber, int cookie, dir_entry_t *entries, int max,
+             int *next_cookie) {
+    insert_delay(); // simulate storage access delay to i-node with inumber
+    if (!valid_inumber(inumber) || cookie < 0 ||
         inode_table[inumber].i_node_type != T_DIRECTORY) {
         return -1;
     }
 
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block);
-    if (dir_entry == NULL) {
+    dir_block_t *dir_block =
+        (dir_block_t *)data_block_get(inode_table[inumber].i_data_block);
+    if (dir_block == NULL) {
         return -1;
     }
 
-    /* Iterates over the directory entries looking for one that has the target
-     * name */
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
-            return dir_entry[i].d_inumber;
+    /* free entries have tag 0 */
+    int count = 0;
+    int i = cookie;
+    for (; i < (int)MAX_DIR_ENTRIES && count < max; i++) {
+        if (dir_block->db_tags[i] != 0) {
+            entries[count++] = dir_block->db_entries[i];
         }
-
-    return -1;
+    }
+    while (i < (int)MAX_DIR_ENTRIES && dir_block->db_tags[i] == 0) {
+        i++;
+    }
+    *next_cookie = i < (int)MAX_DIR_ENTRIES ? i : -1;
+    return count;
 }
 
 /*
- * Allocated a new data block
+ * Allocated a new data block, trying the calling thread's allocation group
+ * first
  * Returns: block index if successful, -1 otherwise
  */
 int data_block_alloc() {
-    for (int i = 0; i < DATA_BLOCKS; i++) {
-        if (i * (int)sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
-        }
+    int first = thread_group();
 
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
-            return i;
+    for (int i = 0; i < ALLOCATION_GROUPS; i++) {
+        allocation_group_t *group = &groups[(first + i) % ALLOCATION_GROUPS];
+        int block_number =
+            free_map_take(free_blocks, group->ag_first_block,
+                          group->ag_end_block, &group->ag_free_blocks);
+        if (block_number != -1) {
+            block_refs[block_number] = 1;
+            return block_number;
         }
     }
     return -1;
 }
 
-/* Frees a data block
+/*
+ * Gives the memory of the pages holding a (free) data block back to the OS,
+ * unless another block sharing those pages is still in use.
  * Input
  * 	- the block index
- * Returns: 0 if success, -1 otherwise
  */
-int data_block_free(int block_number) {
-    if (!valid_block_number(block_number)) {
-        return -1;
+static void data_block_release(int block_number) {
+    size_t start = (size_t)block_number * BLOCK_SIZE / page_size * page_size;
+    size_t end = ((size_t)block_number + 1) * BLOCK_SIZE;
+    end = (end + page_size - 1) / page_size * page_size;
+
+    int first = (int)(start / BLOCK_SIZE);
+    int last = (int)(end / BLOCK_SIZE) - 1;
+    if (last >= DATA_BLOCKS) {
+        last = DATA_BLOCKS - 1;
     }
 
-    insert_delay(); // simulate storage access delay to free_blocks
-    free_blocks[block_number] = FREE;
-    return 0;
+    bool in_use = false;
+    for (int b = first; b <= last && !in_use; b++) {
+        in_use = free_blocks[b] == TAKEN;
+    }
+    if (!in_use) {
+        /* the pages read as zeros (and are committed again) if touched
+         * later; those of a memory file must be removed from it */
+        madvise(fs_data + start, end - start,
+                fs_data_fd != -1 ? MADV_REMOVE : MADV_DONTNEED);
+    }
 }
 
-/* Returns a pointer to the contents of a given block
- * Input:
- * 	- Block's index
- * Returns: pointer to the first byte of the block, NULL otherwise
+/* Removes a data block from the fingerprint index (before its contents
+ * change or it is freed)
+ * Input
+ * 	- the block index
+ */
+static void data_block_unindex(int block_number) {
+    if (block_indexed[block_number]) {
+        dedup_remove(block_hash[block_number], block_number);
+        block_indexed[block_number] = false;
+    }
+}
+
+/* Drops a reference to a data block, freeing it if it was the last one
+ * Input
+ * 	- the block index
+ * Returns: 0 if success, -1 otherwise
+ */
+int data_block_free(int block_number) {
+    if (!valid_block_number(block_number)) {
+        return -1;
+    }
+
+    insert_delay(); // simulate storage access delay to free_blocks
+    if (--block_refs[block_number] > 0) {
+        /* still shared (with a snapshot or an identical file) */
+        return 0;
+    }
+    data_block_unindex(block_number);
+    free_blocks[block_number] = FREE;
+    block_group(block_number)->ag_free_blocks++;
+
+    data_block_release(block_number);
+    return 0;
+}
+
+/* Adds a reference to a data block (which becomes shared)
+ * Input
+ * 	- the block index
+ * Returns: true if successful, false if the block is free
+ */
+bool data_block_ref(int block_number) {
+    bool taken = block_refs[block_number] > 0;
+    if (taken) {
+        block_refs[block_number]++;
+    }
+    return taken;
+}
+
+/* Prepares a data block to be written to: if it is shared, it is replaced
+ * by a private copy (and the reference to the original is dropped)
+ * Input
+ * 	- the block index
+ * Returns: index of the block to write to, -1 otherwise
+ */
+int data_block_cow(int block_number) {
+    if (!valid_block_number(block_number)) {
+        return -1;
+    }
+
+    if (block_refs[block_number] == 1) {
+        /* written in place, so it no longer holds what was indexed */
+        data_block_unindex(block_number);
+        return block_number;
+    }
+
+    int copy = data_block_alloc();
+    if (copy == -1) {
+        return -1;
+    }
+    void *dest = data_block_get(copy);
+    void *src = data_block_get(block_number);
+    if (dest == NULL || src == NULL) {
+        data_block_free(copy);
+        return -1;
+    }
+    memcpy(dest, src, BLOCK_SIZE);
+    block_crc[copy] = block_crc[block_number];
+    block_dirty[copy] = true;
+    data_block_free(block_number);
+    return copy;
+}
+
+/* Returns the memory file the data blocks are in (block b at offset
+ * b * BLOCK_SIZE), -1 if they are not shared */
+int data_region_fd() { return fs_data_fd; }
+
+/* Returns a pointer to the contents of a given block
+ * Input:
+ * 	- Block's index
+ * Returns: pointer to the first byte of the block, NULL otherwise
  */
 void *data_block_get(int block_number) {
     if (!valid_block_number(block_number)) {
@@ -294,46 +1029,1150 @@ void *data_block_get(int block_number) {
     return &fs_data[block_number * BLOCK_SIZE];
 }
 
-/* Add new entry to the open file table
+/* Updates the checksum of a data block (after its contents change); the
+ * block was just written, so it is read straight from memory, without a
+ * simulated storage access
+ * Input:
+ * 	- Block's index
+ */
+void data_block_seal(int block_number) {
+    if (valid_block_number(block_number)) {
+        block_crc[block_number] =
+            crc32c(0, &fs_data[block_number * BLOCK_SIZE], BLOCK_SIZE);
+        block_dirty[block_number] = true;
+    }
+}
+
+/* Checks a data block against its checksum
+ * Input:
+ * 	- Block's index
+ * Returns: 0 if it matches, -1 otherwise
+ */
+int data_block_verify(int block_number) {
+    if (!valid_block_number(block_number)) {
+        return -1;
+    }
+    return crc32c(0, &fs_data[block_number * BLOCK_SIZE], BLOCK_SIZE) ==
+                   block_crc[block_number]
+               ? 0
+               : -1;
+}
+
+/* Makes a full data block share the storage of an identical block, if
+ * there is one in the fingerprint index (or else adds it to the index).
+ * Does nothing if deduplication is disabled.
+ * Input
+ * 	- the block index
+ * Returns: index of the block now holding the contents, -1 otherwise
+ */
+int data_block_dedup(int block_number) {
+    if (!valid_block_number(block_number)) {
+        return -1;
+    }
+    if (!dedup_enabled) {
+        return block_number;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* the block was just written, so it is hashed (and compared) straight
+     * from memory, without a simulated storage access */
+    char const *data = &fs_data[block_number * BLOCK_SIZE];
+    uint64_t hash = dedup_hash(data, BLOCK_SIZE);
+    int ret = block_number;
+
+    int other = dedup_lookup(hash);
+    if (other == -1) {
+        if (dedup_insert(hash, block_number) == 0) {
+            block_hash[block_number] = hash;
+            block_indexed[block_number] = true;
+        }
+    } else if (other != block_number &&
+               memcmp(&fs_data[other * BLOCK_SIZE], data, BLOCK_SIZE) == 0 &&
+               data_block_ref(other)) {
+        data_block_free(block_number);
+        ret = other;
+        dedup_stats.ds_blocks_shared++;
+        dedup_stats.ds_bytes_saved += BLOCK_SIZE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    dedup_stats.ds_blocks_hashed++;
+    dedup_stats.ds_time_ns +=
+        (unsigned long long)((end.tv_sec - start.tv_sec) * 1000000000L +
+                             (end.tv_nsec - start.tv_nsec));
+    return ret;
+}
+
+/* Copies the block deduplication statistics to stats */
+void dedup_stats_get(dedup_stats_t *stats) { *stats = dedup_stats; }
+
+/* A scrub worker checks the i-node table blocks and data blocks numbered
+ * [sw_first, sw_end), counting i-node table blocks first */
+typedef struct {
+    pthread_t sw_thread;
+    int sw_first;
+    int sw_end;
+    scrub_stats_t sw_stats;
+} scrub_worker_t;
+
+static void *scrub_worker(void *arg) {
+    scrub_worker_t *worker = arg;
+    scrub_stats_t *stats = &worker->sw_stats;
+
+    for (int i = worker->sw_first; i < worker->sw_end; i++) {
+        if (i < INODE_BLOCKS) {
+            insert_delay(); // simulate storage access delay to i-nodes
+            stats->ss_inode_blocks_checked++;
+            if (inode_verify(i * INODES_PER_BLOCK) == -1) {
+                stats->ss_inode_blocks_corrupt++;
+            }
+            continue;
+        }
+
+        int b = i - INODE_BLOCKS;
+        if (free_blocks[b] == TAKEN) {
+            insert_delay(); // simulate storage access delay to block
+            stats->ss_blocks_checked++;
+            if (data_block_verify(b) == -1) {
+                stats->ss_blocks_corrupt++;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Checks the whole i-node table and every data block in use against their
+ * checksums, splitting them among threads. The FS must not change
+ * meanwhile.
+ * Input
+ * 	- threads: number of threads to use
+ * 	- stats: where to store the results
+ * Returns: 0 if the scrub ran (even if it found corruption), -1 otherwise
+ */
+int state_scrub(int threads, scrub_stats_t *stats) {
+    int total = INODE_BLOCKS + DATA_BLOCKS;
+    if (threads < 1) {
+        return -1;
+    }
+    if (threads > total) {
+        threads = total;
+    }
+
+    scrub_worker_t *workers = calloc((size_t)threads, sizeof(*workers));
+    if (workers == NULL) {
+        return -1;
+    }
+
+    int started = 0;
+    for (; started < threads; started++) {
+        scrub_worker_t *worker = &workers[started];
+        worker->sw_first = started * total / threads;
+        worker->sw_end = (started + 1) * total / threads;
+        if (pthread_create(&worker->sw_thread, NULL, scrub_worker, worker) !=
+            0) {
+            break;
+        }
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    for (int t = 0; t < started; t++) {
+        pthread_join(workers[t].sw_thread, NULL);
+        stats->ss_inode_blocks_checked +=
+            workers[t].sw_stats.ss_inode_blocks_checked;
+        stats->ss_inode_blocks_corrupt +=
+            workers[t].sw_stats.ss_inode_blocks_corrupt;
+        stats->ss_blocks_checked += workers[t].sw_stats.ss_blocks_checked;
+        stats->ss_blocks_corrupt += workers[t].sw_stats.ss_blocks_corrupt;
+    }
+    free(workers);
+
+    return started == threads ? 0 : -1;
+}
+
+/* Takes a snapshot of the file system: copies the i-node table and adds a
+ * reference to every data block in use, so that they are copied before
+ * being written to
+ * Returns: the snapshot's identifier if successful, -1 otherwise
+ */
+int snapshot_create() {
+    int snapshot = 0;
+    while (snapshot < MAX_SNAPSHOTS && snapshots[snapshot] != NULL) {
+        snapshot++;
+    }
+    if (snapshot == MAX_SNAPSHOTS) {
+        return -1;
+    }
+
+    snapshot_t *snap = malloc(sizeof(snapshot_t));
+    if (snap == NULL) {
+        return -1;
+    }
+
+    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
+        if ((inumber * (int)sizeof(inode_t) % BLOCK_SIZE) == 0) {
+            insert_delay(); // simulate storage access delay to i-node table
+        }
+
+        snap->s_taken[inumber] = freeinode_ts[inumber];
+        if (freeinode_ts[inumber] == FREE) {
+            continue;
+        }
+        snap->s_inodes[inumber] = inode_table[inumber];
+        if (inode_table[inumber].i_size > 0) {
+            data_block_ref(inode_table[inumber].i_data_block);
+        }
+    }
+
+    snapshots[snapshot] = snap;
+    return snapshot;
+}
+
+/* Deletes a snapshot, dropping its references to data blocks
+ * Input:
+ *  - snapshot: identifier of the snapshot
+ * Returns: 0 if successful, -1 otherwise (including when files are still
+ * open in it)
+ */
+int snapshot_delete(int snapshot) {
+    if (!valid_snapshot(snapshot)) {
+        return -1;
+    }
+
+    /* Files opened from the snapshot still read its blocks */
+    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
+        if (open_inode_get(snapshot, inumber)->oi_refs > 0) {
+            return -1;
+        }
+    }
+
+    snapshot_t *snap = snapshots[snapshot];
+    snapshots[snapshot] = NULL;
+
+    int ret = 0;
+    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
+        if (snap->s_taken[inumber] == TAKEN &&
+            snap->s_inodes[inumber].i_size > 0 &&
+            data_block_free(snap->s_inodes[inumber].i_data_block) == -1) {
+            ret = -1;
+        }
+    }
+    free(snap);
+    return ret;
+}
+
+/*
+ * Returns a pointer to an i-node as it was when a snapshot was taken.
+ * Input:
+ *  - snapshot: identifier of the snapshot
+ *  - inumber: identifier of the i-node
+ * Returns: pointer if successful, NULL if failed (including when the i-node
+ * did not exist in the snapshot)
+ */
+inode_t *snapshot_inode_get(int snapshot, int inumber) {
+    if (!valid_snapshot(snapshot) || !valid_inumber(inumber) ||
+        snapshots[snapshot]->s_taken[inumber] == FREE) {
+        return NULL;
+    }
+
+    insert_delay(); // simulate storage access delay to i-node
+    return &snapshots[snapshot]->s_inodes[inumber];
+}
+
+/* Looks for a given name inside a directory, as it was when a snapshot was
+ * taken
+ * Input:
+ * 	- snapshot's identifier
+ * 	- parent directory's i-node number
+ * 	- name to search
+ * 	Returns i-number linked to the target name, -1 if not found
+ */
+int snapshot_find_in_dir(int snapshot, int inumber, char const *sub_name) {
+    inode_t *dir = snapshot_inode_get(snapshot, inumber);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    return dir_find(dir, sub_name);
+}
+
+/* Adds free handles [first, end) to a session's stack of free handles, so
+ * that the lowest is taken first */
+static void session_push_free(session_t *se, int first, int end) {
+    for (int i = end - 1; i >= first; i--) {
+        se->se_free[se->se_free_count++] = i;
+    }
+}
+
+/* Doubles the capacity of a session's open file table
+ * Returns 0 if successful, -1 otherwise (including when it is already at
+ * MAX_SESSION_FILES)
+ */
+static int session_grow(session_t *se) {
+    int capacity = se->se_capacity == 0 ? SESSION_FILES_MIN
+                                        : 2 * se->se_capacity;
+    if (capacity > MAX_SESSION_FILES) {
+        return -1;
+    }
+
+    open_file_entry_t **files =
+        realloc(se->se_files, (size_t)capacity * sizeof(*files));
+    if (files == NULL) {
+        return -1;
+    }
+    se->se_files = files;
+    int *free_stack = realloc(se->se_free, (size_t)capacity * sizeof(int));
+    if (free_stack == NULL) {
+        return -1;
+    }
+    se->se_free = free_stack;
+
+    for (int i = se->se_capacity; i < capacity; i++) {
+        se->se_files[i] = NULL;
+    }
+    session_push_free(se, se->se_capacity, capacity);
+    se->se_capacity = capacity;
+    return 0;
+}
+
+/* Creates a session, with an empty open file table
+ * Returns: the session's identifier if successful, -1 otherwise
+ */
+int session_create() {
+    /* sessions are created rarely (compared to files being opened), so the
+     * first free identifier is searched for */
+    int session = 0;
+    while (session < sessions_capacity && sessions[session] != NULL) {
+        session++;
+    }
+
+    if (session == sessions_capacity) {
+        int capacity = sessions_capacity == 0 ? 16 : 2 * sessions_capacity;
+        if (capacity > MAX_SESSIONS) {
+            capacity = MAX_SESSIONS;
+        }
+        if (capacity == sessions_capacity) {
+            return -1;
+        }
+        session_t **grown =
+            realloc(sessions, (size_t)capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return -1;
+        }
+        for (int i = sessions_capacity; i < capacity; i++) {
+            grown[i] = NULL;
+        }
+        sessions = grown;
+        sessions_capacity = capacity;
+    }
+
+    session_t *se = calloc(1, sizeof(session_t));
+    if (se == NULL) {
+        return -1;
+    }
+    if (session_grow(se) == -1) {
+        free(se->se_files);
+        free(se->se_free);
+        free(se);
+        return -1;
+    }
+    sessions[session] = se;
+    return session;
+}
+
+/* Destroys a session, which must have no open files
+ * Inputs:
+ * 	- session identifier
+ * Returns 0 if successful, -1 otherwise
+ */
+int session_destroy(int session) {
+    if (!valid_session(session)) {
+        return -1;
+    }
+    session_t *se = sessions[session];
+    if (se->se_free_count != se->se_capacity) {
+        return -1;
+    }
+
+    free(se->se_files);
+    free(se->se_free);
+    free(se);
+    sessions[session] = NULL;
+    return 0;
+}
+
+/* Iterates over the open files of a session
+ * Inputs:
+ * 	- session identifier
+ * 	- the previous file handle returned, or -1 to start
+ * Returns: the next open file handle, -1 if there are no more
+ */
+int session_next_file(int session, int fhandle) {
+    if (!valid_session(session)) {
+        return -1;
+    }
+    session_t *se = sessions[session];
+
+    int i = fhandle == -1 ? 0 : fhandle % MAX_SESSION_FILES + 1;
+    for (; i < se->se_capacity; i++) {
+        if (se->se_files[i] != NULL) {
+            return session * MAX_SESSION_FILES + i;
+        }
+    }
+    return -1;
+}
+
+/* Returns the entry of an i-node (live, or in a snapshot) in the open i-node
+ * table
+ * Inputs:
+ * 	- snapshot identifier, -1 for the live file system
+ * 	- i-node number
+ * Returns: pointer to the entry if successful, NULL otherwise
+ */
+open_inode_t *open_inode_get(int snapshot, int inumber) {
+    if (!valid_inumber(inumber) || snapshot < -1 ||
+        snapshot >= MAX_SNAPSHOTS) {
+        return NULL;
+    }
+    return &open_inodes[(snapshot + 1) * INODE_TABLE_SIZE + inumber];
+}
+
+/* Add new entry to a session's open file table
  * Inputs:
+ * 	- session identifier
+ * 	- snapshot the file is opened from, -1 for the live file system
  * 	- I-node number of the file to open
  * 	- Initial offset
  * Returns: file handle if successful, -1 otherwise
  */
-int add_to_open_file_table(int inumber, size_t offset) {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (free_open_file_entries[i] == FREE) {
-            free_open_file_entries[i] = TAKEN;
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_offset = offset;
-            return i;
-        }
+int add_to_open_file_table(int session, int snapshot, int inumber,
+                           size_t offset) {
+    open_inode_t *open_inode = open_inode_get(snapshot, inumber);
+    if (!valid_session(session) || open_inode == NULL) {
+        return -1;
     }
-    return -1;
+    session_t *se = sessions[session];
+    if (se->se_free_count == 0 && session_grow(se) == -1) {
+        return -1;
+    }
+
+    open_file_entry_t *file = malloc(sizeof(open_file_entry_t));
+    if (file == NULL) {
+        return -1;
+    }
+    file->of_inumber = inumber;
+    file->of_snapshot = snapshot;
+    file->of_open_inode = open_inode;
+    file->of_offset = offset;
+    file->of_max_size = BLOCK_SIZE;
+    file->of_append = false;
+    file->of_wb_len = 0;
+    file->of_read_end = offset;
+    file->of_ra_window = 0;
+    file->of_ra_len = 0;
+    file->of_ra = NULL;
+    open_inode->oi_refs++;
+
+    int i = se->se_free[--se->se_free_count];
+    se->se_files[i] = file;
+    return session * MAX_SESSION_FILES + i;
 }
 
-/* Frees an entry from the open file table
+/* Frees an entry from the open file table (its write-behind buffer must
+ * have been flushed)
  * Inputs:
  * 	- file handle to free/close
  * Returns 0 is success, -1 otherwise
  */
 int remove_from_open_file_table(int fhandle) {
-    if (!valid_file_handle(fhandle) ||
-        free_open_file_entries[fhandle] != TAKEN) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
         return -1;
     }
-    free_open_file_entries[fhandle] = FREE;
+    session_t *se = sessions[fhandle / MAX_SESSION_FILES];
+    int i = fhandle % MAX_SESSION_FILES;
+
+    open_inode_t *open_inode = file->of_open_inode;
+    open_inode->oi_refs--;
+    if (open_inode->oi_buffered == file) {
+        open_inode->oi_buffered = NULL;
+    }
+    free(file->of_ra);
+    free(file);
+
+    se->se_files[i] = NULL;
+    se->se_free[se->se_free_count++] = i;
     return 0;
 }
 
 /* Returns pointer to a given entry in the open file table
  * Inputs:
  * 	 - file handle
- * Returns: pointer to the entry if sucessful, NULL otherwise
+ * Returns: pointer to the entry if sucessful, NULL otherwise (including when
+ * the handle is not open)
  */
 open_file_entry_t *get_open_file_entry(int fhandle) {
-    if (!valid_file_handle(fhandle)) {
+    if (fhandle < 0 || !valid_session(fhandle / MAX_SESSION_FILES)) {
+        return NULL;
+    }
+    session_t *se = sessions[fhandle / MAX_SESSION_FILES];
+    int i = fhandle % MAX_SESSION_FILES;
+    if (i >= se->se_capacity) {
         return NULL;
     }
-    return &open_file_table[fhandle];
+    return se->se_files[i];
+}
+
+/* Handoff: the whole FS state, including the sessions and their open files,
+ * is written to a file from which another process (a newer server) rebuilds
+ * it. Free data blocks are not written, so they stay uncommitted. */
+#define HANDOFF_MAGIC (0x54465348u) /* "TFSH" */
+
+typedef struct {
+    uint32_t h_magic;
+    int h_inodes;
+    int h_blocks;
+    int h_block_size;
+    int h_snapshots;
+    int h_sessions_capacity;
+    int h_sessions; /* sessions that exist */
+} handoff_header_t;
+
+typedef struct {
+    int hs_session;
+    int hs_capacity;
+    int hs_files;
+} handoff_session_t;
+
+typedef struct {
+    int hf_index;
+    int hf_inumber;
+    int hf_snapshot;
+    size_t hf_offset;
+    size_t hf_max_size;
+    bool hf_append;
+    size_t hf_read_end;
+    size_t hf_ra_window;
+} handoff_file_t;
+
+static int write_all(int fd, void const *buf, size_t len) {
+    char const *p = buf;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written == -1) {
+            return -1;
+        }
+        p += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t rd = read(fd, p, len);
+        if (rd <= 0) {
+            return -1;
+        }
+        p += rd;
+        len -= (size_t)rd;
+    }
+    return 0;
+}
+
+/* Writes the FS state to a file. No write-behind buffer may hold data, and
+ * the FS must not change meanwhile.
+ * Input:
+ * 	- file descriptor to write to
+ * Returns: 0 if successful, -1 otherwise
+ */
+int state_export(int fd) {
+    handoff_header_t header = {
+        .h_magic = HANDOFF_MAGIC,
+        .h_inodes = INODE_TABLE_SIZE,
+        .h_blocks = DATA_BLOCKS,
+        .h_block_size = BLOCK_SIZE,
+        .h_snapshots = MAX_SNAPSHOTS,
+        .h_sessions_capacity = sessions_capacity,
+        .h_sessions = 0,
+    };
+    for (int session = 0; session < sessions_capacity; session++) {
+        header.h_sessions += sessions[session] != NULL;
+    }
+
+    if (write_all(fd, &header, sizeof(header)) == -1 ||
+        write_all(fd, freeinode_ts, sizeof(freeinode_ts)) == -1 ||
+        write_all(fd, inode_table, INODE_TABLE_SIZE * sizeof(inode_t)) ==
+            -1 ||
+        write_all(fd, inode_block_crc, sizeof(inode_block_crc)) == -1 ||
+        write_all(fd, free_blocks, sizeof(free_blocks)) == -1 ||
+        write_all(fd, block_refs, sizeof(block_refs)) == -1 ||
+        write_all(fd, block_crc, sizeof(block_crc)) == -1 ||
+        write_all(fd, block_indexed, sizeof(block_indexed)) == -1 ||
+        write_all(fd, block_hash, sizeof(block_hash)) == -1 ||
+        write_all(fd, &dedup_stats, sizeof(dedup_stats)) == -1) {
+        return -1;
+    }
+
+    for (int b = 0; b < DATA_BLOCKS; b++) {
+        if (free_blocks[b] == TAKEN &&
+            write_all(fd, &fs_data[b * BLOCK_SIZE], BLOCK_SIZE) == -1) {
+            return -1;
+        }
+    }
+
+    for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+        char present = snapshots[s] != NULL;
+        if (write_all(fd, &present, sizeof(present)) == -1 ||
+            (present &&
+             write_all(fd, snapshots[s], sizeof(snapshot_t)) == -1)) {
+            return -1;
+        }
+    }
+
+    for (int session = 0; session < sessions_capacity; session++) {
+        session_t *se = sessions[session];
+        if (se == NULL) {
+            continue;
+        }
+        handoff_session_t record = {
+            .hs_session = session,
+            .hs_capacity = se->se_capacity,
+            .hs_files = se->se_capacity - se->se_free_count,
+        };
+        if (write_all(fd, &record, sizeof(record)) == -1) {
+            return -1;
+        }
+
+        for (int i = 0; i < se->se_capacity; i++) {
+            open_file_entry_t const *file = se->se_files[i];
+            if (file == NULL) {
+                continue;
+            }
+            if (file->of_wb_len != 0) {
+                return -1;
+            }
+            handoff_file_t file_record = {
+                .hf_index = i,
+                .hf_inumber = file->of_inumber,
+                .hf_snapshot = file->of_snapshot,
+                .hf_offset = file->of_offset,
+                .hf_max_size = file->of_max_size,
+                .hf_append = file->of_append,
+                .hf_read_end = file->of_read_end,
+                .hf_ra_window = file->of_ra_window,
+            };
+            if (write_all(fd, &file_record, sizeof(file_record)) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Rebuilds the session table of the FS state being imported */
+static int import_sessions(int fd, handoff_header_t const *header) {
+    if (header->h_sessions_capacity < 0 ||
+        header->h_sessions_capacity > MAX_SESSIONS) {
+        return -1;
+    }
+    sessions = calloc((size_t)header->h_sessions_capacity, sizeof(*sessions));
+    if (sessions == NULL && header->h_sessions_capacity > 0) {
+        return -1;
+    }
+    sessions_capacity = header->h_sessions_capacity;
+
+    int files = 0;
+    for (int n = 0; n < header->h_sessions; n++) {
+        handoff_session_t record;
+        if (read_all(fd, &record, sizeof(record)) == -1 ||
+            record.hs_session < 0 || record.hs_session >= sessions_capacity ||
+            sessions[record.hs_session] != NULL) {
+            return -1;
+        }
+
+        session_t *se = calloc(1, sizeof(session_t));
+        if (se == NULL) {
+            return -1;
+        }
+        sessions[record.hs_session] = se;
+        while (se->se_capacity < record.hs_capacity) {
+            if (session_grow(se) == -1) {
+                return -1;
+            }
+        }
+
+        for (int f = 0; f < record.hs_files; f++) {
+            handoff_file_t file_record;
+            if (read_all(fd, &file_record, sizeof(file_record)) == -1 ||
+                file_record.hf_index < 0 ||
+                file_record.hf_index >= se->se_capacity ||
+                se->se_files[file_record.hf_index] != NULL) {
+                return -1;
+            }
+            open_inode_t *open_inode = open_inode_get(file_record.hf_snapshot,
+                                                      file_record.hf_inumber);
+            open_file_entry_t *file = malloc(sizeof(open_file_entry_t));
+            if (open_inode == NULL || file == NULL) {
+                free(file);
+                return -1;
+            }
+            file->of_inumber = file_record.hf_inumber;
+            file->of_snapshot = file_record.hf_snapshot;
+            file->of_open_inode = open_inode;
+            file->of_offset = file_record.hf_offset;
+            file->of_max_size = file_record.hf_max_size;
+            file->of_append = file_record.hf_append;
+            file->of_wb_len = 0;
+            file->of_read_end = file_record.hf_read_end;
+            file->of_ra_window = file_record.hf_ra_window;
+            file->of_ra_len = 0;
+            file->of_ra = NULL;
+            open_inode->oi_refs++;
+            se->se_files[file_record.hf_index] = file;
+            files++;
+        }
+
+        /* the free handles are the ones not in use, lowest on top */
+        se->se_free_count = 0;
+        for (int i = se->se_capacity - 1; i >= 0; i--) {
+            if (se->se_files[i] == NULL) {
+                se->se_free[se->se_free_count++] = i;
+            }
+        }
+    }
+
+    return files;
+}
+
+/*
+ * Marks the whole file system dirty, so that the next sync writes all of it
+ */
+static void mark_all_dirty() {
+    for (int b = 0; b < DATA_BLOCKS; b++) {
+        block_dirty[b] = free_blocks[b] == TAKEN;
+    }
+    inodes_dirty = true;
+}
+
+/* Replaces the (just initialized, empty) FS state by the one written to a
+ * file by state_export. Deduplication follows the parameters this state was
+ * initialized with, not those of the exporting process.
+ * Input:
+ * 	- file descriptor to read from
+ * Returns: the number of open files imported if successful, -1 otherwise
+ */
+int state_import(int fd) {
+    handoff_header_t header;
+    if (read_all(fd, &header, sizeof(header)) == -1 ||
+        header.h_magic != HANDOFF_MAGIC ||
+        header.h_inodes != INODE_TABLE_SIZE ||
+        header.h_blocks != DATA_BLOCKS ||
+        header.h_block_size != BLOCK_SIZE ||
+        header.h_snapshots != MAX_SNAPSHOTS) {
+        return -1;
+    }
+
+    if (read_all(fd, freeinode_ts, sizeof(freeinode_ts)) == -1 ||
+        read_all(fd, inode_table, INODE_TABLE_SIZE * sizeof(inode_t)) == -1 ||
+        read_all(fd, inode_block_crc, sizeof(inode_block_crc)) == -1 ||
+        read_all(fd, free_blocks, sizeof(free_blocks)) == -1 ||
+        read_all(fd, block_refs, sizeof(block_refs)) == -1 ||
+        read_all(fd, block_crc, sizeof(block_crc)) == -1 ||
+        read_all(fd, block_indexed, sizeof(block_indexed)) == -1 ||
+        read_all(fd, block_hash, sizeof(block_hash)) == -1 ||
+        read_all(fd, &dedup_stats, sizeof(dedup_stats)) == -1) {
+        return -1;
+    }
+
+    for (int b = 0; b < DATA_BLOCKS; b++) {
+        if (free_blocks[b] == TAKEN &&
+            read_all(fd, &fs_data[b * BLOCK_SIZE], BLOCK_SIZE) == -1) {
+            return -1;
+        }
+        if (block_indexed[b]) {
+            block_indexed[b] =
+                dedup_enabled && dedup_insert(block_hash[b], b) == 0;
+        }
+    }
+
+    for (int g = 0; g < ALLOCATION_GROUPS; g++) {
+        allocation_group_t *group = &groups[g];
+        group->ag_free_inodes = 0;
+        for (int i = group->ag_first_inumber; i < group->ag_end_inumber; i++) {
+            group->ag_free_inodes += freeinode_ts[i] == FREE;
+        }
+        group->ag_free_blocks = 0;
+        for (int b = group->ag_first_block; b < group->ag_end_block; b++) {
+            group->ag_free_blocks += free_blocks[b] == FREE;
+        }
+    }
+
+    for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+        char present;
+        if (read_all(fd, &present, sizeof(present)) == -1) {
+            return -1;
+        }
+        if (present) {
+            snapshots[s] = malloc(sizeof(snapshot_t));
+            if (snapshots[s] == NULL ||
+                read_all(fd, snapshots[s], sizeof(snapshot_t)) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    /* a backing file may not have been kept in sync with what is imported */
+    if (backing_fd != -1) {
+        mark_all_dirty();
+    }
+
+    return import_sessions(fd, &header);
+}
+
+/*
+ * Loads the file system in the metadata slot in sync_meta, reading its data
+ * blocks from the places the slot has them in
+ * Returns: 1 if it was loaded, 0 if a data block does not match its
+ * checksum, -1 if unsuccessful
+ */
+static int load_slot(int fd) {
+    memcpy(freeinode_ts, sync_meta.bm_freeinode_ts, sizeof(freeinode_ts));
+    memcpy(inode_table, sync_meta.bm_inode_table,
+           INODE_TABLE_SIZE * sizeof(inode_t));
+    for (int k = 0; k < INODE_BLOCKS; k++) {
+        inode_block_crc[k] = inode_block_checksum(k * INODES_PER_BLOCK);
+    }
+
+    /* the blocks in use are the ones the i-nodes reference */
+    memset(free_blocks, FREE, sizeof(free_blocks));
+    memset(block_refs, 0, sizeof(block_refs));
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        int b = inode_table[i].i_data_block;
+        if (freeinode_ts[i] == TAKEN && inode_table[i].i_size > 0) {
+            if (!valid_block_number(b)) {
+                return -1;
+            }
+            free_blocks[b] = TAKEN;
+            block_refs[b]++;
+        }
+    }
+
+    /* read in runs of consecutive blocks in the same area, in order */
+    char const *area = sync_meta.bm_block_area;
+    for (int b = 0; b < DATA_BLOCKS;) {
+        if (free_blocks[b] != TAKEN) {
+            b++;
+            continue;
+        }
+        int end = b;
+        while (end < DATA_BLOCKS && free_blocks[end] == TAKEN &&
+               area[end] == area[b]) {
+            block_crc[end] = sync_meta.bm_block_crc[end];
+            end++;
+        }
+        if (pread_all(fd, &fs_data[b * BLOCK_SIZE],
+                      (size_t)(end - b) * BLOCK_SIZE,
+                      (off_t)BACKING_BLOCK(b, area[b])) == -1) {
+            return -1;
+        }
+        for (; b < end; b++) {
+            if (data_block_verify(b) == -1) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ * Loads the file system whose latest metadata slot is in a backing file (or
+ * checkpoint image). If a data block of that slot does not match its
+ * checksum, the previous slot (if valid) is loaded instead, and the next
+ * sync replaces the bad one.
+ * Returns: 1 if it was loaded, 0 if the file holds none, -1 if unsuccessful
+ */
+static int load_image(int fd) {
+    int latest = backing_latest(fd);
+    if (latest == -1) {
+        return 0;
+    }
+
+    int loaded = load_slot(fd);
+    if (loaded == 0) {
+        uint64_t seq = sync_meta.bm_seq;
+        fprintf(stderr,
+                "tecnicofs: data blocks of metadata slot %d do not match "
+                "their checksums\n",
+                latest);
+        if (backing_read_slot(fd, 1 - latest) && sync_meta.bm_seq < seq) {
+            fprintf(stderr, "tecnicofs: loading the previous slot, %d\n",
+                    1 - latest);
+            loaded = load_slot(fd);
+        }
+        if (loaded == 0) {
+            fprintf(stderr, "tecnicofs: no consistent metadata slot\n");
+            return -1;
+        }
+    }
+    if (loaded == -1) {
+        return -1;
+    }
+
+    /* later syncs follow the slot loaded */
+    if (fd == backing_fd) {
+        backing_seq = sync_meta.bm_seq;
+        memcpy(block_area, sync_meta.bm_block_area, sizeof(block_area));
+    }
+
+    for (int g = 0; g < ALLOCATION_GROUPS; g++) {
+        allocation_group_t *group = &groups[g];
+        group->ag_free_inodes = 0;
+        for (int i = group->ag_first_inumber; i < group->ag_end_inumber; i++) {
+            group->ag_free_inodes += freeinode_ts[i] == FREE;
+        }
+        group->ag_free_blocks = 0;
+        for (int b = group->ag_first_block; b < group->ag_end_block; b++) {
+            group->ag_free_blocks += free_blocks[b] == FREE;
+        }
+    }
+
+    memset(block_dirty, 0, sizeof(block_dirty));
+    inodes_dirty = false;
+    return 1;
+}
+
+/*
+ * Loads the file system last synced to the backing file or, if there is no
+ * backing file, the one in a checkpoint image (its i-nodes and the data
+ * blocks they use; snapshots and sessions are not kept there).
+ * Input:
+ *  - image: path of the checkpoint image, NULL if none
+ * Returns: 1 if it was loaded, 0 if there is none yet, -1 if unsuccessful
+ */
+int state_load(char const *image) {
+    int fd = backing_fd;
+    if (fd == -1 && image != NULL) {
+        fd = open(image, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return errno == ENOENT ? 0 : -1;
+        }
+        /* the image is read once, front to back */
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    int loaded = fd == -1 ? 0 : load_image(fd);
+    if (fd != backing_fd) {
+        close(fd);
+    }
+    return loaded;
+}
+
+/*
+ * Fills a metadata slot with the current i-nodes and block checksums
+ * Input:
+ *  - areas: the area each data block is written to, NULL if all in the first
+ */
+static void backing_meta_fill(backing_meta_t *meta, uint64_t seq,
+                              char const *areas) {
+    meta->bm_magic = BACKING_MAGIC;
+    meta->bm_seq = seq;
+    meta->bm_inodes = INODE_TABLE_SIZE;
+    meta->bm_blocks = DATA_BLOCKS;
+    meta->bm_block_size = BLOCK_SIZE;
+    meta->bm_dedup = dedup_enabled;
+    memcpy(meta->bm_freeinode_ts, freeinode_ts, sizeof(freeinode_ts));
+    memcpy(meta->bm_inode_table, inode_table,
+           INODE_TABLE_SIZE * sizeof(inode_t));
+    memcpy(meta->bm_free_blocks, free_blocks, sizeof(free_blocks));
+    memcpy(meta->bm_block_crc, block_crc, sizeof(block_crc));
+    if (areas == NULL) {
+        memset(meta->bm_block_area, 0, sizeof(meta->bm_block_area));
+    } else {
+        memcpy(meta->bm_block_area, areas, sizeof(meta->bm_block_area));
+    }
+    meta->bm_crc = crc32c(0, &meta->bm_seq,
+                          sizeof(*meta) - offsetof(backing_meta_t, bm_seq));
+}
+
+/*
+ * Copies what changed since the last sync (the dirty data blocks, and the
+ * metadata) out, to be written by state_sync_write, and clears the dirty
+ * marks. It only copies memory, so it can be called with the file system
+ * locked; the writes can then happen without it.
+ * Returns: 1 if there is something to write, 0 if there is nothing (or no
+ * backing file)
+ */
+int state_sync_stage() {
+    if (backing_fd == -1) {
+        return 0;
+    }
+
+    /* a dirty block goes to the place the latest slot does not use */
+    sync_count = 0;
+    memcpy(sync_area, block_area, sizeof(sync_area));
+    for (int b = 0; b < DATA_BLOCKS; b++) {
+        if (block_dirty[b] && free_blocks[b] == TAKEN) {
+            sync_area[b] = (char)(1 - block_area[b]);
+            memcpy(&sync_data[sync_count * BLOCK_SIZE],
+                   &fs_data[b * BLOCK_SIZE], BLOCK_SIZE);
+            sync_blocks[sync_count++] = b;
+        }
+        block_dirty[b] = false;
+    }
+    if (sync_count == 0 && !inodes_dirty) {
+        return 0;
+    }
+    inodes_dirty = false;
+
+    backing_meta_fill(&sync_meta, ++backing_seq, sync_area);
+    return 1;
+}
+
+/*
+ * Writes what state_sync_stage copied out to the backing file: the blocks
+ * first (consecutive ones in the same area in a single write), to places
+ * the previous slot does not use, and, once they are on disk, the metadata,
+ * in the slot not holding the previous one. Until that slot is whole, the
+ * previous one still describes what is on disk, so a crash at any point
+ * leaves a valid slot. Calls must not overlap each other, nor
+ * state_sync_stage.
+ * Returns: 0 if successful, -1 otherwise
+ */
+int state_sync_write() {
+    for (int i = 0; i < sync_count;) {
+        int b = sync_blocks[i];
+        int run = 1;
+        while (i + run < sync_count && sync_blocks[i + run] == b + run &&
+               sync_area[b + run] == sync_area[b]) {
+            run++;
+        }
+        if (pwrite_all(backing_fd, &sync_data[i * BLOCK_SIZE],
+                       (size_t)run * BLOCK_SIZE,
+                       (off_t)BACKING_BLOCK(b, sync_area[b])) == -1) {
+            return -1;
+        }
+        i += run;
+    }
+    if (sync_count > 0 && fdatasync(backing_fd) == -1) {
+        return -1;
+    }
+
+    if (pwrite_all(backing_fd, &sync_meta, sizeof(sync_meta),
+                   (off_t)(sync_meta.bm_seq % 2 * BACKING_SLOT)) == -1 ||
+        fdatasync(backing_fd) == -1) {
+        return -1;
+    }
+    memcpy(block_area, sync_area, sizeof(block_area));
+    return 0;
+}
+
+/*
+ * Marks what the last state_sync_stage copied out dirty again, after it
+ * failed to be written
+ */
+void state_sync_abort() {
+    for (int i = 0; i < sync_count; i++) {
+        block_dirty[sync_blocks[i]] = true;
+    }
+    inodes_dirty = true;
+}
+
+/*
+ * Stops using the backing file (another process takes it over, or the file
+ * system is destroyed)
+ */
+void state_backing_detach() {
+    if (backing_fd != -1) {
+        close(backing_fd);
+        backing_fd = -1;
+    }
+    free(sync_data);
+    sync_data = NULL;
+}
+
+/*
+ * Prepares the data blocks for a checkpoint, to be written by a child
+ * process forked right after (with the file system locked): if they are in
+ * a memory file, which the child shares, every block in use gets a
+ * reference, so that writes go to copies of them until state_checkpoint_end;
+ * otherwise, the child's copy of them is already kept apart by the kernel.
+ */
+void state_checkpoint_begin() {
+    if (fs_data_fd == -1) {
+        return;
+    }
+    for (int b = 0; b < DATA_BLOCKS; b++) {
+        checkpoint_pinned[b] = free_blocks[b] == TAKEN && data_block_ref(b);
+    }
+}
+
+/*
+ * Drops the references state_checkpoint_begin took
+ * Returns: 0 if successful, -1 otherwise
+ */
+int state_checkpoint_end() {
+    int ret = 0;
+    for (int b = 0; b < DATA_BLOCKS; b++) {
+        if (checkpoint_pinned[b]) {
+            checkpoint_pinned[b] = false;
+            if (data_block_free(b) == -1) {
+                ret = -1;
+            }
+        }
+    }
+    return ret;
+}
+
+/*
+ * Writes a checkpoint image of the file system (its i-nodes and the data
+ * blocks in use), which state_load can load, to a temporary file that then
+ * replaces the image, so that the previous one stays whole until the new
+ * one is. Meant for the child process forked after state_checkpoint_begin:
+ * it takes no locks.
+ * Input:
+ *  - path: path of the image
+ * Returns: 0 if successful, -1 otherwise
+ */
+int state_checkpoint_write(char const *path) {
+    static backing_meta_t meta;
+    char temp[PATH_MAX];
+
+    if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp)) {
+        return -1;
+    }
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+
+    backing_meta_fill(&meta, 1, NULL);
+    int ret = pwrite_all(fd, &meta, sizeof(meta), 0);
+
+    /* the blocks in use, consecutive ones in a single write */
+    for (int b = 0; b < DATA_BLOCKS && ret == 0;) {
+        if (free_blocks[b] != TAKEN) {
+            b++;
+            continue;
+        }
+        int end = b;
+        while (end < DATA_BLOCKS && free_blocks[end] == TAKEN) {
+            end++;
+        }
+        ret = pwrite_all(fd, &fs_data[b * BLOCK_SIZE],
+                         (size_t)(end - b) * BLOCK_SIZE,
+                         (off_t)BACKING_BLOCK(b, 0));
+        b = end;
+    }
+
+    if (ret == 0 && fdatasync(fd) == -1) {
+        ret = -1;
+    }
+    if (close(fd) == -1 || ret == -1 || rename(temp, path) == -1) {
+        unlink(temp);
+        return -1;
+    }
+    return 0;
 }
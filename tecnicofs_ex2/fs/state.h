@@ -3,6 +3,8 @@
 
 #include "config.h"
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -15,6 +17,25 @@ typedef struct {
     int d_inumber;
 } dir_entry_t;
 
+/* Number of (1-byte) tags at the start of a directory block: a multiple of
+ * 16, so that they are compared 16 at a time */
+#define DIR_TAGS (32)
+
+#define MAX_DIR_ENTRIES ((BLOCK_SIZE - DIR_TAGS) / sizeof(dir_entry_t))
+
+/*
+ * Directory block: a tag per entry (a hash of its name, 0 if the entry is
+ * free), followed by the entries. Lookups scan the tags and only compare
+ * the names of the entries whose tag matches.
+ */
+typedef struct {
+    unsigned char db_tags[DIR_TAGS];
+    dir_entry_t db_entries[MAX_DIR_ENTRIES];
+} dir_block_t;
+
+_Static_assert(MAX_DIR_ENTRIES <= DIR_TAGS, "too few directory tags");
+_Static_assert(sizeof(dir_block_t) <= BLOCK_SIZE, "directory block too big");
+
 typedef enum { T_FILE, T_DIRECTORY } inode_type;
 
 /*
@@ -24,38 +45,211 @@ typedef struct {
     inode_type i_node_type;
     size_t i_size;
     int i_data_block;
+    bool i_compressed;    /* the block holds the contents compressed */
+    size_t i_stored_size; /* bytes of the block in use, if compressed */
     /* in a real FS, more fields would exist here */
 } inode_t;
 
 typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 
 /*
- * Open file entry (in open file table)
+ * Backing file (and checkpoint image) layout: two metadata slots (written
+ * alternately, the valid one with the highest sequence number being the
+ * latest), each enough to rebuild the file system from, followed by two
+ * areas of data blocks. Each data block has a place in both areas, and a
+ * slot records which of them it is in (see BACKING_BLOCK): a sync writes
+ * blocks to the place the latest slot does not use, so that slot still
+ * describes blocks as they were. Checkpoint images only have the first slot
+ * written, and their blocks in the first area.
+ */
+#define BACKING_MAGIC (0x53464254u) /* "TBFS" */
+
+typedef struct {
+    uint32_t bm_magic;
+    uint32_t bm_crc; /* of the rest of the slot */
+    uint64_t bm_seq;
+    int bm_inodes;
+    int bm_blocks;
+    int bm_block_size;
+    bool bm_dedup; /* identical data blocks may be shared by files */
+    char bm_freeinode_ts[INODE_TABLE_SIZE];
+    inode_t bm_inode_table[INODE_TABLE_SIZE];
+    /* also TAKEN: blocks only kept by snapshots or mappings, which are not
+     * written, and are freed when the file system is loaded */
+    char bm_free_blocks[DATA_BLOCKS];
+    uint32_t bm_block_crc[DATA_BLOCKS];
+    char bm_block_area[DATA_BLOCKS]; /* 0 or 1 */
+} backing_meta_t;
+
+#define BACKING_SLOT                                                           \
+    ((sizeof(backing_meta_t) + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE)
+#define BACKING_DATA (2 * BACKING_SLOT)
+#define BACKING_BLOCK(b, area)                                                 \
+    (BACKING_DATA + ((size_t)(area) * DATA_BLOCKS + (size_t)(b)) * BLOCK_SIZE)
+
+struct open_file_entry;
+
+/*
+ * Open i-node entry, shared by all the open files of an i-node
  */
 typedef struct {
+    int oi_refs; /* open files */
+    /* the open file with a non-empty write-behind buffer, if any (there is
+     * at most one per i-node) */
+    struct open_file_entry *oi_buffered;
+} open_inode_t;
+
+/*
+ * Open file entry (in a session's open file table)
+ */
+typedef struct open_file_entry {
     int of_inumber;
+    int of_snapshot; /* snapshot the file is read from, -1 if none */
+    open_inode_t *of_open_inode;
     size_t of_offset;
+    size_t of_max_size; /* BLOCK_SIZE, or more if the file is compressed */
+    bool of_append;     /* every write goes to the end of the file */
+    /* write-behind buffer: of_wb_len pending bytes that belong at
+     * of_wb_offset in the file (not yet copied to the data block) */
+    size_t of_wb_offset;
+    size_t of_wb_len;
+    char of_wb[WRITE_BUFFER_SIZE];
+    /* read-ahead: of_ra_len bytes of the file starting at of_ra_offset,
+     * copied when the file's contents had generation of_ra_generation */
+    size_t of_read_end; /* where the previous read ended */
+    size_t of_ra_window;
+    size_t of_ra_offset;
+    size_t of_ra_len;
+    unsigned int of_ra_generation;
+    char *of_ra; /* BLOCK_SIZE bytes, allocated by the first read-ahead */
 } open_file_entry_t;
 
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+/*
+ * When TecnicoFS syncs its backing file, besides tfs_fsync
+ */
+typedef enum {
+    SYNC_NONE,      /* only on tfs_fsync */
+    SYNC_PERIODIC,  /* every sync_interval_ms, in the background */
+    SYNC_ON_CLOSE,  /* whenever a file is closed */
+} sync_policy_t;
+
+/*
+ * TecnicoFS initialization parameters
+ */
+typedef struct {
+    /* back the i-node table and the data blocks with huge pages */
+    bool huge_pages;
+    /* share the storage of identical full data blocks */
+    bool dedup;
+    /* keep the data blocks in a memory file other processes can map (see
+     * tfs_mmap) */
+    bool shared_data;
+    /* file the file system is kept in (and loaded from, if it holds one),
+     * NULL if none; what changed reaches it when it is synced, as the sync
+     * policy dictates, on tfs_fsync and when TecnicoFS is destroyed */
+    char const *backing_file;
+    sync_policy_t sync_policy;
+    int sync_interval_ms; /* for SYNC_PERIODIC: the most changes can wait */
+    /* checkpoint image the file system is written to, by a forked child
+     * process, on tfs_checkpoint and every checkpoint_interval_ms (if not
+     * 0), and loaded from, if there is no backing file; NULL if none */
+    char const *checkpoint_file;
+    int checkpoint_interval_ms;
+} tfs_params;
+
+/*
+ * Block deduplication statistics
+ */
+typedef struct {
+    size_t ds_blocks_hashed;
+    size_t ds_blocks_shared; /* writes that reused an identical block */
+    size_t ds_bytes_saved;
+    unsigned long long ds_time_ns; /* spent hashing and looking up blocks */
+} dedup_stats_t;
+
+/*
+ * Scrub results: blocks whose contents no longer match their checksum
+ */
+typedef struct {
+    size_t ss_inode_blocks_checked;
+    size_t ss_inode_blocks_corrupt;
+    size_t ss_blocks_checked;
+    size_t ss_blocks_corrupt;
+} scrub_stats_t;
+
+/*
+ * Read leases granted on an open file (see tfs_lease)
+ */
+typedef struct {
+    int l_inumber;
+    int l_dir;      /* the directory the file's name is in */
+    ssize_t l_size; /* size of the leased contents, -1 if not leased */
+} lease_t;
+
+/*
+ * Where the contents of a file mapped with tfs_mmap are
+ */
+typedef struct {
+    int m_inumber;
+    int m_block;     /* -1 if the file is empty */
+    size_t m_offset; /* of the block, in the memory file of the data blocks */
+    size_t m_size;
+} mapping_t;
 
-void state_init();
+int state_init(tfs_params const *params);
 void state_destroy();
 
 int inode_create(inode_type n_type);
 int inode_delete(int inumber);
 inode_t *inode_get(int inumber);
+bool inode_in_use(int inumber);
+void inode_seal(int inumber);
+int inode_verify(int inumber);
 
 int clear_dir_entry(int inumber, int sub_inumber);
 int add_dir_entry(int inumber, int sub_inumber, char const *sub_name);
 int find_in_dir(int inumber, char const *sub_name);
+int dir_list(int inumber, int cookie, dir_entry_t *entries, int max,
+             int *next_cookie);
 
 int data_block_alloc();
 int data_block_free(int block_number);
+bool data_block_ref(int block_number);
+int data_block_cow(int block_number);
+int data_block_dedup(int block_number);
+void dedup_stats_get(dedup_stats_t *stats);
+int data_region_fd();
 void *data_block_get(int block_number);
+void data_block_seal(int block_number);
+int data_block_verify(int block_number);
+
+int state_scrub(int threads, scrub_stats_t *stats);
+
+int state_export(int fd);
+int state_import(int fd);
+
+int state_load(char const *image);
+int state_sync_stage();
+int state_sync_write();
+void state_sync_abort();
+void state_backing_detach();
+void state_checkpoint_begin();
+int state_checkpoint_end();
+int state_checkpoint_write(char const *path);
+
+int snapshot_create();
+int snapshot_delete(int snapshot);
+inode_t *snapshot_inode_get(int snapshot, int inumber);
+int snapshot_find_in_dir(int snapshot, int inumber, char const *sub_name);
+
+int session_create();
+int session_destroy(int session);
+int session_next_file(int session, int fhandle);
 
-int add_to_open_file_table(int inumber, size_t offset);
+int add_to_open_file_table(int session, int snapshot, int inumber,
+                           size_t offset);
 int remove_from_open_file_table(int fhandle);
 open_file_entry_t *get_open_file_entry(int fhandle);
+open_inode_t *open_inode_get(int snapshot, int inumber);
 
 #endif // STATE_H
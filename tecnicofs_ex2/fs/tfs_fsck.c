@@ -0,0 +1,304 @@
+#include "crc32c.h"
+#include "state.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Offline consistency checker for TecnicoFS volume images (backing files
+ * and checkpoint images, see backing_meta_t): checks that
+ *  - the root directory is there, and every i-node in use is reachable from
+ *    it;
+ *  - directory entries name i-nodes in use;
+ *  - sizes fit in the data blocks the i-nodes have;
+ *  - every data block in use has a single owner (unless the volume shares
+ *    identical blocks) and is TAKEN in the free map, and its contents match
+ *    their checksum.
+ * The i-nodes, and their data blocks, are checked by a pool of threads,
+ * each taking the next range of i-nodes; the checks that need all of them
+ * (ownership, reachability) are then made on what they recorded.
+ * Exits with 0 if the image is consistent, 1 if not, 2 if it cannot be
+ * checked.
+ */
+
+#define INODES_PER_TASK (8)
+
+static int image_fd;
+static backing_meta_t meta;
+
+/* Recorded by the workers */
+static atomic_int next_inumber;
+static atomic_int errors;
+static atomic_int block_owners[DATA_BLOCKS];
+static int block_owner[DATA_BLOCKS]; /* one of them */
+/* the i-nodes each directory's entries name (-1 for free entries) */
+static int dir_entries[INODE_TABLE_SIZE][MAX_DIR_ENTRIES];
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Reports a problem with the image
+ */
+__attribute__((format(printf, 1, 2))) static void report(char const *format,
+                                                         ...) {
+    va_list args;
+    va_start(args, format);
+    pthread_mutex_lock(&report_lock);
+    vprintf(format, args);
+    putchar('\n');
+    pthread_mutex_unlock(&report_lock);
+    va_end(args);
+    atomic_fetch_add(&errors, 1);
+}
+
+static int pread_all(void *buf, size_t len, off_t offset) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t got = pread(image_fd, p, len, offset);
+        if (got <= 0) {
+            return -1;
+        }
+        p += got;
+        len -= (size_t)got;
+        offset += got;
+    }
+    return 0;
+}
+
+/*
+ * Reads the latest valid metadata slot of the image into meta
+ * Returns: 0 if successful, -1 if neither slot is valid
+ */
+static int read_meta() {
+    static backing_meta_t slot;
+    int latest = -1;
+
+    for (int s = 0; s < 2; s++) {
+        if (pread_all(&slot, sizeof(slot), (off_t)((size_t)s * BACKING_SLOT)) ==
+                0 &&
+            slot.bm_magic == BACKING_MAGIC &&
+            slot.bm_crc ==
+                crc32c(0, &slot.bm_seq,
+                       sizeof(slot) - offsetof(backing_meta_t, bm_seq)) &&
+            slot.bm_inodes == INODE_TABLE_SIZE &&
+            slot.bm_blocks == DATA_BLOCKS &&
+            slot.bm_block_size == BLOCK_SIZE &&
+            (latest == -1 || slot.bm_seq > meta.bm_seq)) {
+            meta = slot;
+            latest = s;
+        }
+    }
+    return latest == -1 ? -1 : 0;
+}
+
+/*
+ * Checks an i-node in use (and its data block)
+ */
+static void check_inode(int inumber, char *block) {
+    inode_t const *inode = &meta.bm_inode_table[inumber];
+
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        dir_entries[inumber][i] = -1;
+    }
+
+    if (inode->i_node_type != T_FILE && inode->i_node_type != T_DIRECTORY) {
+        report("i-node %d: unknown type %d", inumber, inode->i_node_type);
+        return;
+    }
+
+    size_t stored = inode->i_compressed ? inode->i_stored_size : inode->i_size;
+    if (stored > BLOCK_SIZE ||
+        (inode->i_node_type == T_DIRECTORY && inode->i_size != BLOCK_SIZE)) {
+        report("i-node %d: size %zu does not fit in a block", inumber,
+               stored);
+        return;
+    }
+    if (stored == 0) {
+        return;
+    }
+
+    int b = inode->i_data_block;
+    if (b < 0 || b >= DATA_BLOCKS) {
+        report("i-node %d: invalid data block %d", inumber, b);
+        return;
+    }
+    if (atomic_fetch_add(&block_owners[b], 1) == 0) {
+        block_owner[b] = inumber;
+    }
+
+    if (pread_all(block, BLOCK_SIZE,
+                  (off_t)BACKING_BLOCK(b, meta.bm_block_area[b])) == -1) {
+        report("i-node %d: data block %d cannot be read", inumber, b);
+        return;
+    }
+    if (crc32c(0, block, BLOCK_SIZE) != meta.bm_block_crc[b]) {
+        report("i-node %d: data block %d does not match its checksum",
+               inumber, b);
+        return;
+    }
+
+    if (inode->i_node_type == T_DIRECTORY) {
+        dir_block_t const *dir_block = (dir_block_t const *)block;
+        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+            dir_entry_t const *entry = &dir_block->db_entries[i];
+            if (dir_block->db_tags[i] == 0) {
+                continue;
+            }
+            if (entry->d_inumber < 0 || entry->d_inumber >= INODE_TABLE_SIZE ||
+                meta.bm_freeinode_ts[entry->d_inumber] != TAKEN) {
+                report("i-node %d: entry %zu names i-node %d, not in use",
+                       inumber, i, entry->d_inumber);
+                continue;
+            }
+            if (memchr(entry->d_name, 0, MAX_FILE_NAME) == NULL) {
+                report("i-node %d: entry %zu has an unterminated name",
+                       inumber, i);
+            }
+            dir_entries[inumber][i] = entry->d_inumber;
+        }
+    }
+}
+
+/*
+ * A worker: checks ranges of i-nodes until there are none left
+ */
+static void *check_inodes(void *arg) {
+    char block[BLOCK_SIZE];
+    (void)arg;
+
+    for (;;) {
+        int first = atomic_fetch_add(&next_inumber, INODES_PER_TASK);
+        if (first >= INODE_TABLE_SIZE) {
+            return NULL;
+        }
+        for (int i = first; i < first + INODES_PER_TASK && i < INODE_TABLE_SIZE;
+             i++) {
+            if (meta.bm_freeinode_ts[i] == TAKEN) {
+                check_inode(i, block);
+            }
+        }
+    }
+}
+
+/*
+ * Checks that every i-node in use is reachable from the root directory
+ */
+static void check_reachability() {
+    bool reached[INODE_TABLE_SIZE] = {false};
+    int queue[INODE_TABLE_SIZE];
+    int head = 0, tail = 0;
+
+    if (meta.bm_freeinode_ts[ROOT_DIR_INUM] != TAKEN ||
+        meta.bm_inode_table[ROOT_DIR_INUM].i_node_type != T_DIRECTORY) {
+        report("the root directory (i-node %d) is missing", ROOT_DIR_INUM);
+        return;
+    }
+
+    reached[ROOT_DIR_INUM] = true;
+    queue[tail++] = ROOT_DIR_INUM;
+    while (head < tail) {
+        int dir = queue[head++];
+        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+            int inumber = dir_entries[dir][i];
+            if (inumber != -1 && !reached[inumber]) {
+                reached[inumber] = true;
+                if (meta.bm_inode_table[inumber].i_node_type == T_DIRECTORY) {
+                    queue[tail++] = inumber;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        if (meta.bm_freeinode_ts[i] == TAKEN && !reached[i]) {
+            report("i-node %d: in use, but not reachable from the root", i);
+        }
+    }
+}
+
+/*
+ * Checks the data blocks' owners against each other and the free map
+ * Returns: the number of blocks TAKEN but not owned by any i-node
+ */
+static int check_blocks() {
+    int unowned = 0;
+
+    for (int b = 0; b < DATA_BLOCKS; b++) {
+        int owners = atomic_load(&block_owners[b]);
+        if (owners > 1 && !meta.bm_dedup) {
+            report("data block %d: owned by %d i-nodes (i-node %d among them)",
+                   b, owners, block_owner[b]);
+        }
+        if (owners > 0 && meta.bm_free_blocks[b] != TAKEN) {
+            report("data block %d: owned by i-node %d, but free", b,
+                   block_owner[b]);
+        }
+        unowned += owners == 0 && meta.bm_free_blocks[b] == TAKEN;
+    }
+    return unowned;
+}
+
+int main(int argc, char **argv) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (argc == 4 && strcmp(argv[2], "-j") == 0) {
+        threads = atol(argv[3]);
+    } else if (argc != 2) {
+        printf("Usage: %s image [-j threads]\n", argv[0]);
+        return 2;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    image_fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+    if (image_fd == -1) {
+        perror(argv[1]);
+        return 2;
+    }
+    if (read_meta() == -1) {
+        printf("%s: no valid TecnicoFS metadata for this geometry\n",
+               argv[1]);
+        return 2;
+    }
+
+    pthread_t *pool = malloc((size_t)threads * sizeof(pthread_t));
+    if (pool == NULL) {
+        return 2;
+    }
+    long started = 0;
+    while (started < threads &&
+           pthread_create(&pool[started], NULL, check_inodes, NULL) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        check_inodes(NULL);
+    }
+    for (long t = 0; t < started; t++) {
+        pthread_join(pool[t], NULL);
+    }
+    free(pool);
+
+    check_reachability();
+    int unowned = check_blocks();
+
+    int taken = 0;
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        taken += meta.bm_freeinode_ts[i] == TAKEN;
+    }
+    printf("%s: %d i-nodes in use, %d errors", argv[1], taken,
+           atomic_load(&errors));
+    if (unowned > 0) {
+        /* kept by snapshots or mappings, and freed on load */
+        printf(", %d data blocks not owned by any i-node", unowned);
+    }
+    printf("\n");
+
+    close(image_fd);
+    return atomic_load(&errors) == 0 ? 0 : 1;
+}
@@ -1,4 +1,7 @@
+#define _GNU_SOURCE //memfd_create
+
 #include "operations.h"
+#include "uring.h"
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
@@ -8,53 +11,236 @@
 #include <string.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #define FREE -1
 #define ALL_TAKEN -1
 
+#define ENDPOINT_NAME_FORMAT "%s.%d"    //see MAX_ENDPOINTS
+
+#define MAX_CHUNKS 512   //sessions are allocated S at a time, up to S*MAX_CHUNKS
+#define REAP_INTERVAL 2  //seconds between checks for clients that went away
+
+#define EXECUTORS 4         //default number of threads running requests
+#define QUANTUM 1024        //bytes a session of weight 1 may move per round
+#define REQUEST_COST 64     //cost of a request, besides the bytes it moves
+#define MAX_WEIGHT_RULES 16
+#define MAX_QUEUED 64       //default number of requests waiting before clients are told to retry
+#define MIN_RETRY_US 100
+
+#define INBOX_SIZE 65536   //bytes of requests read from an endpoint at once
+#define RING_ENTRIES 256    //replies the io_uring engine keeps in flight
+
+#define HANDOFF_SUFFIX ".handoff"   //the handoff socket is named after the server pipe
+#define HANDOFF_DRAIN_TIMEOUT 5     //seconds to wait for running requests before a handoff
+#define HANDOFF_BATCH 128           //sessions (and client pipes) sent per message
+
+struct session;
+
+//what a server sends the one taking over from it, besides the FS state:
+//the endpoints' pipes and the FS state (a memfd) come with the header, and then
+//each session comes with its client pipe
+typedef struct {
+    int endpoints;  //their pipes come first, before the FS state
+    int sessions;
+} handoff_header;
+
 typedef struct {
+    int session_id;
+    int fs_session;
+    int weight;
+    int leases;     //its lease pipe comes after its client pipe
+} handoff_session;
+
+typedef struct buffer {
     char code;
     int session_id;
     int fhandle;
     int flags;
+    int snapshot;
+    int inumber;
+    int block;
+    int cookie;
+    int max_entries;
     size_t len;
+    size_t offset;
     char name[NAME_SIZE];
     char *content;
-    pthread_mutex_t mutex;
-    int reading;
-    int writing;
+    int retry_us;   //if turned down: answered TFS_BUSY and the time to wait instead of run
+    struct session *se;
+    struct buffer *next;
 } buffer;
 
-int sessions[S];
-buffer *threads[S];
-pthread_cond_t cond_prod[S];
-pthread_cond_t cond_cons[S];
-int fserv, mounted;
-
-void initialize_sessions();
+typedef struct session {
+    int session_id;
+    int taken;
+    int fcli;
+    int fs_session; //each client's open files are kept in their own TecnicoFS session
+    //scheduling: a session's requests run one at a time, in order
+    buffer *head;
+    buffer *tail;
+    int busy;       //one of its requests is running
+    int queued;     //waiting in one of the scheduler's lanes
+    int weight;
+    long deficit;
+    struct session *next;
+} session;
+
+//a lane is a FIFO of sessions waiting for their next request to run
+typedef struct {
+    session *head;
+    session *tail;
+} lane;
+
+//session table: chunks of S sessions, allocated as clients arrive (a chunk
+//never moves, so it can be read without locks once it is published)
+session *chunks[MAX_CHUNKS];
+int n_chunks;
+//free session ids, lowest on top
+int *free_ids;
+int free_count;
+pthread_mutex_t registry_mutex;
+pthread_cond_t reaper_cond;
+
+//scheduler: sessions whose next request is a metadata op (open, close, ...) go
+//in the priority lane and run first; the others share the data lane by deficit
+//round robin, each getting QUANTUM*weight bytes per round
+pthread_mutex_t sched_mutex;
+pthread_cond_t sched_cond;
+lane priority_lane;
+lane data_lane;
+//admission control: past max_queued waiting requests, new ones are turned down
+//with TFS_BUSY and an estimate of how long the queue takes to drain
+int max_queued = MAX_QUEUED;
+int queued_requests;
+long service_ns;    //moving average of the time a request takes to run
+int executors = EXECUTORS;
+int running;        //requests running (or sessions being checked by the reaper)
+
+//endpoints: the pipes requests are read from (-k), each by a dispatcher
+//thread of its own (the main thread dispatches endpoint 0), which parses
+//them and hands them to the scheduler
+int n_endpoints = 1;
+int endpoints[MAX_ENDPOINTS];
+const char *endpoint_names[MAX_ENDPOINTS];
+int wake[MAX_ENDPOINTS][2]; //wakes a dispatcher up: endpoint 0's with a handoff socket, or -1
+
+//hot restart: a newer server (started with -R) connects to the handoff
+//socket; the dispatchers stop reading requests, the ones they took are run,
+//and the FS state, the sessions and the pipes are handed over to it
+char handoff_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+int handoff_listener;
+int handing_off;
+int paused;         //dispatchers (other than endpoint 0's) stopped for a handoff
+pthread_cond_t drained_cond;
+pthread_cond_t resume_cond;
+
+//weights of the clients whose pipe name starts with a given prefix (-w prefix:weight)
+char *weight_prefixes[MAX_WEIGHT_RULES];
+int weight_values[MAX_WEIGHT_RULES];
+int n_weight_rules;
+
+//the pipes where the clients are told their leases are recalled, by TecnicoFS session
+int lease_fds[MAX_SESSIONS];
+pthread_mutex_t lease_mutex;
+
+int mounted, dedup;
+
+//requests are read from an endpoint in bulk (as much as it holds, up to
+//INBOX_SIZE bytes) and their fields taken from its dispatcher's inbox by read_function
+_Thread_local int listening;        //the endpoint this thread dispatches
+_Thread_local char inbox[INBOX_SIZE];
+_Thread_local size_t inbox_start, inbox_end;
+
+//replies: what a request answers its client is gathered by write_function
+//and sent in a single write once the request has run, either right away
+//(ENGINE_SYNC) or queued to an io_uring (see uring.h), which a kernel thread
+//polls with ENGINE_SQPOLL
+typedef enum { ENGINE_SYNC, ENGINE_URING, ENGINE_SQPOLL } io_engine;
+
+io_engine engine = ENGINE_SYNC;
+_Thread_local session *replying;    //the session whose reply this thread is gathering
+_Thread_local char *reply;
+_Thread_local size_t reply_len, reply_capacity;
+
+session *get_session(int session_id);
+int add_chunk();
+int take_session();
+void release_session(session *se);
+int session_weight(const char *client_pipe);
+void lane_push(lane *l, session *se);
+session *lane_pop(lane *l);
+long request_cost(buffer *b);
+void activate(session *se);
+void admit(buffer *b);
+void reject(buffer *b, int retry_us);
+void answer_busy(buffer *b);
+void submit(buffer *b);
+buffer *next_request();
+void finish(session *se, long elapsed_ns);
+void *execute(void *arg);
+void *reap(void *arg);
+void recall(int fs_session, int inumber);
+int open_server_pipe(const char *pipename);
+int name_endpoints(const char *pipename);
+int dispatch(int endpoint);
+void *dispatcher(void *arg);
+void wake_dispatchers();
+void pause_dispatcher();
+int listen_handoff();
+void *accept_handoff(void *arg);
+void hand_off(int sock);
+int send_state(int sock);
+int take_over(tfs_params const *params);
+int send_fds(int sock, void *data, size_t len, int *fds, int n_fds);
+int recv_fds(int sock, void *data, size_t len, int *fds, int max_fds);
 void empty_buffer(buffer *b);
-void initialize_threads_buffers();
-void *work(void *arg);
 void process_input(buffer *b);
 void process(buffer *b);
-void thread_loop(buffer *b);
 void mount_input(buffer *b);
 void mount(buffer *b);
 void unmount(buffer *b);
+void close_session(session *se);
 void open_file_input(buffer *b);
 void open_file(buffer *b);
+void open_inumber_input(buffer *b);
+void open_inumber(buffer *b);
+void send_lease(buffer *b, int fhandle);
+void map_file_input(buffer *b);
+void map_file(buffer *b);
+void unmap_file_input(buffer *b);
+void unmap_file(buffer *b);
+void list_dir_input(buffer *b);
+void list_dir(buffer *b);
 void close_file_input(buffer *b);
 void close_file(buffer *b);
+void sync_file_input(buffer *b);
+void sync_file(buffer *b);
 void write_file_input(buffer *b);
 void write_file(buffer *b);
 void read_file_input(buffer *b);
 void read_file(buffer *b);
 void shutdown_after_all_closed(buffer *b);
+void take_snapshot(buffer *b);
+void open_snapshot_file_input(buffer *b);
+void open_snapshot_file(buffer *b);
+void delete_snapshot_input(buffer *b);
+void delete_snapshot(buffer *b);
+void name_input(char *name);
+int owns_handle(buffer *b);
 int open_function(const char *file, int flag);
 int close_function(int fd);
 int write_function(int fd, void *buf, size_t bytes);
 int read_function(void *buf, size_t bytes);
+ssize_t fill_inbox();
+int gather_reply(void *buf, size_t bytes);
+int send_reply();
 
 buffer *create_buffer(int session_id) {
     buffer *b = malloc(sizeof(buffer));
@@ -64,8 +250,8 @@ buffer *create_buffer(int session_id) {
 
     b->session_id = session_id;
     empty_buffer(b);
-    b->writing = TRUE;
-    b->reading = FALSE;
+    b->se = NULL;
+    b->next = NULL;
 
     return b;
 }
@@ -78,61 +264,618 @@ int main(int argc, char **argv) {
     }
 
     char *pipename = argv[1];
-    printf("Starting TecnicoFS server with pipe called %s\n", pipename);
+    tfs_params params = tfs_default_params();
+    params.shared_data = true; //clients map files from it
+    int opt, resume = FALSE;
 
-    if(tfs_init() != 0){
-        return -1;
+    optind = 2;
+    while((opt = getopt(argc, argv, "HDRb:s:c:i:u:k:e:q:w:")) != -1) {
+        char *colon;
+
+        switch(opt) {
+            case 'H':
+                params.huge_pages = true;
+                break;
+            case 'D':
+                params.dedup = true;
+                break;
+            case 'R':
+                resume = TRUE;
+                break;
+            case 'b':
+                params.backing_file = optarg;
+                break;
+            case 's':
+                if(strcmp(optarg, "none") == 0)
+                    params.sync_policy = SYNC_NONE;
+                else if(strcmp(optarg, "close") == 0)
+                    params.sync_policy = SYNC_ON_CLOSE;
+                else if((params.sync_interval_ms = atoi(optarg)) >= 1)
+                    params.sync_policy = SYNC_PERIODIC;
+                else {
+                    printf("The sync policy is none, close or an interval in ms\n");
+                    return 1;
+                }
+                break;
+            case 'c':
+                params.checkpoint_file = optarg;
+                break;
+            case 'i':
+                if((params.checkpoint_interval_ms = atoi(optarg)) < 0) {
+                    printf("The checkpoint interval cannot be negative\n");
+                    return 1;
+                }
+                break;
+            case 'u':
+                if(strcmp(optarg, "sync") == 0)
+                    engine = ENGINE_SYNC;
+                else if(strcmp(optarg, "uring") == 0)
+                    engine = ENGINE_URING;
+                else if(strcmp(optarg, "sqpoll") == 0)
+                    engine = ENGINE_SQPOLL;
+                else {
+                    printf("The I/O engine is sync, uring or sqpoll\n");
+                    return 1;
+                }
+                break;
+            case 'k':
+                if((n_endpoints = atoi(optarg)) < 1 || n_endpoints > MAX_ENDPOINTS) {
+                    printf("The number of endpoints is between 1 and %d\n", MAX_ENDPOINTS);
+                    return 1;
+                }
+                break;
+            case 'e':
+                if((executors = atoi(optarg)) < 1) {
+                    printf("The number of executors must be positive\n");
+                    return 1;
+                }
+                break;
+            case 'q':
+                if((max_queued = atoi(optarg)) < 1) {
+                    printf("The number of queued requests must be positive\n");
+                    return 1;
+                }
+                break;
+            case 'w':
+                colon = strrchr(optarg, ':');
+                if(colon == NULL || n_weight_rules == MAX_WEIGHT_RULES || atoi(colon + 1) < 1) {
+                    printf("Weights are given as prefix:weight (at most %d)\n", MAX_WEIGHT_RULES);
+                    return 1;
+                }
+                *colon = '\0';
+                weight_prefixes[n_weight_rules] = optarg;
+                weight_values[n_weight_rules++] = atoi(colon + 1);
+                break;
+            default:
+                printf("Usage: %s pipename [-H (use huge pages)] "
+                       "[-D (deduplicate blocks)] "
+                       "[-R (take over from the server running on pipename)] "
+                       "[-b backing_file] [-s none|close|sync_interval_ms] "
+                       "[-c checkpoint_file] [-i checkpoint_interval_ms] "
+                       "[-u sync|uring|sqpoll (I/O engine)] "
+                       "[-k endpoints] "
+                       "[-e executors] "
+                       "[-q max_queued_requests] "
+                       "[-w client_pipe_prefix:weight]...\n", argv[0]);
+                return 1;
+        }
+    }
+    dedup = params.dedup;
+
+    if(strlen(pipename) + strlen(HANDOFF_SUFFIX) >= sizeof(handoff_path)) {
+        printf("The pathname of the server's pipe is too long\n");
+        return 1;
     }
+    strcpy(handoff_path, pipename);
+    strcat(handoff_path, HANDOFF_SUFFIX);
 
     signal(SIGPIPE, SIG_IGN);
-    initialize_sessions();
-    initialize_threads_buffers();
+    pthread_mutex_init(&registry_mutex, NULL);
+    pthread_cond_init(&reaper_cond, NULL);
+    pthread_mutex_init(&sched_mutex, NULL);
+    pthread_cond_init(&sched_cond, NULL);
+    pthread_cond_init(&drained_cond, NULL);
+    pthread_cond_init(&resume_cond, NULL);
+    pthread_mutex_init(&lease_mutex, NULL);
+    for(int i = 0; i < MAX_SESSIONS; i++)
+        lease_fds[i] = FREE;
     mounted = TRUE;
 
-    unlink(pipename);
+    if(engine != ENGINE_SYNC && uring_init(RING_ENTRIES, engine == ENGINE_SQPOLL) == -1) {
+        printf("No io_uring available, replying synchronously\n");
+        engine = ENGINE_SYNC;
+    }
+
+    if(resume) {
+        printf("Taking over the TecnicoFS server with pipe called %s\n", pipename);
+
+        //the endpoints are the ones of the server taken over from
+        if(take_over(&params) == -1 || name_endpoints(pipename) == -1) {
+            printf("Could not take over from a running server\n");
+            return 1;
+        }
+    }
+    else {
+        printf("Starting TecnicoFS server with pipe called %s\n", pipename);
+
+        if(tfs_init_with_params(&params) != 0){
+            return -1;
+        }
+        tfs_set_recall_function(recall);
+
+        if(name_endpoints(pipename) == -1)
+            return -1;
+
+        for(int e = 0; e < n_endpoints; e++) {
+            unlink(endpoint_names[e]);
+
+            if(mkfifo(endpoint_names[e], 0777) < 0)
+                return -1;
+
+            if((endpoints[e] = open_server_pipe(endpoint_names[e])) == -1)
+                return -1;
+        }
+    }
+
+    //the server keeps the endpoints open for writing too, so that reads
+    //never see their end while no client is connected
+    for(int e = 0; e < n_endpoints; e++) {
+        if(open(endpoint_names[e], O_WRONLY) == -1 || pipe(wake[e]) == -1)
+            return -1;
+    }
+
+    if((handoff_listener = listen_handoff()) == -1)
+        return -1;
+
+    pthread_t reaper, listener, tid[executors], dispatchers[n_endpoints];
+
+    if(pthread_create(&listener, NULL, accept_handoff, NULL) != 0 || pthread_detach(listener) != 0)
+        return -1;
+    if(pthread_create(&reaper, NULL, reap, NULL) != 0)
+        return -1;
+    for(int i = 0; i < executors; i++) {
+        if(pthread_create(&tid[i], NULL, execute, NULL) != 0)
+            return -1;
+    }
+    for(int e = 1; e < n_endpoints; e++) {
+        if(pthread_create(&dispatchers[e], NULL, dispatcher, (void*)(intptr_t)e) != 0)
+            return -1;
+    }
 
-    if(mkfifo(pipename, 0777) < 0)
+    if(dispatch(0) == -1)
         return -1;
 
-    
-    if((fserv = open_function(pipename, O_RDONLY)) == -1) 
+    for(int e = 1; e < n_endpoints; e++)
+        pthread_join(dispatchers[e], NULL);
+
+    pthread_mutex_lock(&registry_mutex);
+    pthread_cond_signal(&reaper_cond);
+    pthread_mutex_unlock(&registry_mutex);
+    pthread_join(reaper, NULL);
+
+    for(int i = 0; i < executors; i++)
+        pthread_join(tid[i], NULL);
+    if(engine != ENGINE_SYNC)
+        uring_destroy();
+
+    for(int c = 0; c < n_chunks; c++)
+        free(chunks[c]);
+    free(free_ids);
+
+    return -1;
+}
+
+session *get_session(int session_id) {
+    if(session_id < 0 || session_id / S >= n_chunks)
+        return NULL;
+    return &chunks[session_id / S][session_id % S];
+}
+
+//allocates S more sessions (with registry_mutex held)
+int add_chunk() {
+    if(n_chunks == MAX_CHUNKS)
         return -1;
 
-    pthread_t tid[S];
+    session *chunk = malloc(S * sizeof(session));
+    int *ids = realloc(free_ids, (size_t)(n_chunks + 1) * S * sizeof(int));
 
-    int *session_ids[S];
+    if(chunk == NULL || ids == NULL) {
+        free(chunk);
+        if(ids != NULL)
+            free_ids = ids;
+        return -1;
+    }
+    free_ids = ids;
 
     for(int i = 0; i < S; i++) {
-        int *session_id = malloc(sizeof(int));
+        session *se = &chunk[i];
+
+        se->session_id = n_chunks * S + i;
+        se->taken = FALSE;
+        se->fcli = FREE;
+        se->fs_session = FREE;
+        se->head = se->tail = NULL;
+        se->busy = se->queued = FALSE;
+        se->weight = 1;
+        se->deficit = 0;
+        se->next = NULL;
+    }
 
-        if(session_id == NULL)
-            return -1;
+    for(int i = S - 1; i >= 0; i--)
+        free_ids[free_count++] = n_chunks * S + i;
+    chunks[n_chunks++] = chunk;
+
+    return 0;
+}
+
+//takes a free session, growing the table if needed
+int take_session() {
+    pthread_mutex_lock(&registry_mutex);
+    if(free_count == 0 && add_chunk() == -1) {
+        pthread_mutex_unlock(&registry_mutex);
+        return -1;
+    }
+
+    int session_id = free_ids[--free_count];
+
+    chunks[session_id / S][session_id % S].taken = TRUE;
+    pthread_mutex_unlock(&registry_mutex);
+
+    return session_id;
+}
+
+//(run for a busy session, so it is in no lane) the requests queued on it are dropped:
+//dispatchers queue requests with registry_mutex held, so none follow
+void release_session(session *se) {
+    pthread_mutex_lock(&registry_mutex);
+    se->taken = FALSE;
+    free_ids[free_count++] = se->session_id;
+
+    pthread_mutex_lock(&sched_mutex);
+    while(se->head != NULL) {
+        buffer *b = se->head;
+
+        se->head = b->next;
+        queued_requests--;
+        free(b->content);
+        free(b);
+    }
+    se->tail = NULL;
+    pthread_mutex_unlock(&sched_mutex);
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+//the weight of the longest prefix of the client's pipe name given with -w, 1 if none
+int session_weight(const char *client_pipe) {
+    int weight = 1;
+    size_t longest = 0;
+
+    for(int i = 0; i < n_weight_rules; i++) {
+        size_t len = strlen(weight_prefixes[i]);
+
+        if(len >= longest && strncmp(client_pipe, weight_prefixes[i], len) == 0) {
+            weight = weight_values[i];
+            longest = len;
+        }
+    }
+    return weight;
+}
+
+void lane_push(lane *l, session *se) {
+    se->next = NULL;
+    if(l->tail == NULL)
+        l->head = se;
+    else
+        l->tail->next = se;
+    l->tail = se;
+}
+
+session *lane_pop(lane *l) {
+    session *se = l->head;
+
+    if(se != NULL) {
+        l->head = se->next;
+        if(l->head == NULL)
+            l->tail = NULL;
+    }
+    return se;
+}
+
+long request_cost(buffer *b) {
+    if(b->retry_us == 0 && (b->code == TFS_OP_CODE_WRITE || b->code == TFS_OP_CODE_READ))
+        return REQUEST_COST + (long)b->len;
+    return REQUEST_COST;
+}
+
+//puts a session with requests waiting (and none running) in the right lane (with sched_mutex held)
+void activate(session *se) {
+    if(se->busy || se->queued || se->head == NULL)
+        return;
+
+    se->queued = TRUE;
+    if(se->head->retry_us == 0 && (se->head->code == TFS_OP_CODE_WRITE || se->head->code == TFS_OP_CODE_READ))
+        lane_push(&data_lane, se);
+    else
+        lane_push(&priority_lane, se);
+    pthread_cond_signal(&sched_cond);
+}
+
+//turns the request down if too many are waiting (mounts, unmounts and shutdowns are always let in)
+void admit(buffer *b) {
+    int retry_us;
+
+    if(b->code == TFS_OP_CODE_MOUNT || b->code == TFS_OP_CODE_UNMOUNT || b->code == TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED)
+        return;
+
+    pthread_mutex_lock(&sched_mutex);
+    if(queued_requests < max_queued) {
+        pthread_mutex_unlock(&sched_mutex);
+        return;
+    }
+    retry_us = (int)(service_ns * queued_requests / executors / 1000);
+    pthread_mutex_unlock(&sched_mutex);
+
+    reject(b, retry_us < MIN_RETRY_US ? MIN_RETRY_US : retry_us);
+}
+
+//a turned down request is still queued, in the priority lane, but only to be
+//answered TFS_BUSY through its session's reply path: the dispatcher never
+//writes to a client, so a slow one cannot hold the others' requests up
+void reject(buffer *b, int retry_us) {
+    b->retry_us = retry_us;
+    free(b->content);
+    b->content = NULL;
+}
+
+//answers TFS_BUSY (as wide as the request's usual answer) followed by the time to wait
+void answer_busy(buffer *b) {
+    ssize_t busy = TFS_BUSY;
+    int busy_int = TFS_BUSY;
+    int fcli = b->se->fcli;
+    int retry_us = b->retry_us;
+
+    //gathered like any reply, and sent once the request is done
+    if(b->code == TFS_OP_CODE_WRITE || b->code == TFS_OP_CODE_READ) {
+        if(write_function(fcli, &busy, sizeof(ssize_t)) == -1)
+            return;
+    }
+    else if(write_function(fcli, &busy_int, sizeof(int)) == -1)
+        return;
+    write_function(fcli, &retry_us, sizeof(int));
+}
+
+void submit(buffer *b) {
+    session *se = b->se;
+
+    pthread_mutex_lock(&sched_mutex);
+    queued_requests++;
+    b->next = NULL;
+    if(se->tail == NULL)
+        se->head = b;
+    else
+        se->tail->next = b;
+    se->tail = b;
+    activate(se);
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+//waits for the next request to run: metadata ops first, then data ops by deficit round robin
+buffer *next_request() {
+    session *se;
+
+    pthread_mutex_lock(&sched_mutex);
+    while(mounted && priority_lane.head == NULL && data_lane.head == NULL)
+        pthread_cond_wait(&sched_cond, &sched_mutex);
+
+    if(!(mounted)) {
+        pthread_mutex_unlock(&sched_mutex);
+        return NULL;
+    }
+
+    if((se = lane_pop(&priority_lane)) == NULL) {
+        //every visit to a session that cannot afford its request adds to its deficit
+        while((se = lane_pop(&data_lane)) != NULL && se->deficit < request_cost(se->head)) {
+            se->deficit += QUANTUM * se->weight;
+            lane_push(&data_lane, se);
+        }
+        if(se == NULL) { //not reached: the data lane was not empty
+            pthread_mutex_unlock(&sched_mutex);
+            return NULL;
+        }
+        se->deficit -= request_cost(se->head);
+    }
+
+    buffer *b = se->head;
+
+    se->head = b->next;
+    if(se->head == NULL)
+        se->tail = NULL;
+    se->queued = FALSE;
+    se->busy = TRUE;
+    running++;
+    queued_requests--;
+    pthread_mutex_unlock(&sched_mutex);
+
+    return b;
+}
+
+//called when a session's request is done, so that its next one can be scheduled
+//(elapsed_ns is the time it took to run, or 0 if it was not a request)
+void finish(session *se, long elapsed_ns) {
+    pthread_mutex_lock(&sched_mutex);
+    if(elapsed_ns > 0)
+        service_ns += (elapsed_ns - service_ns) / 8;
+    se->busy = FALSE;
+    running--;
+    if(se->head == NULL)
+        se->deficit = 0; //idle sessions do not keep credit
+    else
+        activate(se);
+    if(handing_off && running == 0 && queued_requests == 0)
+        pthread_cond_signal(&drained_cond);
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+void *execute(void *arg) {
+    (void)arg;
+
+    buffer *b;
+    while((b = next_request()) != NULL) {
+        session *se = b->se;
+        struct timespec start, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        replying = se;
+        process(b);
+        //a client that cannot be answered went away
+        if(send_reply() == -1 && se->fcli != FREE)
+            unmount(b);
+        replying = NULL;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        free(b);
+        finish(se, (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec));
+    }
+    return 0;
+}
+
+//periodically frees the sessions of clients that went away without unmounting:
+//their pipe reports an error once its reading end is closed
+void *reap(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&registry_mutex);
+    while(mounted) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += REAP_INTERVAL;
+        pthread_cond_timedwait(&reaper_cond, &registry_mutex, &deadline);
+
+        int chunk_count = n_chunks;
+        pthread_mutex_unlock(&registry_mutex);
+
+        for(int c = 0; c < chunk_count && mounted; c++) {
+            for(int i = 0; i < S; i++) {
+                session *se = &chunks[c][i];
+                int idle;
+
+                //only sessions with no request waiting or running are reaped;
+                //the session is marked busy meanwhile, like when a request runs
+                pthread_mutex_lock(&sched_mutex);
+                idle = !handing_off && se->taken && !(se->busy) && !(se->queued) && se->head == NULL && se->fcli != FREE;
+                if(idle) {
+                    se->busy = TRUE;
+                    running++;
+                }
+                pthread_mutex_unlock(&sched_mutex);
+
+                if(!idle)
+                    continue;
+
+                struct pollfd pfd = { .fd = se->fcli, .events = 0 };
+
+                if(poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLERR | POLLHUP)))
+                    close_session(se);
+                finish(se, 0);
+            }
+        }
+
+        pthread_mutex_lock(&registry_mutex);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+
+    return 0;
+}
 
-        *session_id = i;
-        if(pthread_create(&tid[i], NULL, work, (void *)session_id) != 0)
+//tells a client its lease on a file was recalled (with TecnicoFS locked, so
+//before the change that recalled it is answered); a client too slow to
+//drain its lease pipe loses it, and with it every lease
+void recall(int fs_session, int inumber) {
+    pthread_mutex_lock(&lease_mutex);
+    if(lease_fds[fs_session] != FREE && write(lease_fds[fs_session], &inumber, sizeof(int)) != sizeof(int)) {
+        close_function(lease_fds[fs_session]);
+        lease_fds[fs_session] = FREE;
+    }
+    pthread_mutex_unlock(&lease_mutex);
+}
+
+//opens the server pipe for reading without waiting for a client to open it
+int open_server_pipe(const char *pipename) {
+    int fd = open_function(pipename, O_RDONLY | O_NONBLOCK);
+
+    if(fd == -1 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) == -1)
+        return -1;
+    return fd;
+}
+
+//endpoint 0 is the server pipe itself, the others are named after it
+int name_endpoints(const char *pipename) {
+    endpoint_names[0] = pipename;
+    for(int e = 1; e < n_endpoints; e++) {
+        size_t len = (size_t)snprintf(NULL, 0, ENDPOINT_NAME_FORMAT, pipename, e) + 1;
+        char *name = malloc(len);
+
+        if(name == NULL)
             return -1;
-        session_ids[i] = session_id;
+        snprintf(name, len, ENDPOINT_NAME_FORMAT, pipename, e);
+        endpoint_names[e] = name;
     }
+    return 0;
+}
+
+//reads requests from an endpoint and hands them to the scheduler, until the
+//server shuts down; returns -1 on errors the server cannot carry on from
+int dispatch(int endpoint) {
+    listening = endpoint;
 
     while(mounted) {
         char code;
-        ssize_t rd = read(fserv, &code, sizeof(char));
 
-        if(rd == -1 && mounted) {
-            if(errno == EINTR)
+        //the endpoint (and the wake pipe) are only polled once every
+        //request read from it has been taken, so handoffs happen between requests
+        if(inbox_start == inbox_end) {
+            struct pollfd fds[2] = {
+                { .fd = endpoints[endpoint], .events = POLLIN },
+                { .fd = wake[endpoint][0], .events = POLLIN }
+            };
+
+            if(poll(fds, 2, -1) == -1)
                 continue;
-            if(errno == EPIPE)
-                return -1;
-        }
-        else if(rd == 0 && mounted) {
-            if(close_function(fserv) == -1)
-                return -1;
-            if((fserv = open_function(pipename, O_RDONLY)) == -1)
-                return -1;
 
-            continue;
+            if(fds[1].revents & POLLIN) {
+                int sock;
+
+                if(read(wake[endpoint][0], &sock, sizeof(int)) == sizeof(int) && sock != -1)
+                    hand_off(sock); //only returns if the handoff failed
+                else if(endpoint != 0)
+                    pause_dispatcher();
+                continue;
+            }
+
+            ssize_t rd = fill_inbox();
+
+            if(rd == -1 && mounted) {
+                if(errno == EINTR)
+                    continue;
+                if(errno == EPIPE)
+                    return -1;
+                continue;
+            }
+            else if(rd == 0 && mounted) {
+                if(close_function(endpoints[endpoint]) == -1)
+                    return -1;
+                if((endpoints[endpoint] = open_server_pipe(endpoint_names[endpoint])) == -1)
+                    return -1;
+
+                continue;
+            }
+            else if(rd <= 0)
+                continue;
         }
-        else if(rd > 0 && code != 0 && mounted) {
+
+        code = inbox[inbox_start++];
+
+        if(code != 0 && mounted) {
             int session_id;
 
             if(code != TFS_OP_CODE_MOUNT) {
@@ -140,124 +883,356 @@ int main(int argc, char **argv) {
                     return -1;
             }
             
-            else {
-                int found = FALSE;
-
-                for(session_id = 0; session_id < S; session_id++) {
-                    if(sessions[session_id] == FREE) {
-                        found = TRUE;
-                        sessions[session_id] = TAKEN;
-                        break;
-                    }    
-                }
+            else if((session_id = take_session()) == -1) {
+                buffer *b = create_buffer(0);
+                int fcli, taken = ALL_TAKEN;
+
+                if(b == NULL)
+                    return -1;
+
+                mount_input(b);
+                if((fcli = open_function(b->name, O_WRONLY)) == -1)
+                    return -1;
+
+                write_function(fcli, &taken, sizeof(int)); //not necessary to treat error because client pipe will be closed either way
+                if(close_function(fcli) == -1)
+                    return -1;
+                free(b);
+                continue;
+            }
+
+            buffer *b = create_buffer(session_id);
+
+            if(b == NULL)
+                return -1;
+
+            b->code = code;
+            process_input(b);
+
+            //the session is looked up and the request queued on it with registry_mutex
+            //held, so that it cannot be released (reaped, or unmounted) in between
+            pthread_mutex_lock(&registry_mutex);
+            session *se = get_session(session_id);
+
+            if(se == NULL || !(se->taken)) {
+                //unknown (or reaped) session: the request is dropped
+                pthread_mutex_unlock(&registry_mutex);
+                free(b->content);
+                free(b);
+                continue;
+            }
+
+            if(code == TFS_OP_CODE_MOUNT)
+                se->weight = session_weight(b->name);
+
+            b->se = se;
+            admit(b);
+            submit(b);
+            pthread_mutex_unlock(&registry_mutex);
+        }
+    }
+
+    return 0;
+}
+
+void *dispatcher(void *arg) {
+    if(dispatch((int)(intptr_t)arg) == -1)
+        exit(EXIT_FAILURE);
+    return 0;
+}
+
+//wakes the dispatchers of every endpoint but the first up, to shut down or pause
+void wake_dispatchers() {
+    int stop = -1;
+
+    for(int e = 1; e < n_endpoints; e++)
+        write_function(wake[e][1], &stop, sizeof(int));
+}
+
+//keeps a dispatcher (with nothing left in its inbox) from reading requests
+//while a handoff is under way
+void pause_dispatcher() {
+    pthread_mutex_lock(&sched_mutex);
+    if(handing_off) {
+        paused++;
+        pthread_cond_signal(&drained_cond);
+        while(handing_off)
+            pthread_cond_wait(&resume_cond, &sched_mutex);
+        paused--;
+    }
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+int listen_handoff() {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    if(sock == -1)
+        return -1;
+
+    strcpy(addr.sun_path, handoff_path);
+    unlink(handoff_path);
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, 1) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+//passes the connections of servers taking over to endpoint 0's dispatcher
+void *accept_handoff(void *arg) {
+    (void)arg;
+
+    for(;;) {
+        int sock = accept(handoff_listener, NULL, NULL);
+
+        if(sock == -1) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return 0;
+        }
+        write_function(wake[0][1], &sock, sizeof(int));
+    }
+}
+
+//hands the server over to the one connected to sock, and exits; returns only
+//if that fails, in which case this server carries on
+void hand_off(int sock) {
+    struct timespec deadline;
+    int drained;
+    char ack;
+
+    //no new request is read meanwhile (once the other dispatchers pause),
+    //so the queues only drain
+    pthread_mutex_lock(&sched_mutex);
+    handing_off = TRUE;
+    pthread_mutex_unlock(&sched_mutex);
+    wake_dispatchers();
+
+    pthread_mutex_lock(&sched_mutex);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += HANDOFF_DRAIN_TIMEOUT;
+    while(mounted && (running > 0 || queued_requests > 0 || paused < n_endpoints - 1)) {
+        if(pthread_cond_timedwait(&drained_cond, &sched_mutex, &deadline) == ETIMEDOUT)
+            break;
+    }
+    drained = mounted && running == 0 && queued_requests == 0 && paused == n_endpoints - 1;
+    pthread_mutex_unlock(&sched_mutex);
+
+    //replies still being written would be lost when this server exits
+    if(drained && engine != ENGINE_SYNC)
+        uring_drain();
+
+    //the new server acknowledges once it has taken everything over; until
+    //then, this server keeps the backing file and the checkpoints
+    if(drained && send_state(sock) == 0) {
+        if(read(sock, &ack, sizeof(char)) == sizeof(char)) {
+            tfs_export_commit();
+            printf("Handed the server over\n");
+            exit(EXIT_SUCCESS);
+        }
+        tfs_export_abort();
+    }
+
+    printf("Handoff failed, carrying on\n");
+    close_function(sock);
+    pthread_mutex_lock(&sched_mutex);
+    handing_off = FALSE;
+    pthread_cond_broadcast(&resume_cond);
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+//exports the FS and sends it, with the sessions and the pipes; if successful,
+//the export is still to be committed (or aborted)
+int send_state(int sock) {
+    handoff_header header = { .endpoints = n_endpoints, .sessions = 0 };
+    handoff_session batch[HANDOFF_BATCH];
+    int fds[2 * HANDOFF_BATCH];
+    int n = 0, n_fds = 0, ret = -1;
+    int state = memfd_create("tfs_state", MFD_CLOEXEC);
+
+    if(state == -1)
+        return -1;
+    if(tfs_export(state) == -1) {
+        close_function(state);
+        return -1;
+    }
+    if(lseek(state, 0, SEEK_SET) == -1)
+        goto out;
+
+    for(int c = 0; c < n_chunks; c++) {
+        for(int i = 0; i < S; i++)
+            header.sessions += chunks[c][i].taken && chunks[c][i].fcli != FREE;
+    }
+
+    for(int e = 0; e < n_endpoints; e++)
+        fds[e] = endpoints[e];
+    fds[n_endpoints] = state;
+    if(send_fds(sock, &header, sizeof(header), fds, n_endpoints + 1) == -1)
+        goto out;
+
+    for(int c = 0; c < n_chunks; c++) {
+        for(int i = 0; i < S; i++) {
+            session *se = &chunks[c][i];
+
+            if(!(se->taken) || se->fcli == FREE)
+                continue;
+
+            batch[n].session_id = se->session_id;
+            batch[n].fs_session = se->fs_session;
+            batch[n].weight = se->weight;
+            batch[n].leases = lease_fds[se->fs_session] != FREE;
+            fds[n_fds++] = se->fcli;
+            if(batch[n++].leases)
+                fds[n_fds++] = lease_fds[se->fs_session];
+            if(n == HANDOFF_BATCH) {
+                if(send_fds(sock, batch, sizeof(batch), fds, n_fds) == -1)
+                    goto out;
+                n = n_fds = 0;
+            }
+        }
+    }
+    if(n > 0 && send_fds(sock, batch, (size_t)n * sizeof(handoff_session), fds, n_fds) == -1)
+        goto out;
+    ret = 0;
+
+out:
+    close_function(state);
+    if(ret == -1)
+        tfs_export_abort();
+    return ret;
+}
 
-                if(!(found)) {
-                    buffer *b = create_buffer(0);
-                    int fcli, taken = ALL_TAKEN;
+//takes the FS, the sessions and the pipes over from the server listening
+//on the handoff socket
+int take_over(tfs_params const *params) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    handoff_header header;
+    handoff_session batch[HANDOFF_BATCH];
+    int fds[2 * HANDOFF_BATCH];
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    char ack = 1;
+
+    strcpy(addr.sun_path, handoff_path);
+    if(sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        return -1;
 
-                    if(b == NULL)
-                        return -1;
+    int header_fds = recv_fds(sock, &header, sizeof(header), fds, MAX_ENDPOINTS + 1);
 
-                    mount_input(b);
-                    if((fcli = open_function(b->name, O_WRONLY)) == -1)
-                        return -1;
+    if(header_fds < 2 || header.endpoints < 1 || header.endpoints > MAX_ENDPOINTS || header_fds != header.endpoints + 1)
+        return -1;
+    n_endpoints = header.endpoints;
+    for(int e = 0; e < n_endpoints; e++)
+        endpoints[e] = fds[e];
+    if(tfs_import(params, fds[n_endpoints]) == -1)
+        return -1;
+    close_function(fds[n_endpoints]);
+    tfs_set_recall_function(recall);
 
-                    write_function(fcli, &taken, sizeof(int)); //not necessary to treat error because client pipe will be closed either way
-                    if(close_function(fcli) == -1)
-                        return -1;
-                    free(b);
-                    continue;
-                }
-            }
-            buffer *b = threads[session_id];
-            pthread_mutex_lock(&b->mutex);
-            while(b->reading && mounted) pthread_cond_wait(&cond_prod[b->session_id], &b->mutex);
+    for(int received = 0; received < header.sessions; ) {
+        int n = header.sessions - received < HANDOFF_BATCH ? header.sessions - received : HANDOFF_BATCH;
+        int n_fds = recv_fds(sock, batch, (size_t)n * sizeof(handoff_session), fds, 2 * HANDOFF_BATCH);
+        int next_fd = 0;
 
-            if(!(mounted)) {
-                pthread_mutex_unlock(&b->mutex);
-                pthread_mutex_destroy(&b->mutex);
-                break;
-            }
+        if(n_fds == -1)
+            return -1;
 
-            b->writing = TRUE;
-            b->code = code;
-            b->session_id = session_id;
+        for(int i = 0; i < n; i++) {
+            session *se;
 
-            process_input(b);
+            if(next_fd + 1 + batch[i].leases > n_fds || batch[i].fs_session < 0 || batch[i].fs_session >= MAX_SESSIONS)
+                return -1;
 
-            b->writing = FALSE;
-            pthread_mutex_unlock(&b->mutex);
-            pthread_cond_signal(&cond_cons[b->session_id]);
+            while(batch[i].session_id / S >= n_chunks) {
+                if(add_chunk() == -1)
+                    return -1;
+            }
+            se = &chunks[batch[i].session_id / S][batch[i].session_id % S];
+            se->taken = TRUE;
+            se->fcli = fds[next_fd++];
+            se->fs_session = batch[i].fs_session;
+            if(batch[i].leases)
+                lease_fds[se->fs_session] = fds[next_fd++];
+            se->weight = batch[i].weight;
         }
+        received += n;
     }
 
-    for(int i = 0; i < S; i++)
-        pthread_join(tid[i], NULL);
-
-    for(int i = 0; i < S; i++) {
-        free(threads[i]);
-        free(session_ids[i]);
+    //the free session ids are the ones not taken, lowest on top
+    free_count = 0;
+    for(int id = n_chunks * S - 1; id >= 0; id--) {
+        if(!(chunks[id / S][id % S].taken))
+            free_ids[free_count++] = id;
     }
 
-    return -1;
-}
-
-void initialize_sessions() {
-    for(int i = 0; i < S; i++)
-        sessions[i] = FREE;
-}
+    if(write_function(sock, &ack, sizeof(char)) == -1)
+        return -1;
+    close_function(sock);
 
-void empty_buffer(buffer *b) {
-    b->code = '\0';
-    b->fhandle = 0;
-    b->len = 0;
-    b->flags = 0;
-    for(int i = 0; i < NAME_SIZE; i++)
-        b->name[i] = '\0';
-    b->content = NULL;
+    return 0;
 }
 
-void initialize_threads_buffers() {
-    for(int session_id = 0; session_id < S; session_id++) {
-        buffer *b = create_buffer(session_id);
-
-        if(b == NULL)
-            exit(EXIT_FAILURE);
+int send_fds(int sock, void *data, size_t len, int *fds, int n_fds) {
+    char control[CMSG_SPACE(2 * HANDOFF_BATCH * sizeof(int))];
+    struct iovec iov = { .iov_base = data, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = CMSG_SPACE((size_t)n_fds * sizeof(int))
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
 
-        pthread_mutex_init(&b->mutex, NULL);
-        pthread_cond_init(&cond_prod[b->session_id], NULL);
-        pthread_cond_init(&cond_cons[b->session_id], NULL);
+    if(cmsg == NULL)
+        return -1;
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN((size_t)n_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, (size_t)n_fds * sizeof(int));
 
-        threads[session_id] = b;
+    while(sendmsg(sock, &msg, 0) == -1) {
+        if(errno != EINTR)
+            return -1;
     }
+    return 0;
 }
 
-void *work(void *arg) {
-    int s = *((int*)arg);
-    buffer *b = threads[s];
+//returns the number of file descriptors received (at most max_fds), -1 on error
+int recv_fds(int sock, void *data, size_t len, int *fds, int max_fds) {
+    char control[CMSG_SPACE(2 * HANDOFF_BATCH * sizeof(int))];
+    struct iovec iov = { .iov_base = data, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control)
+    };
+    ssize_t rd;
 
-    while(mounted) {
-        pthread_mutex_lock(&b->mutex);
-        while(b->writing && mounted) pthread_cond_wait(&cond_cons[b->session_id], &b->mutex);
+    while((rd = recvmsg(sock, &msg, 0)) == -1) {
+        if(errno != EINTR)
+            return -1;
+    }
 
-        if(!(mounted)) {
-            pthread_mutex_unlock(&b->mutex);
-            pthread_mutex_destroy(&b->mutex);
-            break;
-        }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
 
-        b->reading = TRUE;        
-        process(b);
+    if(rd != (ssize_t)len || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
 
-        empty_buffer(b);
+    size_t n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
 
-        b->reading = FALSE;
-        b->writing = TRUE;
+    if(n_fds > (size_t)max_fds)
+        return -1;
+    memcpy(fds, CMSG_DATA(cmsg), n_fds * sizeof(int));
+    return (int)n_fds;
+}
 
-        pthread_mutex_unlock(&b->mutex);
-        pthread_cond_signal(&cond_prod[b->session_id]);
-    }
-    return 0;
+void empty_buffer(buffer *b) {
+    b->code = '\0';
+    b->fhandle = 0;
+    b->len = 0;
+    b->flags = 0;
+    b->snapshot = 0;
+    for(int i = 0; i < NAME_SIZE; i++)
+        b->name[i] = '\0';
+    b->content = NULL;
+    b->retry_us = 0;
 }
 
 void process_input(buffer *b) {
@@ -283,6 +1258,29 @@ void process_input(buffer *b) {
             break;
         case TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED:
             break;
+        case TFS_OP_CODE_SNAPSHOT:
+            break;
+        case TFS_OP_CODE_SNAPSHOT_OPEN:
+            open_snapshot_file_input(b);
+            break;
+        case TFS_OP_CODE_SNAPSHOT_DELETE:
+            delete_snapshot_input(b);
+            break;
+        case TFS_OP_CODE_OPEN_INUMBER:
+            open_inumber_input(b);
+            break;
+        case TFS_OP_CODE_MMAP:
+            map_file_input(b);
+            break;
+        case TFS_OP_CODE_MUNMAP:
+            unmap_file_input(b);
+            break;
+        case TFS_OP_CODE_READDIR_PLUS:
+            list_dir_input(b);
+            break;
+        case TFS_OP_CODE_FSYNC:
+            sync_file_input(b);
+            break;
         default:
             return;
     }    
@@ -291,6 +1289,11 @@ void process_input(buffer *b) {
 void process(buffer *b) {
     char code = b->code;
 
+    if(b->retry_us != 0) {
+        answer_busy(b);
+        return;
+    }
+
     switch(code) {
         case TFS_OP_CODE_MOUNT:
             mount(b);
@@ -313,13 +1316,37 @@ void process(buffer *b) {
         case TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED:
             shutdown_after_all_closed(b);
             break;
+        case TFS_OP_CODE_SNAPSHOT:
+            take_snapshot(b);
+            break;
+        case TFS_OP_CODE_SNAPSHOT_OPEN:
+            open_snapshot_file(b);
+            break;
+        case TFS_OP_CODE_SNAPSHOT_DELETE:
+            delete_snapshot(b);
+            break;
+        case TFS_OP_CODE_OPEN_INUMBER:
+            open_inumber(b);
+            break;
+        case TFS_OP_CODE_MMAP:
+            map_file(b);
+            break;
+        case TFS_OP_CODE_MUNMAP:
+            unmap_file(b);
+            break;
+        case TFS_OP_CODE_READDIR_PLUS:
+            list_dir(b);
+            break;
+        case TFS_OP_CODE_FSYNC:
+            sync_file(b);
+            break;
         default:
             return;
     }
 }
 
-void mount_input(buffer *b) {
-    char pipename[NAME_SIZE+1];
+void name_input(char *name) {
+    char buf[NAME_SIZE+1];
     int i;
 
     for(i = 0; i < NAME_SIZE; i++) {
@@ -329,9 +1356,9 @@ void mount_input(buffer *b) {
 
         if(c == '\0')
             break;
-        pipename[i] = c;
+        buf[i] = c;
     }
-    pipename[i] = '\0';
+    buf[i] = '\0';
 
     for(; i < NAME_SIZE - 1; i++) {
         char c;
@@ -339,7 +1366,11 @@ void mount_input(buffer *b) {
             exit(EXIT_FAILURE);
     }
 
-    strcpy(b->name, pipename);
+    strcpy(name, buf);
+}
+
+void mount_input(buffer *b) {
+    name_input(b->name);
 } 
 
 void mount(buffer *b) {
@@ -348,56 +1379,215 @@ void mount(buffer *b) {
     if((fcli = open_function(b->name, O_WRONLY)) == -1)
         exit(EXIT_FAILURE);
 
-    sessions[b->session_id] = fcli;
-    if(write_function(fcli, &b->session_id, sizeof(int)) == -1)
+    if((b->se->fs_session = tfs_session_create()) == -1) {
+        int taken = ALL_TAKEN;
+
+        write_function(fcli, &taken, sizeof(int)); //the client pipe is closed either way
+        if(close_function(fcli) == -1)
+            exit(EXIT_FAILURE);
+        release_session(b->se);
+        return;
+    }
+
+    //clients that did not create a lease pipe get no leases
+    char lease_pipe[NAME_SIZE + sizeof(LEASE_SUFFIX)];
+
+    strcpy(lease_pipe, b->name);
+    strcat(lease_pipe, LEASE_SUFFIX);
+    pthread_mutex_lock(&lease_mutex);
+    lease_fds[b->se->fs_session] = open(lease_pipe, O_WRONLY | O_NONBLOCK);
+    pthread_mutex_unlock(&lease_mutex);
+
+    b->se->fcli = fcli;
+    if(write_function(fcli, &b->session_id, sizeof(int)) == -1 || write_function(fcli, &n_endpoints, sizeof(int)) == -1)
         unmount(b);
 }
 
 void unmount(buffer *b) {
-    int fcli = sessions[b->session_id];
+    close_session(b->se);
+}
+
+void close_session(session *se) {
+    int fcli = se->fcli;
+
+    //the files the client left open are closed with its session (and its leases dropped)
+    tfs_session_close(se->fs_session);
+    pthread_mutex_lock(&lease_mutex);
+    if(lease_fds[se->fs_session] != FREE)
+        close_function(lease_fds[se->fs_session]);
+    lease_fds[se->fs_session] = FREE;
+    pthread_mutex_unlock(&lease_mutex);
+    se->fs_session = FREE;
 
     if(close_function(fcli) == -1)
         exit(EXIT_FAILURE);
-    sessions[b->session_id] = FREE;
+    se->fcli = FREE;
+    release_session(se);
+}
+
+int owns_handle(buffer *b) {
+    return tfs_handle_session(b->fhandle) == b->se->fs_session;
 }
 
 void open_file_input(buffer *b) {
-    char file_name[NAME_SIZE+1];
-    int i;
+    name_input(b->name);
 
-    for(i = 0; i < NAME_SIZE; i++) {
-        char c;
-        if(read_function(&c, sizeof(char)) == -1)
-            exit(EXIT_FAILURE);
-        
-        if(c == '\0')
-            break;
-        file_name[i] = c;
-    }
-    file_name[i] = '\0';
+    if(read_function(&b->flags, sizeof(int)) == -1)
+        exit(EXIT_FAILURE);
+}
 
-    for(; i < NAME_SIZE - 1; i++) {
-        char c;
-        if(read_function(&c, sizeof(char)) == -1)
-            exit(EXIT_FAILURE);
+void open_file(buffer *b) {
+    int fcli, answer;
+
+    fcli = b->se->fcli;
+
+    answer = tfs_open_in_session(b->se->fs_session, b->name, b->flags);
+
+    if(write_function(fcli, &answer, sizeof(int)) == -1) {
+        unmount(b);
+        return;
     }
-    strcpy(b->name, file_name);
+    if(answer != -1)
+        send_lease(b, answer);
+}
 
+void open_inumber_input(buffer *b) {
+    if(read_function(&b->inumber, sizeof(int)) == -1)
+        exit(EXIT_FAILURE);
     if(read_function(&b->flags, sizeof(int)) == -1)
         exit(EXIT_FAILURE);
+    if(read_function(&b->offset, sizeof(size_t)) == -1)
+        exit(EXIT_FAILURE);
 }
 
-void open_file(buffer *b) {
+void open_inumber(buffer *b) {
+    int fcli, answer;
+
+    fcli = b->se->fcli;
+
+    answer = tfs_open_inumber(b->se->fs_session, b->inumber, b->flags, b->offset);
+
+    if(write_function(fcli, &answer, sizeof(int)) == -1) {
+        unmount(b);
+        return;
+    }
+    if(answer != -1)
+        send_lease(b, answer);
+}
+
+//the answer to an open goes on with its leases: the file's i-number (-1 if
+//none) and, if there are any, the directory's i-number and the file's size
+//(-1 if its contents were not leased) and contents
+void send_lease(buffer *b, int fhandle) {
+    char contents[LEASE_MAX_SIZE];
+    lease_t lease = { .l_inumber = -1 };
+    int fcli, leases;
+
+    fcli = b->se->fcli;
+
+    pthread_mutex_lock(&lease_mutex);
+    leases = lease_fds[b->se->fs_session] != FREE;
+    pthread_mutex_unlock(&lease_mutex);
+
+    //a truncated file is about to be written
+    if(leases && !(b->flags & TFS_O_TRUNC) &&
+       tfs_lease(fhandle, &lease, contents, sizeof(contents)) == -1)
+        lease.l_inumber = -1;
+
+    if(write_function(fcli, &lease.l_inumber, sizeof(int)) == -1) {
+        unmount(b);
+        return;
+    }
+    if(lease.l_inumber == -1)
+        return;
+    if(write_function(fcli, &lease.l_dir, sizeof(int)) == -1 ||
+       write_function(fcli, &lease.l_size, sizeof(ssize_t)) == -1 ||
+       (lease.l_size != -1 && write_function(fcli, contents, (size_t)lease.l_size) == -1))
+        unmount(b);
+}
+
+void map_file_input(buffer *b) {
+    if(read_function(&b->fhandle, sizeof(int)) == -1)
+        exit(EXIT_FAILURE);
+}
+
+void map_file(buffer *b) {
+    int fcli, answer = -1, leases, layout[4];
+    size_t extent[2];
+    mapping_t mapping;
+
+    fcli = b->se->fcli;
+
+    pthread_mutex_lock(&lease_mutex);
+    leases = lease_fds[b->se->fs_session] != FREE;
+    pthread_mutex_unlock(&lease_mutex);
+
+    //without a lease pipe, the client could not be told the mapping is out of date
+    if(leases && owns_handle(b))
+        answer = tfs_mmap(b->fhandle, &mapping);
+
+    if(write_function(fcli, &answer, sizeof(int)) == -1) {
+        unmount(b);
+        return;
+    }
+    if(answer == -1)
+        return;
+
+    layout[0] = (int)getpid();
+    layout[1] = tfs_data_fd();
+    layout[2] = mapping.m_inumber;
+    layout[3] = mapping.m_block;
+    extent[0] = mapping.m_offset;
+    extent[1] = mapping.m_size;
+    if(write_function(fcli, layout, sizeof(layout)) == -1 ||
+       write_function(fcli, extent, sizeof(extent)) == -1)
+        unmount(b);
+}
+
+void unmap_file_input(buffer *b) {
+    if(read_function(&b->block, sizeof(int)) == -1)
+        exit(EXIT_FAILURE);
+}
+
+void unmap_file(buffer *b) {
     int fcli, answer;
 
-    fcli = sessions[b->session_id];
+    answer = tfs_munmap(b->se->fs_session, b->block);
 
-    answer = tfs_open(b->name, b->flags);
+    fcli = b->se->fcli;
 
     if(write_function(fcli, &answer, sizeof(int)) == -1)
         unmount(b);
 }
 
+void list_dir_input(buffer *b) {
+    if(read_function(&b->cookie, sizeof(int)) == -1)
+        exit(EXIT_FAILURE);
+    if(read_function(&b->max_entries, sizeof(int)) == -1)
+        exit(EXIT_FAILURE);
+}
+
+void list_dir(buffer *b) {
+    tfs_dirent_t entries[READDIR_BATCH];
+    int fcli, answer, max = b->max_entries;
+
+    if(max > READDIR_BATCH)
+        max = READDIR_BATCH;
+    answer = max < 1 ? -1 : tfs_readdir_plus(&b->cookie, entries, max);
+
+    fcli = b->se->fcli;
+
+    if(write_function(fcli, &answer, sizeof(int)) == -1) {
+        unmount(b);
+        return;
+    }
+    if(answer == -1)
+        return;
+    if(write_function(fcli, &b->cookie, sizeof(int)) == -1 ||
+       write_function(fcli, entries, (size_t)answer * sizeof(tfs_dirent_t)) == -1)
+        unmount(b);
+}
+
 void close_file_input(buffer *b) {
     if(read_function(&b->fhandle, sizeof(int)) == -1)
         exit(EXIT_FAILURE);
@@ -406,9 +1596,25 @@ void close_file_input(buffer *b) {
 void close_file(buffer *b) {
     int answer, fcli;
 
-    answer = tfs_close(b->fhandle);
+    answer = owns_handle(b) ? tfs_close(b->fhandle) : -1;
+
+    fcli = b->se->fcli;
+
+    if(write_function(fcli, &answer, sizeof(int)) == -1)
+        unmount(b);
+}
+
+void sync_file_input(buffer *b) {
+    if(read_function(&b->fhandle, sizeof(int)) == -1)
+        exit(EXIT_FAILURE);
+}
+
+void sync_file(buffer *b) {
+    int answer, fcli;
+
+    answer = owns_handle(b) ? tfs_fsync(b->fhandle) : -1;
 
-    fcli = sessions[b->session_id];
+    fcli = b->se->fcli;
 
     if(write_function(fcli, &answer, sizeof(int)) == -1)
         unmount(b);
@@ -432,10 +1638,10 @@ void write_file(buffer *b) {
     int fcli;
     ssize_t answer;
 
-    answer = tfs_write(b->fhandle, b->content, b->len);
+    answer = owns_handle(b) ? tfs_write(b->fhandle, b->content, b->len) : -1;
     free(b->content);
 
-    fcli = sessions[b->session_id];
+    fcli = b->se->fcli;
 
     if(write_function(fcli, &answer, sizeof(ssize_t)) == -1)
         unmount(b);
@@ -454,8 +1660,8 @@ void read_file(buffer *b) {
 
     char readBuffer[b->len];
 
-    answer = tfs_read(b->fhandle, readBuffer, b->len);
-    fcli = sessions[b->session_id];
+    answer = owns_handle(b) ? tfs_read(b->fhandle, readBuffer, b->len) : -1;
+    fcli = b->se->fcli;
 
     if(write_function(fcli, &answer, sizeof(ssize_t)) == -1) {
         unmount(b);
@@ -472,39 +1678,95 @@ void read_file(buffer *b) {
 void shutdown_after_all_closed(buffer *b) {
     int fcli, answer;
 
-    fcli = sessions[b->session_id];
+    fcli = b->se->fcli;
+
+    if(dedup) {
+        dedup_stats_t stats;
+        if(tfs_dedup_stats(&stats) == 0)
+            printf("Deduplication: %zu blocks hashed, %zu shared (%zu bytes "
+                   "saved), %llu ns spent\n", stats.ds_blocks_hashed,
+                   stats.ds_blocks_shared, stats.ds_bytes_saved,
+                   stats.ds_time_ns);
+    }
 
     answer = tfs_destroy_after_all_closed();
 
     if(write_function(fcli, &answer, sizeof(int)) == -1)
         unmount(b);
 
+    pthread_mutex_lock(&sched_mutex);
     mounted = FALSE;
+    pthread_cond_broadcast(&sched_cond);
+    pthread_cond_signal(&drained_cond);
+    pthread_mutex_unlock(&sched_mutex);
 
-    for(int i = 0; i < S; i++) {
-        pthread_cond_signal(&cond_cons[i]);
-    }
-    for(int i = 0; i < S; i++) {
-        pthread_cond_signal(&cond_prod[i]);
-    }
+    int stop = -1;
+    write_function(wake[0][1], &stop, sizeof(int));
+    wake_dispatchers();
+}
+
+void take_snapshot(buffer *b) {
+    int fcli, answer;
+
+    answer = tfs_snapshot();
+
+    fcli = b->se->fcli;
+
+    if(write_function(fcli, &answer, sizeof(int)) == -1)
+        unmount(b);
+}
+
+void open_snapshot_file_input(buffer *b) {
+    if(read_function(&b->snapshot, sizeof(int)) == -1)
+        exit(EXIT_FAILURE);
+    name_input(b->name);
+}
+
+void open_snapshot_file(buffer *b) {
+    int fcli, answer;
+
+    answer = tfs_snapshot_open_in_session(b->se->fs_session, b->snapshot, b->name);
+
+    fcli = b->se->fcli;
+
+    if(write_function(fcli, &answer, sizeof(int)) == -1)
+        unmount(b);
+}
+
+void delete_snapshot_input(buffer *b) {
+    if(read_function(&b->snapshot, sizeof(int)) == -1)
+        exit(EXIT_FAILURE);
+}
+
+void delete_snapshot(buffer *b) {
+    int fcli, answer;
+
+    answer = tfs_snapshot_delete(b->snapshot);
+
+    fcli = b->se->fcli;
+
+    if(write_function(fcli, &answer, sizeof(int)) == -1)
+        unmount(b);
 }
 
 int open_function(const char *file, int flag) {
     int fd;
     while((fd = open(file, flag)) == -1) {
-        if(errno == EINTR)
-            continue;
-        if(errno == EPIPE) 
+        if(errno != EINTR)
             return -1;
     }
     return fd;
 }
 
 int close_function(int fd) {
+    //the reply gathered for a client goes out before its pipe is closed
+    if(replying != NULL && fd == replying->fcli)
+        send_reply();
+    if(engine != ENGINE_SYNC)
+        uring_quiesce(fd);
+
     while(close(fd) == -1) {
-        if(errno == EINTR)
-            continue;
-        if(errno == EPIPE) 
+        if(errno != EINTR)
             return -1;
     }
     return 0;
@@ -512,30 +1774,99 @@ int close_function(int fd) {
 
 int write_function(int fd, void *buf, size_t bytes) {
     ssize_t written;
+
+    if(replying != NULL && fd == replying->fcli)
+        return gather_reply(buf, bytes);
+    //only an interrupted write is retried: any other error (EPIPE, or EBADF on a
+    //session already closed) means the client cannot be answered
     while((written = write(fd, buf, bytes)) == -1) {
-        if(errno == EINTR)
-            continue;
-        if(errno == EPIPE) 
+        if(errno != EINTR)
             return -1;
     }
 
     if(written < bytes)
-        write_function(fd, (char*)buf+written, bytes-(size_t)written);
+        return write_function(fd, (char*)buf+written, bytes-(size_t)written);
 
     return 0; 
 }
 
 int read_function(void *buf, size_t bytes) {
-    ssize_t rd;
-    while((rd = read(fserv, buf, bytes)) == -1) {
-        if(errno == EINTR)
+    while(bytes > 0) {
+        size_t available = inbox_end - inbox_start;
+
+        if(available == 0) {
+            ssize_t rd;
+
+            while((rd = fill_inbox()) == -1) {
+                if(errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if(rd == 0)
+                return -1;
             continue;
-        if(errno == EPIPE)
-            return -1;
+        }
+
+        size_t n = available < bytes ? available : bytes;
+
+        memcpy(buf, inbox + inbox_start, n);
+        inbox_start += n;
+        buf = (char*)buf + n;
+        bytes -= n;
     }
 
-    if(rd < bytes)
-        read_function((char*)buf+rd, bytes-(size_t)rd);
+    return 0;
+}
+
+//reads as much as this thread's endpoint holds (once the inbox is empty)
+ssize_t fill_inbox() {
+    ssize_t rd = read(endpoints[listening], inbox, INBOX_SIZE);
+
+    inbox_start = 0;
+    inbox_end = rd > 0 ? (size_t)rd : 0;
+    return rd;
+}
+
+int gather_reply(void *buf, size_t bytes) {
+    if(reply_len + bytes > reply_capacity) {
+        size_t capacity = reply_capacity == 0 ? 256 : reply_capacity;
+
+        while(capacity < reply_len + bytes)
+            capacity *= 2;
 
+        char *grown = realloc(reply, capacity);
+
+        if(grown == NULL)
+            return -1;
+        reply = grown;
+        reply_capacity = capacity;
+    }
+    memcpy(reply + reply_len, buf, bytes);
+    reply_len += bytes;
     return 0;
+}
+
+//sends the reply gathered for the session this thread is running a request of
+int send_reply() {
+    int fcli = replying->fcli, ret;
+    size_t len = reply_len;
+
+    if(len == 0)
+        return 0;
+    reply_len = 0;
+
+    if(engine == ENGINE_SYNC) {
+        session *se = replying;
+
+        replying = NULL;    //written straight away
+        ret = write_function(fcli, reply, len);
+        replying = se;
+        return ret;
+    }
+
+    //the engine frees the reply once it is written
+    ret = uring_write(fcli, reply, len);
+    reply = NULL;
+    reply_capacity = 0;
+    return ret;
 }
\ No newline at end of file
@@ -0,0 +1,332 @@
+#define _GNU_SOURCE /* syscall and MAP_POPULATE */
+
+#include "uring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* How long the SQPOLL kernel thread keeps polling an idle ring (ms) */
+#define SQ_THREAD_IDLE (1000)
+
+/*
+ * A write in flight: data[sent..len) is still to be written to fd
+ */
+typedef struct {
+    int w_fd;
+    char *w_data;
+    size_t w_len;
+    size_t w_sent;
+} uring_write_t;
+
+static int ring_fd = -1;
+static bool polled; /* SQPOLL */
+
+/* The rings, shared with the kernel */
+static void *sq_ring;
+static void *cq_ring;
+static size_t sq_ring_len;
+static size_t cq_ring_len;
+static struct io_uring_sqe *sqes;
+static size_t sqes_len;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+static unsigned sq_entries;
+
+/* Writes in flight (at most sq_entries, so that their completions always
+ * fit in the completion ring), in all and per file descriptor; ring_cond is
+ * signaled whenever one completes */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+static unsigned in_flight;
+static int *fd_in_flight;
+static int fd_capacity;
+
+static pthread_t completer;
+static bool completer_running;
+
+static int enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+/*
+ * Puts a write (or, if w is NULL, a no-op) in the submission ring and
+ * submits it, with ring_lock held and room in the ring
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int submit(uring_write_t *w) {
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (w == NULL) {
+        sqe->opcode = IORING_OP_NOP;
+    } else {
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = w->w_fd;
+        sqe->addr = (uint64_t)(uintptr_t)(w->w_data + w->w_sent);
+        sqe->len = (uint32_t)(w->w_len - w->w_sent);
+        sqe->off = (uint64_t)-1; /* at the file position (pipes have none) */
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)w;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (polled) {
+        /* the kernel thread only needs waking up once it has gone idle */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(sq_flags, __ATOMIC_RELAXED) &
+            IORING_SQ_NEED_WAKEUP) {
+            enter(0, 0, IORING_ENTER_SQ_WAKEUP);
+        }
+        return 0;
+    }
+    while (enter(1, 0, 0) == -1) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Accounts for a write that is done (or failed), with ring_lock held
+ */
+static void retire(uring_write_t *w) {
+    fd_in_flight[w->w_fd]--;
+    in_flight--;
+    free(w->w_data);
+    free(w);
+}
+
+/*
+ * Reaps the completions in the ring, with ring_lock held: short writes are
+ * submitted again for what is left, failed ones are dropped (their client
+ * went away, and its session is reaped).
+ * Returns: true if the no-op uring_destroy submits was among them
+ */
+static bool reap() {
+    bool stop = false;
+    unsigned head = *cq_head;
+
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe const *cqe = &cqes[head & *cq_mask];
+        uring_write_t *w = (uring_write_t *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        head++;
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+        if (w == NULL) {
+            stop = true;
+        } else if (res > 0 && w->w_sent + (size_t)res < w->w_len) {
+            w->w_sent += (size_t)res;
+            if (submit(w) == -1) {
+                retire(w);
+            }
+        } else {
+            retire(w);
+        }
+    }
+    pthread_cond_broadcast(&ring_cond);
+    return stop;
+}
+
+/*
+ * The completer thread: waits for completions and reaps them, until
+ * uring_destroy
+ */
+static void *complete(void *arg) {
+    (void)arg;
+
+    for (bool stop = false; !stop;) {
+        if (enter(0, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR) {
+            break;
+        }
+        pthread_mutex_lock(&ring_lock);
+        stop = reap();
+        pthread_mutex_unlock(&ring_lock);
+    }
+    return NULL;
+}
+
+/*
+ * Sets the ring up, and starts the completer thread
+ * Input:
+ *  - entries: writes that can be in flight at once
+ *  - sqpoll: have a kernel thread poll the ring for new writes, so that
+ *    queueing them takes no system call
+ * Returns: 0 if successful, -1 otherwise (e.g. if the kernel has no
+ * io_uring, or does not allow it)
+ */
+int uring_init(unsigned entries, bool sqpoll) {
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    if (sqpoll) {
+        params.flags = IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = SQ_THREAD_IDLE;
+    }
+    ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd == -1) {
+        return -1;
+    }
+    polled = sqpoll;
+    sq_entries = params.sq_entries;
+
+    sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_len =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    sq_ring = mmap(NULL, sq_ring_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    cq_ring = mmap(NULL, cq_ring_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+        sq_ring = sq_ring == MAP_FAILED ? NULL : sq_ring;
+        cq_ring = cq_ring == MAP_FAILED ? NULL : cq_ring;
+        sqes = sqes == MAP_FAILED ? NULL : sqes;
+        uring_destroy();
+        return -1;
+    }
+
+    char *sq = sq_ring, *cq = cq_ring;
+    sq_head = (unsigned *)(void *)(sq + params.sq_off.head);
+    sq_tail = (unsigned *)(void *)(sq + params.sq_off.tail);
+    sq_mask = (unsigned *)(void *)(sq + params.sq_off.ring_mask);
+    sq_flags = (unsigned *)(void *)(sq + params.sq_off.flags);
+    sq_array = (unsigned *)(void *)(sq + params.sq_off.array);
+    cq_head = (unsigned *)(void *)(cq + params.cq_off.head);
+    cq_tail = (unsigned *)(void *)(cq + params.cq_off.tail);
+    cq_mask = (unsigned *)(void *)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(void *)(cq + params.cq_off.cqes);
+
+    in_flight = 0;
+    if (pthread_create(&completer, NULL, complete, NULL) != 0) {
+        uring_destroy();
+        return -1;
+    }
+    completer_running = true;
+    return 0;
+}
+
+/*
+ * Waits for every write in flight, and takes the ring down
+ */
+void uring_destroy() {
+    if (completer_running) {
+        pthread_mutex_lock(&ring_lock);
+        while (in_flight > 0) {
+            pthread_cond_wait(&ring_cond, &ring_lock);
+        }
+        /* a no-op tells the completer to stop */
+        submit(NULL);
+        pthread_mutex_unlock(&ring_lock);
+        pthread_join(completer, NULL);
+        completer_running = false;
+    }
+
+    if (sqes != NULL) {
+        munmap(sqes, sqes_len);
+    }
+    if (cq_ring != NULL) {
+        munmap(cq_ring, cq_ring_len);
+    }
+    if (sq_ring != NULL) {
+        munmap(sq_ring, sq_ring_len);
+    }
+    sqes = NULL;
+    sq_ring = cq_ring = NULL;
+    if (ring_fd != -1) {
+        close(ring_fd);
+        ring_fd = -1;
+    }
+    free(fd_in_flight);
+    fd_in_flight = NULL;
+    fd_capacity = 0;
+}
+
+/*
+ * Queues a write
+ * Input:
+ *  - fd: file descriptor to write to
+ *  - data: what to write (allocated with malloc, and freed once written)
+ *  - len: its length
+ * Returns: 0 if it was queued, -1 otherwise (data is freed either way)
+ */
+int uring_write(int fd, void *data, size_t len) {
+    uring_write_t *w = malloc(sizeof(uring_write_t));
+    if (w == NULL || fd < 0) {
+        free(w);
+        free(data);
+        return -1;
+    }
+    w->w_fd = fd;
+    w->w_data = data;
+    w->w_len = len;
+    w->w_sent = 0;
+
+    pthread_mutex_lock(&ring_lock);
+    if (fd >= fd_capacity) {
+        int capacity = fd_capacity == 0 ? 64 : fd_capacity;
+        while (capacity <= fd) {
+            capacity *= 2;
+        }
+        int *grown = realloc(fd_in_flight, (size_t)capacity * sizeof(int));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&ring_lock);
+            free(w);
+            free(data);
+            return -1;
+        }
+        memset(grown + fd_capacity, 0,
+               (size_t)(capacity - fd_capacity) * sizeof(int));
+        fd_in_flight = grown;
+        fd_capacity = capacity;
+    }
+    while (in_flight == sq_entries) {
+        pthread_cond_wait(&ring_cond, &ring_lock);
+    }
+    fd_in_flight[fd]++;
+    in_flight++;
+    if (submit(w) == -1) {
+        retire(w);
+        pthread_mutex_unlock(&ring_lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&ring_lock);
+    return 0;
+}
+
+/*
+ * Waits until no write to a file descriptor is in flight (before it is
+ * closed, and its number possibly reused)
+ */
+void uring_quiesce(int fd) {
+    pthread_mutex_lock(&ring_lock);
+    while (fd >= 0 && fd < fd_capacity && fd_in_flight[fd] > 0) {
+        pthread_cond_wait(&ring_cond, &ring_lock);
+    }
+    pthread_mutex_unlock(&ring_lock);
+}
+
+/*
+ * Waits until no write is in flight
+ */
+void uring_drain() {
+    pthread_mutex_lock(&ring_lock);
+    while (in_flight > 0) {
+        pthread_cond_wait(&ring_cond, &ring_lock);
+    }
+    pthread_mutex_unlock(&ring_lock);
+}
@@ -0,0 +1,23 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Asynchronous writes through an io_uring: any thread queues a write with a
+ * single system call (or none, with SQPOLL, where a kernel thread picks new
+ * writes up from the ring), and a thread of the engine's own reaps their
+ * completions, resubmitting what was written short and freeing the buffers.
+ * Writes to the same file descriptor must not overlap (a second one is only
+ * queued once the first has been taken in, e.g. answered).
+ */
+
+int uring_init(unsigned entries, bool sqpoll);
+void uring_destroy();
+
+int uring_write(int fd, void *data, size_t len);
+void uring_quiesce(int fd);
+void uring_drain();
+
+#endif // URING_H
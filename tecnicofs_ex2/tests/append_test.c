@@ -0,0 +1,83 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Threads append records to the same file, each through its own handle
+    (in its own session), until the file is full: every record lands whole,
+    exactly once, and each thread's records land in the order they were
+    written.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+#define THREADS 8
+#define RECORD 8
+#define RECORDS (BLOCK_SIZE / RECORD / THREADS)
+
+void *append(void *arg) {
+    int t = *(int *)arg;
+    char record[RECORD + 1];
+
+    int session = tfs_session_create();
+    assert(session != -1);
+    int f = tfs_open_in_session(session, "/log", TFS_O_APPEND);
+    assert(f != -1);
+
+    for (int r = 0; r < RECORDS; r++) {
+        snprintf(record, sizeof(record), "t%dr%04d", t, r);
+        assert(tfs_write(f, record, RECORD) == RECORD);
+    }
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_session_close(session) != -1);
+    return NULL;
+}
+
+int main() {
+    char contents[BLOCK_SIZE + 1];
+    pthread_t threads[THREADS];
+    int ids[THREADS], next[THREADS] = {0};
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open("/log", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+
+    for (int t = 0; t < THREADS; t++) {
+        ids[t] = t;
+        assert(pthread_create(&threads[t], NULL, append, &ids[t]) == 0);
+    }
+    for (int t = 0; t < THREADS; t++) {
+        assert(pthread_join(threads[t], NULL) == 0);
+    }
+
+    f = tfs_open("/log", 0);
+    assert(f != -1);
+    assert(tfs_read(f, contents, sizeof(contents)) == BLOCK_SIZE);
+    assert(tfs_close(f) != -1);
+
+    for (int i = 0; i < BLOCK_SIZE; i += RECORD) {
+        int t, r;
+        assert(sscanf(contents + i, "t%1dr%4d", &t, &r) == 2);
+        assert(t >= 0 && t < THREADS && r == next[t]);
+        next[t]++;
+    }
+    for (int t = 0; t < THREADS; t++) {
+        assert(next[t] == RECORDS);
+    }
+
+    /* the file is full: an append writes nothing */
+    f = tfs_open("/log", TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, "x", 1) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
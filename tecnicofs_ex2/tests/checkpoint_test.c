@@ -0,0 +1,130 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*  Checkpoints TecnicoFS (with its data blocks shared, as the server keeps
+    them, and private) while a thread keeps rewriting a file, and checks that
+    a fresh instance loads the file system as it was when the last checkpoint
+    was taken: whole, with no torn block, and without what was written after.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+#define IMAGE "/tmp/tfs_checkpoint_test"
+#define LEN (1000)
+
+static volatile bool stop;
+
+void *rewrite(void *arg) {
+    char buffer[LEN];
+    (void)arg;
+
+    for (char c = 'a'; !stop; c = c == 'z' ? 'a' : (char)(c + 1)) {
+        memset(buffer, c, sizeof(buffer));
+        int f = tfs_open("/busy", TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(tfs_close(f) != -1);
+    }
+    return NULL;
+}
+
+void check(char const *path, char const *expected) {
+    char buffer[32];
+    size_t len = strlen(expected);
+
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == len);
+    assert(memcmp(buffer, expected, len) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+void check_loaded() {
+    char buffer[LEN + 1];
+    scrub_stats_t stats;
+
+    assert(tfs_scrub(1, &stats) != -1);
+    assert(stats.ss_blocks_corrupt == 0 && stats.ss_inode_blocks_corrupt == 0);
+
+    check("/f1", "checkpointed");
+
+    /* one of the versions of the file (or the file just truncated), not a
+     * mix of two */
+    int f = tfs_open("/busy", 0);
+    assert(f != -1);
+    ssize_t len = tfs_read(f, buffer, sizeof(buffer));
+    assert(len == 0 || len == LEN);
+    for (int i = 1; i < len; i++) {
+        assert(buffer[i] == buffer[0]);
+    }
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.checkpoint_file = IMAGE;
+    params.checkpoint_interval_ms = 0;
+    pthread_t writer;
+
+    for (int shared = 0; shared < 2; shared++) {
+        unlink(IMAGE);
+        params.shared_data = shared;
+
+        assert(tfs_init_with_params(&params) != -1);
+        int f = tfs_open("/f1", TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, "checkpointed", 12) == 12);
+        assert(tfs_close(f) != -1);
+        f = tfs_open("/busy", TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+
+        stop = false;
+        assert(pthread_create(&writer, NULL, rewrite, NULL) == 0);
+        for (int i = 0; i < 20; i++) {
+            assert(tfs_checkpoint() != -1);
+        }
+        stop = true;
+        assert(pthread_join(writer, NULL) == 0);
+
+        /* written after the last checkpoint */
+        f = tfs_open("/f1", TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, "lost", 4) == 4);
+        assert(tfs_close(f) != -1);
+        assert(tfs_open("/f2", TFS_O_CREAT) != -1);
+        assert(tfs_destroy() != -1);
+
+        assert(tfs_init_with_params(&params) != -1);
+        check_loaded();
+        assert(tfs_open("/f2", 0) == -1);
+        assert(tfs_destroy() != -1);
+    }
+
+    /* checkpointed periodically */
+    unlink(IMAGE);
+    params.checkpoint_interval_ms = 10;
+    assert(tfs_init_with_params(&params) != -1);
+    int f = tfs_open("/f3", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "periodic", 8) == 8);
+    assert(tfs_close(f) != -1);
+    nanosleep(&(struct timespec){.tv_nsec = 200 * 1000 * 1000}, NULL);
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init_with_params(&params) != -1);
+    check("/f3", "periodic");
+    assert(tfs_destroy() != -1);
+
+    unlink(IMAGE);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
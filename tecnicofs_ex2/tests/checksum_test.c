@@ -0,0 +1,73 @@
+#include "fs/crc32c.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks the CRC32C implementations against each other, then corrupts a
+    data block behind the FS's back and checks that reads and the scrub
+    detect it.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+int main() {
+    static unsigned char data[3 * BLOCK_SIZE];
+    char buffer[BLOCK_SIZE];
+    unsigned int seed = 1;
+    scrub_stats_t stats;
+
+    /* the standard check value */
+    assert(crc32c(0, "123456789", 9) == 0xE3069283);
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (unsigned char)rand_r(&seed);
+    }
+    for (size_t len = 0; len < sizeof(data); len += 7) {
+        assert(crc32c_hw(0, data, len) == crc32c_portable(0, data, len));
+    }
+    assert(crc32c(crc32c(0, data, 100), data + 100, 2000) ==
+           crc32c(0, data, 2100));
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open("/f1", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, data, 500) == 500);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_scrub(4, &stats) != -1);
+    assert(stats.ss_inode_blocks_checked > 0);
+    assert(stats.ss_inode_blocks_corrupt == 0);
+    assert(stats.ss_blocks_checked == 2); /* root directory and /f1 */
+    assert(stats.ss_blocks_corrupt == 0);
+
+    /* flip a bit in the file's block */
+    inode_t *inode = inode_get(tfs_lookup("/f1"));
+    assert(inode != NULL);
+    char *block = data_block_get(inode->i_data_block);
+    assert(block != NULL);
+    block[10] ^= 1;
+
+    f = tfs_open("/f1", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == -1);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_scrub(4, &stats) != -1);
+    assert(stats.ss_blocks_corrupt == 1);
+    assert(stats.ss_inode_blocks_corrupt == 0);
+
+    /* and in its i-node */
+    block[10] ^= 1;
+    inode->i_size++;
+    assert(tfs_scrub(1, &stats) != -1);
+    assert(stats.ss_blocks_corrupt == 0);
+    assert(stats.ss_inode_blocks_corrupt == 1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
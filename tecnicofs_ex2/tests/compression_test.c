@@ -0,0 +1,77 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Writes more than a block of (compressible) text to a compressed file,
+    reads it back, and checks that incompressible data is refused.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+int main() {
+    static char text[MAX_COMPRESSED_FILE_SIZE];
+    static char buffer[MAX_COMPRESSED_FILE_SIZE];
+    char noise[BLOCK_SIZE];
+    unsigned int seed = 1;
+
+    assert(tfs_init() != -1);
+
+    for (int i = 0; i < MAX_COMPRESSED_FILE_SIZE; i++) {
+        text[i] = (char)('a' + (i % 26));
+    }
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        noise[i] = (char)rand_r(&seed);
+    }
+
+    /* a plain file is still limited to a block */
+    int f = tfs_open("/plain", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, text, sizeof(text)) == BLOCK_SIZE);
+    assert(tfs_close(f) != -1);
+
+    /* a compressed one holds all of it, written in pieces */
+    f = tfs_open("/packed", TFS_O_CREAT | TFS_O_COMPRESS);
+    assert(f != -1);
+    for (size_t done = 0; done < sizeof(text); done += 100) {
+        size_t len = sizeof(text) - done < 100 ? sizeof(text) - done : 100;
+        assert(tfs_write(f, text + done, len) == (ssize_t)len);
+    }
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open("/packed", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, text, sizeof(text)) == 0);
+    assert(tfs_close(f) != -1);
+
+    /* reopening keeps the mode (and the larger size limit) */
+    f = tfs_open("/packed", TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, "x", 1) == 0);
+    assert(tfs_close(f) != -1);
+
+    /* random data does not compress into a block */
+    f = tfs_open("/noise", TFS_O_CREAT | TFS_O_COMPRESS);
+    assert(f != -1);
+    assert(tfs_write(f, noise, sizeof(noise)) == -1);
+    assert(tfs_close(f) != -1);
+
+    /* truncating without the flag turns the file back into a plain one */
+    f = tfs_open("/packed", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, noise, sizeof(noise)) == sizeof(noise));
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open("/packed", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(noise));
+    assert(memcmp(buffer, noise, sizeof(noise)) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,67 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Writes the same full block to two files (so that they share storage),
+    then changes one of them and checks that the other one is unaffected.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+static void write_file(char const *path, char const *contents) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, contents, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_close(f) != -1);
+}
+
+static void check_file(char const *path, char const *contents) {
+    char buffer[BLOCK_SIZE];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(buffer, contents, BLOCK_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    char template[BLOCK_SIZE];
+    char changed[BLOCK_SIZE];
+    dedup_stats_t stats;
+
+    tfs_params params = tfs_default_params();
+    params.dedup = true;
+    assert(tfs_init_with_params(&params) != -1);
+
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        template[i] = (char)('a' + (i % 26));
+    }
+    memcpy(changed, template, BLOCK_SIZE);
+    changed[0] = '!';
+
+    write_file("/f1", template);
+    write_file("/f2", template);
+    write_file("/f3", changed);
+
+    assert(tfs_dedup_stats(&stats) != -1);
+    assert(stats.ds_blocks_hashed == 3);
+    assert(stats.ds_blocks_shared == 1);
+    assert(stats.ds_bytes_saved == BLOCK_SIZE);
+
+    /* writing to a shared block must not affect the other file */
+    int f = tfs_open("/f2", 0);
+    assert(f != -1);
+    assert(tfs_write(f, "!", 1) == 1);
+    assert(tfs_close(f) != -1);
+
+    check_file("/f1", template);
+    check_file("/f2", changed);
+    check_file("/f3", changed);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Fills the root directory with files whose names share long prefixes,
+    and checks that each one is found (and that missing names are not).
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+static void make_name(char *name, size_t i) {
+    sprintf(name, "/a_rather_long_common_prefix_%zu", i);
+}
+
+int main() {
+    char name[MAX_FILE_NAME + 10];
+    int inumbers[MAX_DIR_ENTRIES];
+
+    assert(tfs_init() != -1);
+
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        make_name(name, i);
+        int f = tfs_open(name, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+        inumbers[i] = tfs_lookup(name);
+        assert(inumbers[i] != -1);
+    }
+
+    /* the directory is full */
+    assert(tfs_open("/one_too_many", TFS_O_CREAT) == -1);
+
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        make_name(name, i);
+        assert(tfs_lookup(name) == inumbers[i]);
+        for (size_t j = 0; j < i; j++) {
+            assert(inumbers[j] != inumbers[i]);
+        }
+    }
+
+    make_name(name, MAX_DIR_ENTRIES);
+    assert(tfs_lookup(name) == -1);
+    assert(tfs_lookup("/a_rather_long_common_prefix_") == -1);
+    assert(tfs_lookup("/a_rather_long_common_prefix_1x") == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*  Writes files to a TecnicoFS instance with a backing file, syncs them
+    (with tfs_fsync, on close and periodically) and checks that a fresh
+    instance, started from the same backing file, finds them there. A write
+    that was never synced to the backing file is not expected to survive.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+#define BACKING_FILE "/tmp/tfs_durability_test"
+
+void check(char const *path, char const *expected) {
+    char buffer[32];
+    size_t len = strlen(expected);
+
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == len);
+    assert(memcmp(buffer, expected, len) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+/* Flips a bit of a data block the latest sync wrote (one whose place
+ * differs between the two metadata slots), as a torn write would */
+void corrupt_latest_block() {
+    static backing_meta_t slots[2];
+
+    int fd = open(BACKING_FILE, O_RDWR);
+    assert(fd != -1);
+    for (int s = 0; s < 2; s++) {
+        assert(pread(fd, &slots[s], sizeof(slots[s]),
+                     (off_t)((size_t)s * BACKING_SLOT)) == sizeof(slots[s]));
+    }
+    backing_meta_t const *latest =
+        slots[0].bm_seq > slots[1].bm_seq ? &slots[0] : &slots[1];
+    backing_meta_t const *previous =
+        latest == &slots[0] ? &slots[1] : &slots[0];
+
+    int b = 0;
+    while (b < DATA_BLOCKS &&
+           (latest->bm_free_blocks[b] != TAKEN ||
+            latest->bm_block_area[b] == previous->bm_block_area[b])) {
+        b++;
+    }
+    assert(b < DATA_BLOCKS);
+    off_t offset = (off_t)BACKING_BLOCK(b, latest->bm_block_area[b]);
+    char byte;
+    assert(pread(fd, &byte, 1, offset) == 1);
+    byte ^= 1;
+    assert(pwrite(fd, &byte, 1, offset) == 1);
+    close(fd);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.backing_file = BACKING_FILE;
+
+    unlink(BACKING_FILE);
+
+    /* synced explicitly */
+    assert(tfs_init_with_params(&params) != -1);
+    int f = tfs_open("/f1", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "synced", 6) == 6);
+    assert(tfs_fsync(f) != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init_with_params(&params) != -1);
+    check("/f1", "synced");
+
+    /* synced on close */
+    assert(tfs_destroy() != -1);
+    params.sync_policy = SYNC_ON_CLOSE;
+    assert(tfs_init_with_params(&params) != -1);
+    f = tfs_open("/f2", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "closed", 6) == 6);
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/f1", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, "rewritten", 9) == 9);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init_with_params(&params) != -1);
+    check("/f1", "rewritten");
+    check("/f2", "closed");
+
+    /* synced periodically, by an instance that then dies without being
+     * destroyed */
+    assert(tfs_destroy() != -1);
+    params.sync_policy = SYNC_PERIODIC;
+    params.sync_interval_ms = 10;
+    int pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        assert(tfs_init_with_params(&params) != -1);
+        f = tfs_open("/f3", TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, "periodic", 8) == 8);
+        assert(tfs_close(f) != -1);
+        nanosleep(&(struct timespec){.tv_nsec = 200 * 1000 * 1000}, NULL);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WEXITSTATUS(status) == 0);
+
+    assert(tfs_init_with_params(&params) != -1);
+    check("/f1", "rewritten");
+    check("/f2", "closed");
+    check("/f3", "periodic");
+
+    /* an export nobody takes over leaves the backing file in use */
+    FILE *state = tmpfile();
+    assert(state != NULL);
+    assert(tfs_export(fileno(state)) != -1);
+    assert(tfs_export_abort() != -1);
+    fclose(state);
+    f = tfs_open("/f4", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "kept", 4) == 4);
+    assert(tfs_fsync(f) != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    params.sync_policy = SYNC_NONE;
+    assert(tfs_init_with_params(&params) != -1);
+    check("/f4", "kept");
+
+    /* a sync whose blocks are torn leaves the previous one to load */
+    f = tfs_open("/f4", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, "torn", 4) == 4);
+    assert(tfs_fsync(f) != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+    corrupt_latest_block();
+
+    assert(tfs_init_with_params(&params) != -1);
+    check("/f4", "kept");
+    assert(tfs_destroy() != -1);
+
+    unlink(BACKING_FILE);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
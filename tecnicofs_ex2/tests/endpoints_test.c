@@ -0,0 +1,96 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Clients rewrite and reread a block-sized file each, all at once. Run
+ * against a server with several endpoints (-k), their pipes' names hash
+ * them onto different ones, whose requests are read by different threads;
+ * each client must still see its requests run in order, and the last one
+ * must see every file. */
+
+#define CLIENT_COUNT 12
+#define ROUNDS 200
+#define FILE_SIZE 1024
+#define CLIENT_PIPE_NAME_FORMAT "/tmp/tfs_endpoint%d"
+
+void fill(char *buffer, int client_id, int round) {
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        buffer[i] = (char)('a' + (client_id + round + (int)i) % 26);
+    }
+}
+
+void run_client(char *server_pipe, int client_id) {
+    char client_pipe[40], path[40];
+    char expected[FILE_SIZE], buffer[FILE_SIZE];
+
+    sprintf(client_pipe, CLIENT_PIPE_NAME_FORMAT, client_id);
+    sprintf(path, "/f%d", client_id);
+    assert(tfs_mount(client_pipe, server_pipe) == 0);
+
+    for (int round = 0; round < ROUNDS; round++) {
+        fill(expected, client_id, round);
+
+        int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, expected, FILE_SIZE) == FILE_SIZE);
+        assert(tfs_close(f) != -1);
+
+        f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, FILE_SIZE) == FILE_SIZE);
+        assert(memcmp(buffer, expected, FILE_SIZE) == 0);
+        assert(tfs_close(f) != -1);
+    }
+
+    assert(tfs_unmount() == 0);
+}
+
+int main(int argc, char **argv) {
+    char client_pipe[40], path[40];
+    char expected[FILE_SIZE], buffer[FILE_SIZE];
+    int child_pids[CLIENT_COUNT];
+
+    if (argc < 2) {
+        printf(
+            "You must provide the following arguments: 'server_pipe_path'\n");
+        return 1;
+    }
+
+    for (int i = 1; i < CLIENT_COUNT; i++) {
+        int pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            run_client(argv[1], i);
+            exit(0);
+        }
+        child_pids[i] = pid;
+    }
+
+    for (int i = 1; i < CLIENT_COUNT; i++) {
+        int result;
+        assert(waitpid(child_pids[i], &result, 0) == child_pids[i]);
+        assert(WIFEXITED(result) && WEXITSTATUS(result) == 0);
+    }
+
+    sprintf(client_pipe, CLIENT_PIPE_NAME_FORMAT, 0);
+    assert(tfs_mount(client_pipe, argv[1]) == 0);
+    for (int i = 1; i < CLIENT_COUNT; i++) {
+        sprintf(path, "/f%d", i);
+        fill(expected, i, ROUNDS - 1);
+
+        int f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, FILE_SIZE) == FILE_SIZE);
+        assert(memcmp(buffer, expected, FILE_SIZE) == 0);
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
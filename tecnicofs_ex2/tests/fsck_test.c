@@ -0,0 +1,142 @@
+#include "fs/crc32c.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*  Checkpoints TecnicoFS to an image, checks it with tfs_fsck (which must
+    be built, and is run from the directory the test is run from), and then
+    checks it again after corrupting it in several ways, each of which
+    tfs_fsck must find.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+#define IMAGE "/tmp/tfs_fsck_test"
+#define CORRUPT "/tmp/tfs_fsck_test.corrupt"
+
+static backing_meta_t meta;
+
+int fsck(char const *image) {
+    char command[128];
+    snprintf(command, sizeof(command), "./fs/tfs_fsck %s -j 4 >/dev/null",
+             image);
+    int status = system(command);
+    assert(status != -1 && WIFEXITED(status));
+    return WEXITSTATUS(status);
+}
+
+/*
+ * Copies the image, with its metadata replaced by meta (resealed), and, if
+ * block is not -1, a byte of that data block flipped
+ */
+void corrupt(int block) {
+    char buffer[BLOCK_SIZE];
+    int in = open(IMAGE, O_RDONLY);
+    int out = open(CORRUPT, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(in != -1 && out != -1);
+    ssize_t got;
+    while ((got = read(in, buffer, sizeof(buffer))) > 0) {
+        assert(write(out, buffer, (size_t)got) == got);
+    }
+
+    meta.bm_crc = crc32c(0, &meta.bm_seq,
+                         sizeof(meta) - offsetof(backing_meta_t, bm_seq));
+    assert(pwrite(out, &meta, sizeof(meta), 0) == sizeof(meta));
+    if (block != -1) {
+        off_t offset =
+            (off_t)BACKING_BLOCK(block, meta.bm_block_area[block]);
+        assert(pread(out, buffer, 1, offset) == 1);
+        buffer[0] ^= 1;
+        assert(pwrite(out, buffer, 1, offset) == 1);
+    }
+    close(in);
+    close(out);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.checkpoint_file = IMAGE;
+    params.checkpoint_interval_ms = 0;
+
+    unlink(IMAGE);
+    assert(tfs_init_with_params(&params) != -1);
+    for (int i = 0; i < 10; i++) {
+        char name[8];
+        snprintf(name, sizeof(name), "/f%d", i);
+        int f = tfs_open(name, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, name, strlen(name)) == strlen(name));
+        assert(tfs_close(f) != -1);
+    }
+    int f1 = tfs_lookup("/f1");
+    int f2 = tfs_lookup("/f2");
+    assert(f1 != -1 && f2 != -1);
+    assert(tfs_checkpoint() != -1);
+    assert(tfs_destroy() != -1);
+
+    assert(fsck(IMAGE) == 0);
+
+    int fd = open(IMAGE, O_RDONLY);
+    assert(fd != -1);
+    assert(read(fd, &meta, sizeof(meta)) == sizeof(meta));
+    close(fd);
+    backing_meta_t const good = meta;
+
+    /* resealed as is, it is still consistent */
+    corrupt(-1);
+    assert(fsck(CORRUPT) == 0);
+
+    /* an i-node in use, but in no directory */
+    int unused = INODE_TABLE_SIZE - 1;
+    assert(meta.bm_freeinode_ts[unused] == FREE);
+    meta.bm_freeinode_ts[unused] = TAKEN;
+    meta.bm_inode_table[unused] = meta.bm_inode_table[f1];
+    meta.bm_inode_table[unused].i_size = 0;
+    corrupt(-1);
+    assert(fsck(CORRUPT) == 1);
+
+    /* a data block owned by two files */
+    meta = good;
+    meta.bm_inode_table[f2].i_data_block = meta.bm_inode_table[f1].i_data_block;
+    corrupt(-1);
+    assert(fsck(CORRUPT) == 1);
+
+    /* a data block in use, but free */
+    meta = good;
+    meta.bm_free_blocks[meta.bm_inode_table[f1].i_data_block] = FREE;
+    corrupt(-1);
+    assert(fsck(CORRUPT) == 1);
+
+    /* a size that does not fit in the block */
+    meta = good;
+    meta.bm_inode_table[f1].i_size = BLOCK_SIZE + 1;
+    corrupt(-1);
+    assert(fsck(CORRUPT) == 1);
+
+    /* a data block that does not match its checksum */
+    meta = good;
+    corrupt(meta.bm_inode_table[f2].i_data_block);
+    assert(fsck(CORRUPT) == 1);
+
+    /* metadata that does not match its checksum */
+    meta = good;
+    corrupt(-1);
+    fd = open(CORRUPT, O_WRONLY);
+    assert(fd != -1);
+    assert(pwrite(fd, "x", 1, offsetof(backing_meta_t, bm_freeinode_ts)) == 1);
+    close(fd);
+    assert(fsck(CORRUPT) == 2);
+
+    unlink(IMAGE);
+    unlink(CORRUPT);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
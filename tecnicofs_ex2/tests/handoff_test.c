@@ -0,0 +1,84 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Exports the state of TecnicoFS (with files open in several sessions, a
+    buffered write and a snapshot), imports it into a fresh instance and
+    checks that everything carries on where it was left.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+int main() {
+    char buffer[32];
+    scrub_stats_t stats;
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open("/f1", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "hello world", 11) == 11);
+    assert(tfs_close(f) != -1);
+
+    int snapshot = tfs_snapshot();
+    assert(snapshot != -1);
+
+    int session_a = tfs_session_create();
+    int session_b = tfs_session_create();
+    assert(session_a != -1 && session_b != -1);
+
+    int reader = tfs_open_in_session(session_a, "/f1", 0);
+    assert(reader != -1);
+    assert(tfs_read(reader, buffer, 6) == 6);
+    int old = tfs_snapshot_open_in_session(session_a, snapshot, "/f1");
+    assert(old != -1);
+
+    int writer = tfs_open_in_session(session_b, "/f1", TFS_O_TRUNC);
+    assert(writer != -1);
+    assert(tfs_write(writer, "HELLO WORLD", 11) == 11); /* still buffered */
+
+    FILE *state = tmpfile();
+    assert(state != NULL);
+    assert(tfs_export(fileno(state)) != -1);
+    assert(tfs_export_commit() != -1);
+    assert(tfs_destroy() != -1);
+
+    rewind(state);
+    assert(tfs_import(NULL, fileno(state)) != -1);
+    fclose(state);
+
+    assert(tfs_scrub(1, &stats) != -1);
+    assert(stats.ss_blocks_corrupt == 0 && stats.ss_inode_blocks_corrupt == 0);
+
+    /* the handles, and their offsets, survived the handoff */
+    assert(tfs_read(reader, buffer, sizeof(buffer)) == 5);
+    assert(memcmp(buffer, "WORLD", 5) == 0);
+    assert(tfs_read(old, buffer, sizeof(buffer)) == 11);
+    assert(memcmp(buffer, "hello world", 11) == 0);
+    assert(tfs_write(writer, "!", 1) == 1);
+
+    /* new handles and sessions do not clash with the imported ones */
+    int another = tfs_open_in_session(session_a, "/f1", 0);
+    assert(another != -1 && another != reader && another != old);
+    int session_c = tfs_session_create();
+    assert(session_c != -1 && session_c != session_a &&
+           session_c != session_b);
+
+    assert(tfs_session_close(session_a) != -1);
+    assert(tfs_session_close(session_b) != -1);
+    assert(tfs_session_close(session_c) != -1);
+    assert(tfs_snapshot_delete(snapshot) != -1);
+
+    f = tfs_open("/f1", 0);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 12);
+    assert(memcmp(buffer, "HELLO WORLD!", 12) == 0);
+    assert(tfs_close(f) != -1);
+
+    /* no file is left open, so this does not wait */
+    assert(tfs_destroy_after_all_closed() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
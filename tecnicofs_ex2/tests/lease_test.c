@@ -0,0 +1,94 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* A client rereads a file it holds a lease on (from its cache) while
+ * another client rewrites it: the rewrite recalls the lease, so the first
+ * client sees the new contents, including through a handle it had open, at
+ * the offset it had reached. Files are reopened by their cached names'
+ * i-numbers. */
+
+void reread(char const *expected) {
+    char buffer[16];
+    size_t len = strlen(expected);
+
+    int f = tfs_open("/cfg", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == len);
+    assert(memcmp(buffer, expected, len) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main(int argc, char **argv) {
+    char buffer[16];
+    int go[2];
+
+    if (argc < 2) {
+        printf(
+            "You must provide the following arguments: 'server_pipe_path'\n");
+        return 1;
+    }
+    assert(pipe(go) == 0);
+
+    assert(tfs_mount("/tmp/tfs_lease_reader", argv[1]) == 0);
+
+    int f = tfs_open("/cfg", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "v1", 2) == 2);
+    assert(tfs_close(f) != -1);
+
+    for (int i = 0; i < 100; i++) {
+        reread("v1");
+    }
+
+    /* a handle kept open across the rewrite */
+    int held = tfs_open("/cfg", 0);
+    assert(held != -1);
+    assert(tfs_read(held, buffer, 1) == 1 && buffer[0] == 'v');
+
+    int pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        assert(tfs_mount("/tmp/tfs_lease_writer", argv[1]) == 0);
+        f = tfs_open("/cfg", TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, "v22", 3) == 3);
+        assert(tfs_close(f) != -1);
+        assert(tfs_unmount() == 0);
+        assert(write(go[1], "", 1) == 1);
+        exit(0);
+    }
+
+    assert(read(go[0], buffer, 1) == 1);
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WEXITSTATUS(status) == 0);
+
+    reread("v22");
+    assert(tfs_read(held, buffer, sizeof(buffer)) == 2);
+    assert(memcmp(buffer, "22", 2) == 0);
+    assert(tfs_close(held) != -1);
+
+    /* writing through a handle from the cache writes to the file */
+    f = tfs_open("/cfg", 0);
+    assert(f != -1);
+    assert(tfs_write(f, "V", 1) == 1);
+    assert(tfs_close(f) != -1);
+    reread("V22");
+
+    /* so does appending, through a handle opened by the i-number the name
+     * was cached with */
+    f = tfs_open("/cfg", TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, "!", 1) == 1);
+    assert(tfs_close(f) != -1);
+    reread("V22!");
+
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
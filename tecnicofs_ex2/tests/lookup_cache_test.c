@@ -0,0 +1,98 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  A session reopens a file by the i-number its leases named, and is told
+    (through the recall function) when the directory or the file changes.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+int recalled[8];
+int n_recalled;
+
+void record(int session, int inumber) {
+    (void)session;
+    recalled[n_recalled++] = inumber;
+}
+
+int was_recalled(int inumber) {
+    for (int i = 0; i < n_recalled; i++) {
+        if (recalled[i] == inumber) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main() {
+    char buffer[32];
+    lease_t lease;
+
+    assert(tfs_init() != -1);
+    tfs_set_recall_function(record);
+
+    int session = tfs_session_create();
+    assert(session != -1);
+
+    int f = tfs_open_in_session(session, "/f1", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "hello", 5) == 5);
+    assert(tfs_lease(f, &lease, buffer, sizeof(buffer)) == 0);
+    assert(lease.l_size == 5 && memcmp(buffer, "hello", 5) == 0);
+    assert(tfs_close(f) != -1);
+
+    /* reopened by i-number, at an offset, and appending */
+    f = tfs_open_inumber(session, lease.l_inumber, 0, 1);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 4);
+    assert(memcmp(buffer, "ello", 4) == 0);
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open_inumber(session, lease.l_inumber, TFS_O_APPEND, 0);
+    assert(f != -1);
+    assert(tfs_write(f, "!", 1) == 1);
+    assert(tfs_close(f) != -1);
+    assert(n_recalled == 1 && was_recalled(lease.l_inumber));
+
+    /* with the contents' lease recalled, the i-node is read again */
+    f = tfs_open_inumber(session, lease.l_inumber, TFS_O_APPEND, 0);
+    assert(f != -1);
+    assert(tfs_write(f, "?", 1) == 1);
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open("/f1", 0);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 7);
+    assert(memcmp(buffer, "hello!?", 7) == 0);
+    assert(tfs_close(f) != -1);
+
+    /* creating a file changes the directory */
+    n_recalled = 0;
+    f = tfs_open("/f2", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(n_recalled == 1 && was_recalled(lease.l_dir));
+
+    /* what is not a file, or not an i-number, cannot be opened */
+    assert(tfs_open_inumber(session, lease.l_dir, 0, 0) == -1);
+    assert(tfs_open_inumber(session, -1, 0, 0) == -1);
+    assert(tfs_open_inumber(session, INODE_TABLE_SIZE, 0, 0) == -1);
+
+    /* not even while the session holds a lease on the directory, or on an
+     * i-node no longer in use */
+    f = tfs_open_in_session(session, "/f1", 0);
+    assert(f != -1);
+    assert(tfs_lease(f, &lease, buffer, sizeof(buffer)) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_open_inumber(session, ROOT_DIR_INUM, 0, 0) == -1);
+    assert(tfs_open_inumber(session, INODE_TABLE_SIZE - 1, 0, 0) == -1);
+    assert(tfs_lookup("/f1") == lease.l_inumber);
+
+    assert(tfs_session_close(session) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
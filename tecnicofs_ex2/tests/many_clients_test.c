@@ -0,0 +1,84 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* This test launches more clients than the server starts with sessions for.
+ * Half of them exit without unmounting (and with a file still open); the
+ * server must reap their sessions, closing the file, before it can shut
+ * down. */
+
+#define CLIENT_COUNT 60
+#define CLIENT_PIPE_NAME_FORMAT "/tmp/tfs_many%d"
+
+void run_test(char *server_pipe, int client_id);
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf(
+            "You must provide the following arguments: 'server_pipe_path'\n");
+        return 1;
+    }
+
+    int child_pids[CLIENT_COUNT];
+
+    for (int i = 1; i < CLIENT_COUNT; ++i) {
+        int pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            run_test(argv[1], i);
+            exit(0);
+        } else {
+            child_pids[i] = pid;
+        }
+    }
+
+    for (int i = 1; i < CLIENT_COUNT; ++i) {
+        int result;
+        waitpid(child_pids[i], &result, 0);
+        assert(WIFEXITED(result) && WEXITSTATUS(result) == 0);
+    }
+
+    char client_pipe[40];
+    sprintf(client_pipe, CLIENT_PIPE_NAME_FORMAT, 0);
+    assert(tfs_mount(client_pipe, argv[1]) == 0);
+    assert(tfs_shutdown_after_all_closed() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
+
+void run_test(char *server_pipe, int client_id) {
+    char str[40];
+    char path[40];
+    char buffer[40];
+
+    char client_pipe[40];
+    sprintf(client_pipe, CLIENT_PIPE_NAME_FORMAT, client_id);
+    sprintf(path, "/f%d", client_id % 10);
+    sprintf(str, "client %d", client_id);
+
+    assert(tfs_mount(client_pipe, server_pipe) == 0);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, str, strlen(str)) == strlen(str));
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) > 0);
+
+    if (client_id % 2 == 0) {
+        /* vanish, leaving the file open */
+        unlink(client_pipe);
+        return;
+    }
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_unmount() == 0);
+}
@@ -0,0 +1,72 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/* A client maps a file and reads it in place. Writing to the file recalls
+ * the mapping, which goes on showing the contents it was made with, until
+ * the file is mapped again. */
+
+#define SIZE 1024 /* a whole block */
+
+int main(int argc, char **argv) {
+    char data[SIZE];
+    size_t size;
+
+    if (argc < 2) {
+        printf(
+            "You must provide the following arguments: 'server_pipe_path'\n");
+        return 1;
+    }
+
+    memset(data, 'a', sizeof(data));
+
+    assert(tfs_mount("/tmp/tfs_mmap_client", argv[1]) == 0);
+
+    int f = tfs_open("/big", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, data, sizeof(data)) == sizeof(data));
+
+    char const *old = tfs_mmap(f, &size);
+    assert(old != NULL && size == sizeof(data));
+    assert(memcmp(old, data, size) == 0);
+    assert(tfs_mmap_valid(old));
+
+    /* the write goes to a copy of the mapped block */
+    assert(tfs_close(f) != -1);
+    memset(data, 'b', 10);
+    f = tfs_open("/big", 0);
+    assert(f != -1);
+    assert(tfs_write(f, data, 10) == 10);
+    assert(tfs_close(f) != -1);
+
+    assert(!tfs_mmap_valid(old));
+    assert(old[0] == 'a');
+
+    f = tfs_open("/big", 0);
+    assert(f != -1);
+    char const *new = tfs_mmap(f, &size);
+    assert(new != NULL && size == sizeof(data));
+    assert(memcmp(new, data, size) == 0);
+    assert(tfs_mmap_valid(new));
+    assert(old[0] == 'a');
+
+    assert(tfs_munmap(old) == 0);
+    assert(tfs_munmap(new) == 0);
+    assert(tfs_munmap(new) == -1);
+
+    /* empty files map too */
+    int e = tfs_open("/empty", TFS_O_CREAT);
+    assert(e != -1);
+    char const *nothing = tfs_mmap(e, &size);
+    assert(nothing != NULL && size == 0);
+    assert(tfs_munmap(nothing) == 0);
+
+    assert(tfs_close(e) != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
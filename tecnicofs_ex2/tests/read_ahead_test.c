@@ -0,0 +1,55 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Reads a file sequentially in small chunks (so that it is served from the
+    read-ahead data) while another handle overwrites part of it, and checks
+    that the reader never sees stale contents.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+#define CHUNK_SIZE 16
+
+int main() {
+    char *path = "/f1";
+    char contents[BLOCK_SIZE];
+    char buffer[CHUNK_SIZE];
+
+    assert(tfs_init() != -1);
+
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        contents[i] = (char)('a' + (i % 26));
+    }
+
+    int w = tfs_open(path, TFS_O_CREAT);
+    assert(w != -1);
+    assert(tfs_write(w, contents, BLOCK_SIZE) == BLOCK_SIZE);
+
+    int r = tfs_open(path, 0);
+    assert(r != -1);
+
+    for (int i = 0; i < BLOCK_SIZE / CHUNK_SIZE; i++) {
+        if (i == BLOCK_SIZE / CHUNK_SIZE / 2) {
+            /* overwrite the second half of the file */
+            memset(contents + BLOCK_SIZE / 2, 'Z', BLOCK_SIZE / 2);
+            assert(tfs_close(w) != -1);
+            w = tfs_open(path, 0);
+            assert(w != -1);
+            assert(tfs_write(w, contents, BLOCK_SIZE) == BLOCK_SIZE);
+        }
+        assert(tfs_read(r, buffer, CHUNK_SIZE) == CHUNK_SIZE);
+        assert(memcmp(buffer, contents + i * CHUNK_SIZE, CHUNK_SIZE) == 0);
+    }
+    assert(tfs_read(r, buffer, CHUNK_SIZE) == 0);
+
+    assert(tfs_close(r) != -1);
+    assert(tfs_close(w) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
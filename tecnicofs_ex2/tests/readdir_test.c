@@ -0,0 +1,71 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/* A client lists the root directory in batches, getting every file (with
+ * its i-number, type and size) exactly once, in one request per batch. */
+
+#define FILES 20
+#define BATCH 6
+
+int main(int argc, char **argv) {
+    char name[NAME_SIZE], data[FILES];
+    tfs_dirent_t entries[BATCH];
+    int seen[FILES] = {0};
+
+    if (argc < 2) {
+        printf(
+            "You must provide the following arguments: 'server_pipe_path'\n");
+        return 1;
+    }
+
+    memset(data, 'x', sizeof(data));
+    assert(tfs_mount("/tmp/tfs_readdir_client", argv[1]) == 0);
+
+    /* file i holds i bytes */
+    for (int i = 0; i < FILES; i++) {
+        snprintf(name, sizeof(name), "/file%d", i);
+        int f = tfs_open(name, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, data, (size_t)i) == i);
+        assert(tfs_close(f) != -1);
+    }
+
+    int cookie = 0, calls = 0, count;
+    while ((count = tfs_readdir_plus(&cookie, entries, BATCH)) > 0) {
+        calls++;
+        for (int j = 0; j < count; j++) {
+            int i;
+            assert(sscanf(entries[j].de_name, "file%d", &i) == 1);
+            assert(i >= 0 && i < FILES && !seen[i]);
+            seen[i] = 1;
+            assert(entries[j].de_type == TFS_DT_FILE);
+            assert(entries[j].de_size == (size_t)i);
+
+            snprintf(name, sizeof(name), "/file%d", i);
+            int f = tfs_open(name, 0);
+            assert(f != -1);
+            assert(tfs_close(f) != -1);
+        }
+    }
+    assert(count == 0 && cookie == -1);
+    assert(calls == (FILES + BATCH - 1) / BATCH);
+    for (int i = 0; i < FILES; i++) {
+        assert(seen[i]);
+    }
+
+    /* a cookie resumes a listing */
+    cookie = 0;
+    assert(tfs_readdir_plus(&cookie, entries, 1) == 1);
+    char first[NAME_SIZE];
+    strcpy(first, entries[0].de_name);
+    assert(tfs_readdir_plus(&cookie, entries, 1) == 1);
+    assert(strcmp(first, entries[0].de_name) != 0);
+
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Opens many more files than a fixed table would hold, over several
+    sessions, and checks that closing a session releases (and flushes) all
+    of its files at once.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+#define SESSIONS 100
+#define FILES_PER_SESSION 200
+
+int main() {
+    static int fhandles[SESSIONS][FILES_PER_SESSION];
+    int session_ids[SESSIONS];
+    char buffer[16];
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open("/f1", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_handle_session(f) == DEFAULT_SESSION);
+    assert(tfs_close(f) != -1);
+
+    for (int s = 0; s < SESSIONS; s++) {
+        session_ids[s] = tfs_session_create();
+        assert(session_ids[s] != -1);
+        for (int i = 0; i < FILES_PER_SESSION; i++) {
+            fhandles[s][i] = tfs_open_in_session(session_ids[s], "/f1", 0);
+            assert(fhandles[s][i] != -1);
+            assert(tfs_handle_session(fhandles[s][i]) == session_ids[s]);
+        }
+    }
+
+    /* a small (buffered) write, not flushed before the session closes */
+    assert(tfs_write(fhandles[0][7], "hello", 5) == 5);
+    assert(tfs_session_close(session_ids[0]) != -1);
+    assert(tfs_read(fhandles[0][7], buffer, sizeof(buffer)) == -1);
+    assert(tfs_close(fhandles[0][0]) == -1);
+
+    /* the write was flushed when the session closed */
+    assert(tfs_read(fhandles[1][0], buffer, sizeof(buffer)) == 5);
+    assert(memcmp(buffer, "hello", 5) == 0);
+
+    /* a handle closed by itself is reused by its session */
+    assert(tfs_close(fhandles[2][3]) != -1);
+    assert(tfs_open_in_session(session_ids[2], "/f1", 0) == fhandles[2][3]);
+
+    for (int s = 1; s < SESSIONS; s++) {
+        assert(tfs_session_close(session_ids[s]) != -1);
+    }
+    assert(tfs_open_in_session(session_ids[1], "/f1", 0) == -1);
+
+    /* a closed session's identifier is reused */
+    assert(tfs_session_create() == session_ids[0]);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,60 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks that files opened from a snapshot keep the contents they had when
+    it was taken, while the live file system moves on.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+int main() {
+    char buffer[40];
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open("/f1", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "old", 3) == 3);
+
+    /* the buffered write is part of the snapshot */
+    int snap = tfs_snapshot();
+    assert(snap != -1);
+
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/f1", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, "new!", 4) == 4);
+    assert(tfs_close(f) != -1);
+
+    /* created after the snapshot */
+    f = tfs_open("/f2", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+
+    int s = tfs_snapshot_open(snap, "/f1");
+    assert(s != -1);
+    assert(tfs_snapshot_open(snap, "/f2") == -1);
+    assert(tfs_write(s, "x", 1) == -1);
+    assert(tfs_read(s, buffer, sizeof(buffer)) == 3);
+    assert(memcmp(buffer, "old", 3) == 0);
+
+    f = tfs_open("/f1", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 4);
+    assert(memcmp(buffer, "new!", 4) == 0);
+    assert(tfs_close(f) != -1);
+
+    /* a snapshot with open files can't be deleted */
+    assert(tfs_snapshot_delete(snap) == -1);
+    assert(tfs_close(s) != -1);
+    assert(tfs_snapshot_delete(snap) != -1);
+    assert(tfs_snapshot_open(snap, "/f1") == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
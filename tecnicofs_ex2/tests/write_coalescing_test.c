@@ -0,0 +1,66 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks that small appends coalesced in the write-behind buffer are
+    visible to readers (through another handle), survive tfs_close and
+    are not reordered with writes made through other handles.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+#define CHUNK_SIZE 16
+
+int main() {
+    char *path = "/f1";
+    char chunk[CHUNK_SIZE];
+    char buffer[BLOCK_SIZE + 1];
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+
+    /* fill the whole block, 16 bytes at a time */
+    for (int i = 0; i < BLOCK_SIZE / CHUNK_SIZE; i++) {
+        memset(chunk, 'a' + (i % 26), CHUNK_SIZE);
+        assert(tfs_write(f, chunk, CHUNK_SIZE) == CHUNK_SIZE);
+    }
+    /* the file is full */
+    assert(tfs_write(f, chunk, CHUNK_SIZE) == 0);
+
+    /* a reader through another handle sees everything written so far */
+    int g = tfs_open(path, 0);
+    assert(g != -1);
+    assert(tfs_read(g, buffer, sizeof(buffer)) == BLOCK_SIZE);
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        assert(buffer[i] == 'a' + ((i / CHUNK_SIZE) % 26));
+    }
+    assert(tfs_close(g) != -1);
+    assert(tfs_close(f) != -1);
+
+    /* a buffered write must not overwrite a later write to the same range
+     * made through another handle */
+    f = tfs_open(path, TFS_O_TRUNC);
+    assert(f != -1);
+    g = tfs_open(path, 0);
+    assert(g != -1);
+    assert(tfs_write(f, "xxxx", 4) == 4);
+    assert(tfs_write(g, "yy", 2) == 2);
+    assert(tfs_fsync(g) != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_close(g) != -1);
+
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 4);
+    assert(memcmp(buffer, "yyxx", 4) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}